@@ -28,76 +28,225 @@
 #include <string>
 #include <cstring>
 #include <fstream>
+#include <cstdarg>
+#include <cmath>
+#include <thread>
+#include <deque>
+#include <algorithm>
+#include <ctime>
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <csignal>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/auxv.h>
+#include "../result_store/result_store.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 #define MEMSIZE 1048576
+#define HUGEPAGE 2097152 /// guest memory and tables are aligned to huge page size
 #define ASMINP "input.fasm"
 #define BININP "input.bin"
 typedef unsigned long int word;
 typedef unsigned long long int dword;
 
 /**
- * conformity between number of command and its type in {"RI", "RR", "RM", "J"}
- */
-map<word, string> TYPE = {
-        {0,  "RI"},
-        {1,  "RI"},
-        {2,  "RR"},
-        {3,  "RI"},
-        {4,  "RR"},
-        {5,  "RI"},
-        {6,  "RR"},
-        {7,  "RI"},
-        {8,  "RR"},
-        {9,  "RI"},
-        {12, "RI"},
-        {13, "RR"},
-        {14, "RI"},
-        {15, "RR"},
-        {16, "RI"},
-        {17, "RR"},
-        {18, "RI"},
-        {19, "RR"},
-        {20, "RI"},
-        {21, "RR"},
-        {22, "RI"},
-        {23, "RI"},
-        {24, "RR"},
-        {32, "RR"},
-        {33, "RR"},
-        {34, "RR"},
-        {35, "RR"},
-        {36, "RR"},
-        {37, "RR"},
-        {38, "RI"},
-        {39, "RI"},
-        {40, "RR"},
-        {41, "J"},
-        {42, "RI"},
-        {43, "RR"},
-        {44, "RI"},
-        {45, "RR"},
-        {46, "J"},
-        {47, "J"},
-        {48, "J"},
-        {49, "J"},
-        {50, "J"},
-        {51, "J"},
-        {52, "J"},
-        {64, "RM"},
-        {65, "RM"},
-        {66, "RM"},
-        {67, "RM"},
-        {68, "RR"},
-        {69, "RR"},
-        {70, "RR"},
-        {71, "RR"}
+ * formats of instructions, TYPE_NONE for unused opcodes
+ */
+enum {TYPE_NONE, TYPE_RR, TYPE_RI, TYPE_RM, TYPE_J};
+
+/**
+ * conformity between number of command and its type, constant table indexed by opcode
+ */
+const unsigned char TYPE[256] = {
+        TYPE_RI, TYPE_RI, TYPE_RR, TYPE_RI, TYPE_RR, TYPE_RI,
+        TYPE_RR, TYPE_RI, TYPE_RR, TYPE_RI, TYPE_NONE, TYPE_NONE,
+        TYPE_RI, TYPE_RR, TYPE_RI, TYPE_RR, TYPE_RI, TYPE_RR,
+        TYPE_RI, TYPE_RR, TYPE_RI, TYPE_RR, TYPE_RI, TYPE_RI,
+        TYPE_RR, TYPE_NONE, TYPE_NONE, TYPE_NONE, TYPE_NONE, TYPE_NONE,
+        TYPE_NONE, TYPE_NONE, TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR,
+        TYPE_RR, TYPE_RR, TYPE_RI, TYPE_RI, TYPE_RR, TYPE_J,
+        TYPE_RI, TYPE_RR, TYPE_RI, TYPE_RR, TYPE_J, TYPE_J,
+        TYPE_J, TYPE_J, TYPE_J, TYPE_J, TYPE_J, TYPE_NONE,
+        TYPE_NONE, TYPE_NONE, TYPE_NONE, TYPE_NONE, TYPE_NONE, TYPE_NONE,
+        TYPE_NONE, TYPE_NONE, TYPE_NONE, TYPE_NONE, TYPE_RM, TYPE_RM,
+        TYPE_RM, TYPE_RM, TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR
+};
+
+/**
+ * host open addressing hash table of guest words, linear probing with backward shift deletion
+ */
+struct guest_map {
+    vector<word> keys, values;
+    vector<char> used;
+    size_t count = 0;
+    bool live = false; /// handle is not freed
 };
 
 vector<string> input; /// asm input commands placed here
 map<string, word> label; /// map of labels - name of label as first element, number of row label start as second. Only significant rows are taken
-word mem[MEMSIZE]; /// addresses space of processor
+word *mem; /// addresses space of processor, allocated by alloc_table()
 word regs[17]; /// 16 register and 1 addictional sign register
+word image_size = 0; /// number of words assembled programm takes
+const char *source_file = ASMINP; /// asm file to assemble
+vector<guest_map> maps; /// hash maps of machine, handle is index + 1
+
+const char *share_dir = nullptr; /// registry directory of images shared between emulator processes
+int image_fd = -1; /// memfd with published image of this process
+size_t shared_bytes = 0; /// start of guest memory mapped from shared image, its pages are copied on first write
+pid_t image_owner = 0; /// process which published image
+string image_entry; /// registry file of published image
+
+int idle_ms = 0; /// compress guest memory after waiting input this long, 0 - never
+vector<vector<unsigned char>> packed; /// compressed guest pages
+vector<char> is_packed; /// 1 if guest page is compressed and unmapped till next access
+size_t packed_pages = 0, packed_bytes = 0; /// compression statistics
+
+bool lazy = false; /// assemble instructions only when execution or memory access first reaches them
+vector<int> lazy_rows; /// per address: row of input waiting to be assembled into it plus 1, 0 - nothing waits
+size_t lazy_pending = 0; /// number of instructions not assembled yet
+
+const char *snapshot_dir = nullptr; /// cache of machine snapshots taken at first input, per image
+bool input_used = false; /// machine has executed input syscall
+bool snapshot_loaded = false; /// machine was restored from snapshot
+dword snapshot_retired = 0; /// instructions executed before snapshot
+string replay_output; /// output produced before snapshot, repeated when machine is restored from it
+string prefix_output; /// output produced before first input
+
+/**
+ * result of guest clone, read by machine which joins it
+ */
+struct clone_slot {
+    dword result; /// value clone passed with syscall 112 or its exit code
+    dword retired; /// instructions executed by clone
+    int done; /// clone finished and result is set
+};
+
+typedef uint32_t limb; /// limb of multi-precision number, one per memory word
+typedef dword wide_limb; /// holds sum or product of two limbs
+const int LIMB_BITS = 32;
+const word LIMB_STEP = 1; /// address step between limbs
+const size_t KARATSUBA_LIMBS = 32; /// shorter numbers are multiplied by schoolbook method
+
+typedef word symbol; /// character of string syscalls, one per memory word
+const word SCAN_WIDTH = 4; /// symbols compared at once by scan_mask()
+const word PREFETCH_AHEAD = 16; /// elements between prefetched and accessed one of index syscalls
+
+const size_t CLONE_SLOTS = 65536; /// clones one programm run may fork
+/**
+ * shared by machine and all its clones
+ */
+struct clone_area {
+    int running; /// clones alive now
+    size_t next; /// slots handed out
+    clone_slot slot[CLONE_SLOTS];
+};
+
+clone_area *clones = nullptr; /// mapped on first guest fork
+clone_slot *clone_self = nullptr; /// slot of this machine if it is a clone
+dword clone_start = 0; /// instructions executed when this clone was forked
+map<dword, pid_t> clone_pid; /// process of every clone this machine forked, by handle
+int fork_width = -1; /// most clones running at once, number of allowed cpus by default
+
+int page_mode = 1; /// pages to back tables with: 0 - regular, 1 - transparent huge pages, 2 - hugetlbfs
+const char *mem_backing = "regular pages"; /// pages guest memory actually got
+bool stats = false; /// print execution statistics on exit
+dword retired = 0; /// number of executed instructions
+dword branches = 0; /// number of executed branch instructions
+bool perf = false; /// count host hardware events while emulating
+const char *profile = nullptr; /// file to write per label profile to, batch jobs add ".job" to it
+string profile_path; /// profile file of this run
+dword source_hash = 0; /// hash of programm source, identifies image in profiles
+dword *pc_hits = nullptr; /// executions of every instruction of image
+dword *block_hits = nullptr; /// executions of every instruction of image as first one of block
+size_t profile_size = 0; /// number of instructions in image
+bool new_block = true; /// previous instruction was branch
+dword type_hits[256]; /// executions of every instruction type, counted with profile
+const char *ab_source = nullptr; /// version B of programm, compared with version A from source_file on ab_inputs
+vector<string> ab_inputs; /// recorded inputs of A/B comparison
+const int SEQ_OPS = 72; /// instruction types counted in sequences
+vector<dword> seq_hits; /// executions of pairs, then triples of straight-line instruction types inside blocks
+int seq_last[2] = {-1, -1}; /// types of two previous straight-line instructions of block, -1 - none
+bool fuse = true; /// execute frequent instruction sequences of fused.inc in one step
+bool idioms = true; /// run fill, copy, sum and find loops found at backward branches as host bulk operations
+const char *trace_file = nullptr; /// file to record execution trace of run to
+FILE *trace_out = nullptr; /// execution trace being recorded
+const word IDIOM_MISSES = 256; /// loop heads remembered as no idiom
+word idiom_miss[IDIOM_MISSES]; /// head + 1 of loop which is no idiom, by head modulo IDIOM_MISSES
+const int PERF_COUNTERS = 5;
+const char *perf_name[PERF_COUNTERS] = {"host cycles", "host instructions", "host branch misses",
+                                        "host L1D misses", "host LLC misses"};
+int perf_fd[PERF_COUNTERS] = {-1, -1, -1, -1, -1}; /// perf_event_open counters
+long long perf_value[PERF_COUNTERS] = {-1, -1, -1, -1, -1}; /// counted events, -1 if counter is unavailable
+timespec start_time; /// moment emulation started
+
+/**
+ * job of batch mode - guest input and output files
+ */
+struct job {
+    string in, out, tenant, expected;
+};
+
+/**
+ * tenant of batch mode - jobs waiting for cpu and share of cpu in deficit round robin
+ */
+struct tenant_queue {
+    string name;
+    long long weight; /// quantums tenant gets per round
+    long long deficit; /// instructions tenant may still start slices for in this round
+    deque<size_t> queue; /// new and preempted jobs of tenant
+};
+
+/**
+ * result of batch job, written by job process to memory shared with runner
+ */
+struct job_result {
+    int done; /// 1 if machine stopped by halt or exit syscall
+    int cpu, node; /// where job was executed
+    dword retired; /// number of executed instructions
+    dword branches; /// number of executed branch instructions
+    long long perf_value[PERF_COUNTERS]; /// host hardware events, -1 if unavailable
+    long long mismatch; /// offset of first output byte differing from expected output, -1 if output matched
+};
+
+const char *batch_file = nullptr; /// jobs list for batch mode, one "input output" pair per line
+int workers = 0; /// number of jobs executed at once, 0 - one per allowed cpu
+bool no_smt = false; /// use only one hardware thread of each core
+vector<job> jobs; /// batch jobs
+job_result *results = nullptr; /// results of batch jobs, shared between runner and machines
+job_result *result = nullptr; /// result slot of current job
+dword slice = 0; /// instructions batch job runs before it is preempted at block boundary, 0 - never
+dword preempt_at = ~0ULL; /// number of executed instructions to preempt job after
+const dword HUGE_AFTER = 1000000; /// instructions one-shot run executes before its memory is advised to huge pages
+bool huge_pending = false; /// guest memory of one-shot run stays on regular pages until HUGE_AFTER instructions
+int coldstart_runs = 0; /// fresh processes to measure start of, 0 - measure nothing
+int hugebench_runs = 0; /// runs on each kind of pages to compare, 0 - compare nothing
+int coldstart_fd = -1; /// pipe to report moment of first instruction to -coldstart parent through, -1 - none
+vector<tenant_queue> tenants; /// tenants of batch mode with weights from -tenant options
+const char *expected = nullptr; /// expected output of batch job, mapped from file
+size_t expected_size = 0; /// size of expected output
+size_t out_pos = 0; /// number of bytes guest has output
+const char *store_file = nullptr; /// result store batch outputs and statuses are written to
+dword store_capacity = 64 << 20; /// bytes preallocated for outputs in result store
+result_store job_store; /// mapped result store, shared by runner and jobs
+string captured; /// output of batch job kept for result store
+const char *gen_command = nullptr; /// host command "gen_command n" printing input of size n for complexity mode
+const char *gen_template = nullptr; /// input template for complexity mode, {n} is size and {seq} n numbers
+dword ladder_from = 64, ladder_to = 4096; /// sizes of complexity mode, doubled from first to last
+int machine_cpu = 0, machine_node = 0; /// where machine of batch job was prepared
+thread prefaulter; /// idle priority thread faulting in guest memory of spare machine
+bool prefault_stop = false; /// job was handed over, prefaulter must stop before guest runs
 
 /**
  * convert doubleword to double
@@ -116,6 +265,126 @@ dword d_t_dw(double x) {
     return res;
 }
 
+/**
+ * allocate zeroed table aligned to huge page. Tries hugetlbfs pages if asked, then transparent huge pages, then regular pages
+ * \param[size] - size of table in bytes
+ * \param[kind] - if not null, kind of pages table got is written here
+ * \param[huge] - advise transparent huge pages right away, otherwise table starts on regular pages
+ */
+void *alloc_table(size_t size, const char **kind = nullptr, bool huge = true) {
+    size = (size + HUGEPAGE - 1) / HUGEPAGE * HUGEPAGE;
+    if (page_mode == 2) {
+        void *res = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (res != MAP_FAILED) {
+            if (kind) *kind = "hugetlbfs pages";
+            return res;
+        }
+    }
+    char *raw = (char *) mmap(nullptr, size + HUGEPAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    char *res = (char *) (((uintptr_t) raw + HUGEPAGE - 1) / HUGEPAGE * HUGEPAGE);
+    if (res > raw) munmap(raw, res - raw);
+    if (res < raw + HUGEPAGE) munmap(res + size, raw + HUGEPAGE - res);
+    if (kind) *kind = "regular pages";
+    if (page_mode > 0 && huge && madvise(res, size, MADV_HUGEPAGE) == 0 && kind) *kind = "transparent huge pages";
+    return res;
+}
+
+/**
+ * open disabled perf_event_open counter of this process, user space only
+ * \param[type] - perf event type
+ * \param[config] - perf event of that type
+ */
+int open_counter(unsigned int type, unsigned long long config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * read and close host counters, called on machine exit
+ */
+void stop_perf() {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (perf_fd[i] < 0) continue;
+        ioctl(perf_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd[i], &perf_value[i], sizeof(long long)) != sizeof(long long)) perf_value[i] = -1;
+        close(perf_fd[i]);
+        perf_fd[i] = -1;
+    }
+}
+
+/**
+ * start host counters of cycles, instructions, branch misses, L1D and LLC read misses. Counters kernel
+ * doesn't give stay unavailable
+ */
+void start_perf() {
+    const unsigned long long miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    perf_fd[0] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    perf_fd[1] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    perf_fd[2] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    perf_fd[3] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | miss);
+    perf_fd[4] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | miss);
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (perf_fd[i] < 0) continue;
+        ioctl(perf_fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    atexit(stop_perf);
+}
+
+/**
+ * print host counters next to guest instructions and branches
+ * \param[fp] - file to print to
+ * \param[value] - counted host events
+ * \param[instructions] - executed guest instructions
+ * \param[jumps] - executed guest branches
+ */
+void print_perf(FILE *fp, const long long *value, dword instructions, dword jumps) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (value[i] < 0) fprintf(fp, "%s: unavailable\n", perf_name[i]);
+        else fprintf(fp, "%s: %lld\n", perf_name[i], value[i]);
+    }
+    if (value[0] >= 0 && instructions > 0)
+        fprintf(fp, "host cycles per guest instruction: %.2lf\n", (double) value[0] / instructions);
+    if (value[2] >= 0 && jumps > 0)
+        fprintf(fp, "host mispredicts per guest branch: %.4lf\n", (double) value[2] / jumps);
+}
+
+/**
+ * print instructions count, speed and pages used for guest memory to stderr
+ */
+void print_stats() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fflush(stdout);
+    double time = (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9;
+    fprintf(stderr, "instructions: %llu\n", retired);
+    fprintf(stderr, "branches: %llu\n", branches);
+    fprintf(stderr, "time: %.6lf s\n", time);
+    if (time > 0) fprintf(stderr, "speed: %.2lf MIPS\n", (retired - snapshot_retired) / time / 1e6);
+    fprintf(stderr, "memory: %s\n", mem_backing);
+    if (snapshot_loaded) fprintf(stderr, "snapshot: started after %llu instructions\n", snapshot_retired);
+    if (perf) print_perf(stderr, perf_value, retired, branches);
+    if (packed_pages > 0) fprintf(stderr, "compressed: %zu pages to %zu bytes\n", packed_pages, packed_bytes);
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (fp == nullptr) return;
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+        if (strncmp(line, "AnonHugePages:", 14) == 0 || strncmp(line, "Private_Hugetlb:", 16) == 0)
+            fprintf(stderr, "%s", line);
+    fclose(fp);
+}
+
 /// masks to separate command to its part
 const word f8 = 0b11111111000000000000000000000000;
 const word s4 = 0b00000000111100000000000000000000;
@@ -154,11 +423,59 @@ word tl24(word x) {
     return (x & l24);
 }
 
+enum {TRACE_PC = 1, TRACE_REG, TRACE_MEM};
+const dword TRACE_MAGIC = 0x314352545450494d; /// "MIPTTRC1"
+const size_t TRACE_BUFFER = 65536; /// records collected before they are written
+
+/**
+ * fixed size record of execution trace. First record of trace is header with TRACE_MAGIC as kind, number of
+ * memory addresses as where and number of registers as value
+ */
+struct trace_record {
+    dword step; /// instruction which made record, counted from 1
+    dword kind; /// TRACE_PC, TRACE_REG or TRACE_MEM
+    dword where; /// pc of executed instruction, written register or memory address
+    dword value; /// executed instruction, new value of register or memory word
+};
+
+trace_record trace_buf[TRACE_BUFFER]; /// records not written to trace yet
+size_t trace_used = 0; /// number of records in trace_buf
+
+/**
+ * write collected records to trace file, called on exit
+ */
+void flush_trace() {
+    fwrite(trace_buf, sizeof(trace_record), trace_used, trace_out);
+    fflush(trace_out);
+    trace_used = 0;
+}
+
+/**
+ * add record of current instruction to trace
+ */
+void trace_put(dword kind, dword where, dword value) {
+    if (trace_used == TRACE_BUFFER) flush_trace();
+    trace_buf[trace_used++] = {retired, kind, where, value};
+}
+
+/**
+ * add n memory words from address to trace, for syscalls which write guest memory directly
+ */
+void trace_words(word adr, word n) {
+    for (word i = 0; i < n; i++) {
+        trace_put(TRACE_MEM, adr + i, mem[adr + i]);
+    }
+}
+
+void lazy_touch(word adr);
+void halt(word mod);
+
 /**
  * get value from memory
  * \param[adr] - adress to get value from it
  */
 word gmem(word adr) {
+    if (lazy_pending != 0) lazy_touch(adr);
     return mem[adr];
 }
 
@@ -168,6 +485,8 @@ word gmem(word adr) {
  * \param[val] - value to set
  */
 void smem(word adr, word val) {
+    if (lazy_pending != 0) lazy_touch(adr);
+    if (trace_out != nullptr) trace_put(TRACE_MEM, adr, val);
     mem[adr] = val;
 }
 
@@ -185,6 +504,7 @@ word greg(word adr) {
  * \param[val] - value to set
  */
 void sreg(word adr, word val) {
+    if (trace_out != nullptr && adr != 15) trace_put(TRACE_REG, adr, val);
     regs[adr] = val;
 }
 
@@ -236,9 +556,23 @@ void bin_input() {
  * Get assembler code from asm file and (!) write it to input vector
  */
 void file_input() {
-    string temp, temp1, temp2;
-    ifstream fin(ASMINP);
-    while (getline(fin, temp, '\n')) {
+    string text, temp, temp1, temp2;
+    int fd = open(source_file, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        text.resize(st.st_size);
+        ssize_t got = 0;
+        for (size_t done = 0; done < text.size(); done += got)
+            if ((got = read(fd, &text[done], text.size() - done)) <= 0) {
+                text.resize(done);
+                break;
+            }
+    }
+    if (fd >= 0) close(fd);
+    for (size_t from = 0, to; from < text.size(); from = to + 1) {
+        to = text.find('\n', from);
+        if (to == string::npos) to = text.size();
+        temp = text.substr(from, to - from);
         temp = temp.substr(0, temp.find(';'));
         if (temp.find(':') != string::npos) {
             temp1 = temp.substr(0, temp.find(':') + 1);
@@ -250,7 +584,6 @@ void file_input() {
         while (temp.length() > 0 && (temp[0] == ' ' || temp[0] == '\t')) temp.erase(0, 1);
         if (temp.length() > 0) input.push_back(temp);
     }
-    fin.close();
 }
 
 /**
@@ -300,7 +633,7 @@ void parse_labels() {
  * \param[lexemes] - command splitted by split function
  */
 word make_comm(vector<string> &lexemes) {
-    const map<string, word> CODE = {
+    static const map<string, word> CODE = {
             {"halt",    0},
             {"syscall", 1},
             {"add",     2},
@@ -355,13 +688,13 @@ word make_comm(vector<string> &lexemes) {
             {"storer2", 71}
     };
     word coded = CODE.at(lexemes[0]) << 24;
-    if (TYPE.at(coded >> 24) == "RM") {
+    if (TYPE[coded >> 24] == TYPE_RM) {
         string reg_str = lexemes[1].substr(1, lexemes[1].length() - 1);
         string mod_str = lexemes[2];
         word reg = ((word) strtol(reg_str.c_str(), nullptr, 10)) << 20;
         word mod = (word) strtol(mod_str.c_str(), nullptr, 10);
         coded += reg + mod;
-    } else if (TYPE.at(coded >> 24) == "RR") {
+    } else if (TYPE[coded >> 24] == TYPE_RR) {
         string reg1_str = lexemes[1].substr(1, lexemes[1].length() - 1);
         string reg2_str = lexemes[2].substr(1, lexemes[2].length() - 1);
         string mod_str = lexemes[3];
@@ -369,7 +702,7 @@ word make_comm(vector<string> &lexemes) {
         word reg2 = ((word) strtol(reg2_str.c_str(), nullptr, 10)) << 16;
         word mod = ((word) strtol(mod_str.c_str(), nullptr, 10));
         coded += reg1 + reg2 + mod;
-    } else if (TYPE.at(coded >> 24) == "RI") {
+    } else if (TYPE[coded >> 24] == TYPE_RI) {
         string reg_str = "0";
         if (coded >> 24 != 42) reg_str = lexemes[1].substr(1, lexemes[1].length() - 1);
         string mod_str = lexemes[1];
@@ -379,7 +712,7 @@ word make_comm(vector<string> &lexemes) {
         else mod = ((word) strtol(mod_str.c_str(), nullptr, 10));
         word reg = ((word) strtol(reg_str.c_str(), nullptr, 10)) << 20;
         coded += reg + mod;
-    } else if (TYPE.at(coded >> 24) == "J") {
+    } else if (TYPE[coded >> 24] == TYPE_J) {
         word mod;
         if (label.find(lexemes[1]) != label.end()) mod = label[lexemes[1]];
         else mod = ((word) strtol(lexemes[1].c_str(), nullptr, 10));
@@ -388,534 +721,3138 @@ word make_comm(vector<string> &lexemes) {
     return coded;
 }
 
+enum {ROW_CODE, ROW_DATA, ROW_END};
+
+/**
+ * assemble row which is not an instruction, shared by assemble() and lazy_assemble(): place word or double
+ * at pc and move pc past it, or set start address for end row
+ * \param[splited] - row splitted by split function
+ * \param[pc] - address of row
+ * \return ROW_DATA or ROW_END, ROW_CODE if row is instruction and nothing was done
+ */
+int assemble_data(const vector<string> &splited, word &pc) {
+    if (splited[0] == "end") {
+        sreg(15, label[splited[1]]);
+        return ROW_END;
+    } else if (splited[0] == "word") {
+        smem(pc, (word) strtol(splited[1].c_str(), nullptr, 10));
+    } else if (splited[0] == "double") {
+        double temp = strtod(splited[1].c_str(), nullptr);
+        dword tmp;
+        memcpy(&tmp, &temp, 8);
+        smem(pc, (tmp << 32) >> 32);
+        smem(pc + 1, tmp >> 32);
+    } else return ROW_CODE;
+    pc++;
+    return ROW_DATA;
+}
+
 /**
  * write prepared command to memory
  */
 void assemble() {
     word pc = 0;
     parse_labels();
-    for (int i = 0; i < input.size(); i++) {
+    for (size_t i = 0; i < input.size(); i++) {
         vector<string> splited = split(input[i]);
-        if (splited[0] == "end") {
-            sreg(15, label[splited[1]]);
-            break;
-        } else if (splited[0] == "word") {
-            smem(pc, (word) strtol(splited[1].c_str(), nullptr, 10));
-            pc++;
-        } else if (splited[0] == "double") {
-            double temp = strtod(splited[1].c_str(), nullptr);
-            dword tmp;
-            memcpy(&tmp, &temp, 8);
-            smem(pc, (tmp << 32) >> 32);
-            smem(pc + 1, tmp >> 32);
-            pc++;
-        } else {
+        int kind = assemble_data(splited, pc);
+        if (kind == ROW_END) break;
+        if (kind == ROW_CODE) {
             smem(pc, make_comm(splited));
             pc++;
         }
     }
+    image_size = pc + 1;
     sreg(14, MEMSIZE-1);
 }
 
-/// every functions here emulate processor command. See processor doc to get information
-
-void halt(word mod) {
-    exit((int) mod);
+/**
+ * lazy mode: assemble instruction at address if it still waits
+ * \param[adr] - address being read or written
+ */
+void lazy_touch(word adr) {
+    if (adr >= lazy_rows.size() || lazy_rows[adr] == 0) return;
+    vector<string> splited = split(input[lazy_rows[adr] - 1]);
+    lazy_rows[adr] = 0;
+    lazy_pending--;
+    mem[adr] = make_comm(splited);
 }
 
-void syscall(word reg, word arg) {
-    switch (arg) {
-        case 0:
-            exit(0);
-        case 100:
-            int scanning_int;
-            scanf("%d", &scanning_int);
-            sreg(reg, scanning_int);
-            break;
-        case 101:
-            double ddi;
-            scanf("%lf", &ddi);
-            dword dwi;
-            dwi = d_t_dw(ddi);
-            sreg(reg, (dwi << 32) >> 32);
-            sreg(reg + 1, dwi >> 32);
-            break;
-        case 102:
-            int sending_int;
-            sending_int = (int) greg(reg);
-            printf("%d", sending_int);
-            break;
-        case 103:
-            dword dwo;
-            dwo = (greg(reg) + (greg(reg + 1) << 32));
-            double ddo;
-            ddo = dw_t_d(dwo);
-            printf("%lg", ddo);
-            break;
-        case 104:
-            char scanning_char;
-            scanf("%c", &scanning_char);
-            sreg(reg, scanning_char);
-            break;
-        case 105:
-            char sending_char;
-            sending_char = (char) greg(reg);
-            printf("%c", sending_char);
-            break;
+/**
+ * lazy mode: only find labels, place data and start address. Every instruction is assembled by lazy_touch()
+ * on first access to its address
+ */
+void lazy_assemble() {
+    word pc = 0;
+    parse_labels();
+    lazy_rows.assign(input.size(), 0);
+    for (size_t i = 0; i < input.size(); i++) {
+        int kind = assemble_data(split(input[i]), pc);
+        if (kind == ROW_END) break;
+        if (kind == ROW_CODE) {
+            lazy_rows[pc] = i + 1;
+            lazy_pending++;
+            pc++;
+        }
     }
+    image_size = pc + 1;
+    sreg(14, MEMSIZE-1);
 }
 
-void add(word r1, word r2, word mod) {
-    sreg(r1, greg(r1) + greg(r2) + mod);
-}
-
-void addi(word r1, word mod) {
-    sreg(r1, greg(r1) + mod);
-}
-
-void sub(word r1, word r2, word mod) {
-    sreg(r1, greg(r1) - greg(r2) - mod);
-}
-
-void subi(word r1 , word mod) {
-    sreg(r1, greg(r1) - mod);
-}
-
-void mul(word r1, word r2) {
-    dword res = greg(r1) * greg(r2);
-    sreg(r1, (res << 32) >> 32);
-    sreg(r1 + 1, res >> 32);
+/**
+ * lazy mode: assemble every waiting instruction, when whole image is needed
+ */
+void lazy_finish() {
+    for (word adr = 0; lazy_pending != 0 && adr < lazy_rows.size(); adr++) lazy_touch(adr);
 }
 
-void muli(word r1, word mod) {
-    dword res = greg(r1) * mod;
-    sreg(r1, (res << 32) >> 32);
-    sreg(r1 + 1, res >> 32);
+/**
+ * FNV-1a hash of programm source, names image in registry
+ */
+dword image_hash() {
+    dword hash = 14695981039346656037ULL;
+    for (const string &row : input) {
+        for (char c : row) hash = (hash ^ (unsigned char) c) * 1099511628211ULL;
+        hash = (hash ^ '\n') * 1099511628211ULL;
+    }
+    return hash;
 }
 
-void div(word r1, word r2) {
-    dword fir = (greg(r1 + 1) << 32) + greg(r1);
-    word di = fir / greg(r2);
-    word re = fir % greg(r2);
-    sreg(r1, di);
-    sreg(r1 + 1, re);
+/**
+ * path to registry entry of image - file with "pid fd size pc" of process holding image memfd
+ */
+string image_path() {
+    char name[64];
+    snprintf(name, sizeof(name), "/mipt32-%016llx", image_hash());
+    return string(share_dir) + name;
 }
 
-void divi(word r1, word mod) {
-    dword big = (greg(r1 + 1) << 32) + greg(r1);
-    word di = big / mod;
-    word re = big % mod;
-    sreg(r1, di);
-    sreg(r1 + 1, re);
+/**
+ * map image published by other process over guest memory. Pages are shared with every process mapping it
+ * until guest writes to them. Memfd must hold source hash after the image: pid and fd of registry entry may
+ * belong to other process by now
+ * \return true if image was found and mapped
+ */
+bool map_shared_image() {
+    image_entry = image_path();
+    FILE *fp = fopen(image_entry.c_str(), "r");
+    if (fp == nullptr) return false;
+    int pid = 0, fd = 0;
+    dword size = 0, pc = 0;
+    int got = fscanf(fp, "%d %d %llu %llu", &pid, &fd, &size, &pc);
+    fclose(fp);
+    if (got != 4 || size == 0 || size > MEMSIZE * sizeof(word)) return false;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", pid, fd);
+    int image = open(path, O_RDONLY | O_CLOEXEC);
+    if (image < 0) return false;
+    struct stat st;
+    int seals = fcntl(image, F_GET_SEALS);
+    int need = F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW;
+    dword pages = (size + 4095) / 4096 * 4096, hash = 0;
+    if (fstat(image, &st) != 0 || (dword) st.st_size != pages + 8 || seals < 0 || (seals & need) != need ||
+        pread(image, &hash, 8, pages) != 8 || hash != source_hash) {
+        close(image);
+        return false;
+    }
+    void *res = mmap(mem, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image, 0);
+    close(image);
+    if (res == MAP_FAILED) return false;
+    shared_bytes = pages;
+    parse_labels();
+    image_size = size / sizeof(word);
+    sreg(15, pc);
+    sreg(14, MEMSIZE - 1);
+    return true;
 }
 
-void lc(word r1, word mod) {
-    sreg(r1, mod);
+/**
+ * remove registry entry of image on exit of publishing process
+ */
+void unpublish_image() {
+    if (getpid() == image_owner) unlink(image_entry.c_str());
 }
 
-void shl(word r1, word r2) {
-    sreg(r1, greg(r1) << greg(r2));
+/**
+ * copy assembled image to sealed memfd, map it back as guest memory and register it for other processes.
+ * Registry entry name is taken by map_shared_image() before assembling changes input. Source hash follows
+ * the page aligned image in memfd
+ */
+void publish_image() {
+    size_t size = (image_size * sizeof(word) + 4095) / 4096 * 4096;
+    image_fd = memfd_create("mipt32-image", MFD_ALLOW_SEALING);
+    if (image_fd < 0) return;
+    if (ftruncate(image_fd, size + 8) != 0 || write(image_fd, mem, size) != (ssize_t) size ||
+        write(image_fd, &source_hash, 8) != 8 || fcntl(image_fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        close(image_fd);
+        image_fd = -1;
+        return;
+    }
+    if (mmap(mem, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image_fd, 0) != MAP_FAILED) shared_bytes = size;
+    string temp = image_entry + ".tmp" + to_string(getpid());
+    FILE *fp = fopen(temp.c_str(), "w");
+    if (fp == nullptr) return;
+    fprintf(fp, "%d %d %llu %llu\n", getpid(), image_fd, (dword) image_size * sizeof(word), (dword) greg(15));
+    fclose(fp);
+    if (rename(temp.c_str(), image_entry.c_str()) != 0) return;
+    image_owner = getpid();
+    atexit(unpublish_image);
 }
 
-void shli(word r1, word mod) {
-    sreg(r1, greg(r1) << mod);
+/**
+ * write length of lz sequence part exceeding token nibble
+ */
+void lz_put_len(vector<unsigned char> &out, size_t len) {
+    while (len >= 255) {
+        out.push_back(255);
+        len -= 255;
+    }
+    out.push_back(len);
 }
 
-void shr(word r1, word r2) {
-    sreg(r1, greg(r1) >> greg(r2));
+/**
+ * compress bytes with lz77 codec: sequences of token (literals and match length nibbles),
+ * literals, 2 bytes match offset
+ * \param[src] - bytes to compress
+ * \param[n] - number of bytes, at most 65535
+ * \param[out] - compressed bytes
+ */
+void lz_compress(const unsigned char *src, size_t n, vector<unsigned char> &out) {
+    out.clear();
+    unsigned short table[4096] = {0};
+    size_t anchor = 0, i = 0;
+    while (i + 4 <= n) {
+        uint32_t seq;
+        memcpy(&seq, src + i, 4);
+        size_t h = (seq * 2654435761u) >> 20;
+        size_t cand = table[h];
+        table[h] = i + 1;
+        if (cand == 0 || memcmp(src + cand - 1, src + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        size_t m = cand - 1, len = 4, lit = i - anchor;
+        while (i + len < n && src[m + len] == src[i + len]) len++;
+        out.push_back((min(lit, (size_t) 15) << 4) | min(len - 4, (size_t) 15));
+        if (lit >= 15) lz_put_len(out, lit - 15);
+        out.insert(out.end(), src + anchor, src + i);
+        out.push_back((i - m) & 255);
+        out.push_back((i - m) >> 8);
+        if (len - 4 >= 15) lz_put_len(out, len - 4 - 15);
+        i += len;
+        anchor = i;
+    }
+    size_t lit = n - anchor;
+    out.push_back(min(lit, (size_t) 15) << 4);
+    if (lit >= 15) lz_put_len(out, lit - 15);
+    out.insert(out.end(), src + anchor, src + n);
 }
 
-void shri(word r1, word mod) {
-    sreg(r1, greg(r1) >> mod);
+/**
+ * decompress bytes compressed by lz_compress
+ * \param[src] - compressed bytes
+ * \param[dst] - place for n decompressed bytes
+ */
+void lz_decompress(const unsigned char *src, unsigned char *dst, size_t n) {
+    size_t o = 0, p = 0;
+    while (o < n) {
+        size_t token = src[p++], lit = token >> 4, len = token & 15;
+        if (lit == 15) {
+            while (src[p++] == 255) lit += 255;
+            lit += src[p - 1];
+        }
+        memcpy(dst + o, src + p, lit);
+        o += lit;
+        p += lit;
+        if (o >= n) break;
+        size_t off = src[p] + (src[p + 1] << 8);
+        p += 2;
+        if (len == 15) {
+            while (src[p++] == 255) len += 255;
+            len += src[p - 1];
+        }
+        len += 4;
+        for (size_t k = 0; k < len; k++) dst[o + k] = dst[o - off + k];
+        o += len;
+    }
 }
 
-void and1(word r1, word r2) {
-    sreg(r1, greg(r1) & greg(r2));
+/**
+ * decompress guest page on first access after machine was idle
+ */
+void unpack_page(int sig, siginfo_t *info, void *) {
+    char *adr = (char *) info->si_addr, *begin = (char *) mem;
+    if (adr >= begin && adr < begin + MEMSIZE * sizeof(word) && is_packed[(adr - begin) / 4096]) {
+        size_t page = (adr - begin) / 4096;
+        mprotect(begin + page * 4096, 4096, PROT_READ | PROT_WRITE);
+        lz_decompress(packed[page].data(), (unsigned char *) begin + page * 4096, 4096);
+        is_packed[page] = 0;
+        return;
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
-void andi(word r1, word mod) {
-    sreg(r1, greg(r1) & mod);
+/**
+ * compress resident guest pages of idle machine and give their memory back to system.
+ * Pages are protected, so next access decompresses them in unpack_page()
+ */
+void pack_memory() {
+    size_t pages = MEMSIZE * sizeof(word) / 4096;
+    if (is_packed.empty()) {
+        is_packed.assign(pages, 0);
+        packed.resize(pages);
+        struct sigaction sa = {};
+        sa.sa_sigaction = unpack_page;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigaction(SIGSEGV, &sa, nullptr);
+    }
+    vector<unsigned char> resident(pages);
+    if (mincore(mem, MEMSIZE * sizeof(word), resident.data()) != 0) return;
+    char *begin = (char *) mem;
+    for (size_t i = 0; i < pages; i++) {
+        if (is_packed[i]) continue;
+        if (!(resident[i] & 1)) {
+            vector<unsigned char>().swap(packed[i]);
+            continue;
+        }
+        lz_compress((unsigned char *) begin + i * 4096, 4096, packed[i]);
+        packed[i].shrink_to_fit();
+        madvise(begin + i * 4096, 4096, MADV_DONTNEED);
+        mprotect(begin + i * 4096, 4096, PROT_NONE);
+        is_packed[i] = 1;
+        packed_pages++;
+        packed_bytes += packed[i].size();
+    }
 }
 
-void or1(word r1, word r2) {
-    sreg(r1, greg(r1) | greg(r2));
+/**
+ * called before input syscall: if no input comes in idle_ms, compress machine memory while waiting
+ */
+void wait_input() {
+    if (idle_ms <= 0) return;
+#ifdef __GLIBC__
+    if (stdin->_IO_read_ptr < stdin->_IO_read_end) return;
+#endif
+    pollfd fd = {fileno(stdin), POLLIN, 0};
+    if (poll(&fd, 1, idle_ms) == 0) pack_memory();
 }
 
-void ori(word r1, word mod) {
-    sreg(r1, greg(r1) | mod);
+/**
+ * write guest output. For batch job with expected output, machine stops on first byte differing from it
+ * or going past its end
+ * \param[buf] - bytes to output
+ * \param[n] - number of bytes
+ */
+void put_output(const char *buf, size_t n) {
+    if (expected != nullptr && (out_pos + n > expected_size || memcmp(buf, expected + out_pos, n) != 0)) {
+        size_t same = 0;
+        while (same < n && out_pos + same < expected_size && buf[same] == expected[out_pos + same]) same++;
+        if (job_store.base != nullptr) captured.append(buf, same);
+        else fwrite(buf, 1, same, stdout);
+        out_pos += same;
+        result->mismatch = (long long) out_pos;
+        halt(1);
+    }
+    if (snapshot_dir != nullptr && !input_used) prefix_output.append(buf, n);
+    if (job_store.base != nullptr) captured.append(buf, n);
+    else fwrite(buf, 1, n, stdout);
+    out_pos += n;
 }
 
-void xor1(word r1, word r2) {
-    sreg(r1, greg(r1) ^ greg(r2));
+/**
+ * printf for guest output syscalls
+ */
+void guest_printf(const char *format, ...) {
+    char buf[64];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    put_output(buf, min(n, (int) sizeof(buf) - 1));
 }
 
-void xori(word r1, word mod) {
-    sreg(r1, greg(r1) ^ mod);
+/**
+ * instruction may be part of fused sequence - it neither branches nor calls system
+ * \param[row] - instruction
+ */
+bool fusable(word row) {
+    word type = tf8(row);
+    return type > 1 && type < SEQ_OPS && !((type >= 40 && type <= 42) || (type >= 46 && type <= 52));
 }
 
-void not1(word r1) {
-    sreg(r1, ~greg(r1));
+/**
+ * collect profile of instruction before it executes
+ * \param[pc] - address of instruction
+ * \param[row] - instruction
+ */
+void profile_step(word pc, word row) {
+    size_t i = pc;
+    if (i >= profile_size) return;
+    pc_hits[i]++;
+    if (new_block) block_hits[i]++;
+    type_hits[tf8(row)]++;
+    if (new_block || !fusable(row)) seq_last[0] = seq_last[1] = -1;
+    if (!fusable(row)) return;
+    int type = tf8(row);
+    if (seq_last[1] >= 0) seq_hits[seq_last[1] * SEQ_OPS + type]++;
+    if (seq_last[0] >= 0) seq_hits[SEQ_OPS * SEQ_OPS + (seq_last[0] * SEQ_OPS + seq_last[1]) * SEQ_OPS + type]++;
+    seq_last[0] = seq_last[1];
+    seq_last[1] = type;
 }
 
-void mov(word r1, word r2, word mod) {
-    sreg(r1, greg(r2) + mod);
+/**
+ * modelled cost of instruction type in cycles of simple in-order pipeline, compares programm versions
+ * \param[type] - type of instruction
+ */
+dword cycle_cost(word type) {
+    switch (type) {
+        case 1:
+            return 50;
+        case 8:
+        case 9:
+        case 35:
+            return 20;
+        case 32:
+        case 33:
+        case 34:
+        case 36:
+        case 37:
+        case 45:
+            return 4;
+        case 6:
+        case 7:
+        case 66:
+        case 67:
+        case 69:
+        case 71:
+            return 3;
+        case 38:
+        case 39:
+        case 40:
+        case 41:
+        case 42:
+        case 46:
+        case 47:
+        case 48:
+        case 49:
+        case 50:
+        case 51:
+        case 52:
+        case 64:
+        case 65:
+        case 68:
+        case 70:
+            return 2;
+        default:
+            return 1;
+    }
 }
 
-void addd(word r1, word r2) {
-    dword mul1 = (greg(r1 + 1) << 32) + greg(r1);
-    dword mul2 = (greg(r2 + 1) << 32) + greg(r2);
-    double mu1 = dw_t_d(mul1), mu2 = dw_t_d(mul2);
-    dword res = d_t_dw(mu1+mu2);
-    sreg(r1, (res << 32) >> 32);
-    sreg(r1 + 1, res >> 32);
+/**
+ * number of guest memory pages with nonzero contents, pages never faulted in are skipped
+ */
+dword touched_pages() {
+    size_t size = MEMSIZE * sizeof(word), pages = size / 4096;
+    vector<unsigned char> resident(pages);
+    if (mincore(mem, size, resident.data()) != 0) return 0;
+    static const char zero[4096] = {0};
+    dword res = 0;
+    for (size_t i = 0; i < pages; i++)
+        if ((resident[i] & 1) && memcmp((char *) mem + i * 4096, zero, 4096) != 0) res++;
+    return res;
 }
 
-void subd(word r1, word r2) {
-    dword mul1 = (greg(r1 + 1) << 32) + greg(r1);
-    dword mul2 = (greg(r2 + 1) << 32) + greg(r2);
-    double mu1 = dw_t_d(mul1), mu2 = dw_t_d(mul2);
-    dword res = d_t_dw(mu1-mu2);
-    sreg(r1, (res << 32) >> 32);
-    sreg(r1 + 1, res >> 32);
+/**
+ * write profile of run - image hash, executed instructions, syscalls, modelled cycles, touched pages, per label
+ * instructions and blocks and executions of instruction type sequences. Instruction belongs to the closest label above it
+ */
+void write_profile() {
+    vector<pair<size_t, string>> starts;
+    for (auto &l : label) starts.push_back({l.second, l.first});
+    sort(starts.begin(), starts.end());
+    vector<dword> ins(starts.size() + 1, 0), blocks(starts.size() + 1, 0);
+    size_t k = 0;
+    for (size_t i = 0; i < profile_size; i++) {
+        while (k < starts.size() && starts[k].first <= i) k++;
+        ins[k] += pc_hits[i];
+        blocks[k] += block_hits[i];
+    }
+    FILE *fp = fopen(profile_path.c_str(), "w");
+    if (fp == nullptr) {
+        perror(profile_path.c_str());
+        return;
+    }
+    fprintf(fp, "image %016llx\n", source_hash);
+    fprintf(fp, "instructions %llu\n", retired);
+    dword cycles = 0;
+    for (int t = 0; t < 256; t++) cycles += type_hits[t] * cycle_cost(t);
+    fprintf(fp, "syscalls %llu\n", type_hits[1]);
+    fprintf(fp, "cycles %llu\n", cycles);
+    fprintf(fp, "touched %llu\n", touched_pages());
+    if (ins[0] > 0) fprintf(fp, "label <none> %llu %llu\n", ins[0], blocks[0]);
+    for (size_t i = 0; i < starts.size(); i++)
+        fprintf(fp, "label %s %llu %llu\n", starts[i].second.c_str(), ins[i + 1], blocks[i + 1]);
+    for (size_t i = 0; i < seq_hits.size(); i++) {
+        if (seq_hits[i] == 0) continue;
+        size_t j = i - SEQ_OPS * SEQ_OPS;
+        if (i < SEQ_OPS * SEQ_OPS) fprintf(fp, "seq %zu+%zu %llu\n", i / SEQ_OPS, i % SEQ_OPS, seq_hits[i]);
+        else fprintf(fp, "seq %zu+%zu+%zu %llu\n", j / SEQ_OPS / SEQ_OPS, j / SEQ_OPS % SEQ_OPS, j % SEQ_OPS, seq_hits[i]);
+    }
+    fclose(fp);
 }
 
-void muld(word r1, word r2) {
-    dword mul1 = (greg(r1 + 1) << 32) + greg(r1);
-    dword mul2 = (greg(r2 + 1) << 32) + greg(r2);
-    double mu1 = dw_t_d(mul1), mu2 = dw_t_d(mul2);
-    dword res = d_t_dw(mu1*mu2);
-    sreg(r1, (res << 32) >> 32);
-    sreg(r1 + 1, res >> 32);
+/**
+ * allocate profile tables for assembled image. Fusion is off, so every instruction is counted
+ */
+void start_profile() {
+    profile_size = image_size;
+    pc_hits = (dword *) alloc_table(profile_size * sizeof(dword));
+    block_hits = (dword *) alloc_table(profile_size * sizeof(dword));
+    seq_hits.assign(SEQ_OPS * SEQ_OPS + SEQ_OPS * SEQ_OPS * SEQ_OPS, 0);
+    fuse = false;
+    idioms = false;
+    profile_path = profile;
 }
 
-void divd(word r1, word r2) {
-    dword mul1 = (greg(r1 + 1) << 32) + greg(r1);
-    dword mul2 = (greg(r2 + 1) << 32) + greg(r2);
-    double mu1 = dw_t_d(mul1), mu2 = dw_t_d(mul2);
-    dword res = d_t_dw(mu1/mu2);
-    sreg(r1, (res << 32) >> 32);
-    sreg(r1 + 1, res >> 32);
+/**
+ * snapshot file of image in snapshot cache
+ */
+string snapshot_path() {
+    char name[64];
+    snprintf(name, sizeof(name), "/mipt32-%016llx.snap", source_hash);
+    return string(snapshot_dir) + name;
 }
 
-void itod(word r1, word r2) {
-    dword res;
-    double sour = greg(r2); /////////////////////////////////////////////////////////////why???
-    memcpy(&res, &sour, 8);
-    sreg(r1, (res << 32) >> 32);
-    sreg(r1 + 1, res >> 32);
+/**
+ * called before input syscall: on first input, when no input is consumed yet, save machine to snapshot cache -
+ * registers, nonzero memory pages, counters and output produced so far. Machine that has forked clones takes
+ * no snapshot: their handles, output and instructions can't be restored
+ */
+void take_snapshot() {
+    if (snapshot_dir == nullptr || input_used) return;
+    input_used = true;
+    if (snapshot_loaded || !maps.empty() || clones != nullptr) return;
+    string path = snapshot_path();
+    if (access(path.c_str(), F_OK) == 0) return;
+    lazy_finish();
+    string temp = path + ".tmp" + to_string(getpid());
+    FILE *fp = fopen(temp.c_str(), "wb");
+    if (fp == nullptr) return;
+    dword head[6] = {0x50414e5354504d49ULL, source_hash, retired - 1, branches, image_size, prefix_output.size()};
+    fwrite(head, sizeof(head), 1, fp);
+    fwrite(regs, sizeof(regs), 1, fp);
+    fwrite(prefix_output.data(), 1, prefix_output.size(), fp);
+    const char *begin = (const char *) mem;
+    static const char zero[4096] = {0};
+    for (uint32_t page = 0; page < MEMSIZE * sizeof(word) / 4096; page++) {
+        if (memcmp(begin + page * 4096, zero, 4096) == 0) continue;
+        fwrite(&page, sizeof(page), 1, fp);
+        fwrite(begin + page * 4096, 1, 4096, fp);
+    }
+    bool ok = ferror(fp) == 0;
+    if (fclose(fp) == 0 && ok && rename(temp.c_str(), path.c_str()) == 0) return;
+    unlink(temp.c_str());
 }
 
-void dtoi(word r1, word r2) {
-    dword sour = (greg(r2 + 1) << 32) + greg(r2);
-    double res;
-    memcpy(&res, &sour, 8);
-    word re = res;
-    sreg(r1, re);
+/**
+ * restore machine from snapshot of image instead of assembling it and executing instructions before first input
+ * \return true if snapshot was found
+ */
+bool load_snapshot() {
+    FILE *fp = fopen(snapshot_path().c_str(), "rb");
+    if (fp == nullptr) return false;
+    dword head[6];
+    word saved[17];
+    if (fread(head, sizeof(head), 1, fp) != 1 || head[0] != 0x50414e5354504d49ULL || head[1] != source_hash ||
+        fread(saved, sizeof(saved), 1, fp) != 1) {
+        fclose(fp);
+        return false;
+    }
+    string output(head[5], 0);
+    if (fread(&output[0], 1, head[5], fp) != head[5]) {
+        fclose(fp);
+        return false;
+    }
+    char *begin = (char *) mem;
+    uint32_t page;
+    while (fread(&page, sizeof(page), 1, fp) == 1 && page < MEMSIZE * sizeof(word) / 4096)
+        if (fread(begin + page * 4096, 1, 4096, fp) != 4096) break;
+    fclose(fp);
+    memcpy(regs, saved, sizeof(regs));
+    parse_labels();
+    retired = snapshot_retired = head[2];
+    branches = head[3];
+    image_size = head[4];
+    replay_output = output;
+    snapshot_loaded = true;
+    return true;
 }
 
-void push(word r1, word mod) {
-    push_stack(greg(r1) + mod);
+/**
+ * guest fork: clone machine copy-on-write into new process, it shares code image and continues after syscall
+ * \return handle of clone in machine, 0 in clone, -1 if every worker is busy and machine should go on alone.
+ * Batch jobs get -1: their output is checked and stored by the job process only
+ */
+word guest_fork() {
+    if (result != nullptr) return -1;
+    if (clones == nullptr) {
+        void *area = mmap(nullptr, sizeof(clone_area), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (area == MAP_FAILED) return -1;
+        clones = (clone_area *) area;
+        cpu_set_t set;
+        if (fork_width < 0) fork_width = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 1;
+    }
+    if (__atomic_add_fetch(&clones->running, 1, __ATOMIC_SEQ_CST) > fork_width) {
+        __atomic_sub_fetch(&clones->running, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    size_t id = __atomic_fetch_add(&clones->next, 1, __ATOMIC_SEQ_CST);
+    fflush(stdout);
+    pid_t pid = id < CLONE_SLOTS ? fork() : -1;
+    if (pid < 0) {
+        __atomic_sub_fetch(&clones->running, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    if (pid == 0) {
+        clone_self = clones->slot + id;
+        clone_start = retired;
+        clone_pid.clear();
+        preempt_at = ~0ULL;
+        return 0;
+    }
+    clone_pid[id + 1] = pid;
+    return id + 1;
 }
 
-void pop(word r1, word mod) {
-    sreg(r1, pop_stack() + mod);
+/**
+ * stop clone machine: pass result to machine which joins it and exit without exit handlers of forking machine
+ * \param[value] - result
+ */
+void finish_clone(dword value) {
+    clone_self->result = value;
+    clone_self->retired = retired - clone_start;
+    __atomic_store_n(&clone_self->done, 1, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&clones->running, 1, __ATOMIC_SEQ_CST);
+    fflush(stdout);
+    _exit(0);
 }
 
-void call(word r1, word r2, word mod) {
-    push_stack(greg(15)+1);
-    sreg(15, greg(r2)+mod-1);
-    sreg(r1, greg(14));
+/**
+ * wait for clone forked by this machine and take its result, instructions it executed are added to this machine
+ * \param[handle] - handle returned by guest fork
+ * \return result of clone, -1 if handle is unknown or clone crashed
+ */
+word guest_join(word handle) {
+    auto it = clone_pid.find(handle);
+    if (it == clone_pid.end()) return -1;
+    waitpid(it->second, nullptr, 0);
+    clone_pid.erase(it);
+    clone_slot &slot = clones->slot[handle - 1];
+    if (!slot.done) {
+        __atomic_sub_fetch(&clones->running, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    retired += slot.retired;
+    return slot.result;
 }
 
-void calli(word tail) {
-    push_stack(greg(15)+1);
-    sreg(15, tail - 1);
-}
+/// every functions here emulate processor command. See processor doc to get information
 
-void ret(word mod) {
-    sreg(15, pop_stack(mod + 1)-1);
+void halt(word mod) {
+    if (clone_self != nullptr) finish_clone(mod);
+    exit((int) mod);
 }
 
-void cmp(word r1, word r2) {
-    if (greg(r1) == greg(r2)) sreg(16, 0);
-    else if (greg(r1) < greg(r2)) sreg(16, 1);
-    else sreg(16, 2);
+/**
+ * stop machine if n memory words from address don't fit in guest memory
+ * \param[adr] - address of first word
+ * \param[n] - number of words
+ */
+void range_check(word adr, word n) {
+    if (n > MEMSIZE || adr > MEMSIZE - n) halt(139);
 }
 
-void cmpi(word r1, word mod) {
-    if (greg(r1) == mod) sreg(16, 0);
-    else if (greg(r1) < mod) sreg(16, 1);
-    else sreg(16, 2);
+/**
+ * read multi-precision number from guest memory
+ * \param[adr] - address of lowest limb
+ * \param[n] - number of limbs
+ */
+vector<limb> mp_load(word adr, word n) {
+    range_check(adr, n);
+    vector<limb> res(n);
+    for (word i = 0; i < n; i++) res[i] = (limb) gmem(adr + i * LIMB_STEP);
+    return res;
 }
 
-void cmpd(word r1, word r2) {
-    dword first = (greg(r1 + 1) << 32) + greg(r1);
-    dword second = (greg(r2 + 1) << 32) + greg(r2);
-    double fir = dw_t_d(first), sec = dw_t_d(second);
-    if (fir == sec) sreg(16, 0);
-    else if (fir < sec) sreg(16, 1);
-    else sreg(16, 2);
+/**
+ * write multi-precision number to guest memory
+ * \param[adr] - address of lowest limb
+ * \param[x] - limbs
+ */
+void mp_store(word adr, const vector<limb> &x) {
+    range_check(adr, x.size());
+    for (size_t i = 0; i < x.size(); i++) smem(adr + i * LIMB_STEP, x[i]);
 }
 
-void jmp(word tail) {
-    sreg(15, tail - 1);
+/**
+ * add x to r from limb at, carry goes on to the end of r
+ */
+void mp_add_at(vector<limb> &r, size_t at, const vector<limb> &x) {
+    wide_limb carry = 0;
+    for (size_t i = 0; at + i < r.size() && (i < x.size() || carry != 0); i++) {
+        wide_limb sum = (wide_limb) r[at + i] + (i < x.size() ? x[i] : 0) + carry;
+        r[at + i] = (limb) sum;
+        carry = sum >> LIMB_BITS;
+    }
 }
 
-void jne(word tail) {
-    if (greg(16) > 0) sreg(15, tail - 1);
+/**
+ * subtract x from r, r is not less than x
+ */
+void mp_sub_from(vector<limb> &r, const vector<limb> &x) {
+    limb borrow = 0;
+    for (size_t i = 0; i < r.size() && (i < x.size() || borrow != 0); i++) {
+        wide_limb sub = (wide_limb) (i < x.size() ? x[i] : 0) + borrow;
+        borrow = r[i] < sub;
+        r[i] -= (limb) sub;
+    }
 }
 
-void jeq(word tail) {
-    if (greg(16) == 0) sreg(15, tail - 1);
+/**
+ * product of n limb numbers, Karatsuba method from KARATSUBA_LIMBS limbs
+ * \return 2n limbs
+ */
+vector<limb> mp_mul(const limb *a, const limb *b, size_t n) {
+    vector<limb> res(2 * n, 0);
+    if (n < KARATSUBA_LIMBS) {
+        for (size_t i = 0; i < n; i++) {
+            wide_limb carry = 0;
+            for (size_t j = 0; j < n; j++) {
+                wide_limb t = (wide_limb) a[i] * b[j] + res[i + j] + carry;
+                res[i + j] = (limb) t;
+                carry = t >> LIMB_BITS;
+            }
+            res[i + n] = (limb) carry;
+        }
+        return res;
+    }
+    size_t h = n / 2, m = n - h;
+    vector<limb> sa(a + h, a + n), sb(b + h, b + n);
+    sa.push_back(0), sb.push_back(0);
+    mp_add_at(sa, 0, vector<limb>(a, a + h));
+    mp_add_at(sb, 0, vector<limb>(b, b + h));
+    vector<limb> low = mp_mul(a, b, h), high = mp_mul(a + h, b + h, m), mid = mp_mul(sa.data(), sb.data(), m + 1);
+    mp_sub_from(mid, low);
+    mp_sub_from(mid, high);
+    mp_add_at(res, 0, low);
+    mp_add_at(res, h, mid);
+    mp_add_at(res, 2 * h, high);
+    return res;
 }
 
-void jle(word tail) {
-    if (greg(16) < 2) sreg(15, tail - 1);
+/**
+ * multi-precision syscalls on little-endian limb arrays, operands are taken from registers starting with reg:
+ *  120 - add: dst, a, b, n. reg gets carry
+ *  121 - sub: dst, a, b, n. reg gets borrow
+ *  122 - mul: dst of 2n limbs, a, b, n
+ *  123 - divmod by limb: dst, a, n, d. reg gets remainder, -1 if d is 0
+ *  124 - compare: a, b, n. reg and flag get 0 if a = b, 1 if a < b, 2 if a > b, as with cmp
+ * \param[code] - syscall
+ * \param[reg] - first register of operands
+ */
+void mp_call(word code, word reg) {
+    if (reg + 4 > 15) halt(132);
+    word n = greg(reg + 3);
+    if (code == 120 || code == 121) {
+        vector<limb> a = mp_load(greg(reg + 1), n), b = mp_load(greg(reg + 2), n);
+        limb carry = 0;
+        for (word i = 0; i < n; i++) {
+            if (code == 120) {
+                wide_limb sum = (wide_limb) a[i] + b[i] + carry;
+                a[i] = (limb) sum;
+                carry = (limb) (sum >> LIMB_BITS);
+            } else {
+                wide_limb sub = (wide_limb) b[i] + carry;
+                carry = a[i] < sub;
+                a[i] -= (limb) sub;
+            }
+        }
+        mp_store(greg(reg), a);
+        sreg(reg, carry);
+    } else if (code == 122) {
+        vector<limb> a = mp_load(greg(reg + 1), n), b = mp_load(greg(reg + 2), n);
+        mp_store(greg(reg), mp_mul(a.data(), b.data(), n));
+    } else if (code == 123) {
+        n = greg(reg + 2);
+        limb d = (limb) greg(reg + 3);
+        vector<limb> a = mp_load(greg(reg + 1), n);
+        if (d == 0) {
+            sreg(reg, -1);
+            return;
+        }
+        wide_limb rem = 0;
+        for (word i = n; i-- > 0;) {
+            wide_limb cur = rem << LIMB_BITS | a[i];
+            a[i] = (limb) (cur / d);
+            rem = cur % d;
+        }
+        mp_store(greg(reg), a);
+        sreg(reg, (limb) rem);
+    } else if (code == 124) {
+        n = greg(reg + 2);
+        vector<limb> a = mp_load(greg(reg), n), b = mp_load(greg(reg + 1), n);
+        word res = 0;
+        for (word i = n; i-- > 0 && res == 0;)
+            if (a[i] != b[i]) res = a[i] < b[i] ? 1 : 2;
+        sreg(reg, res);
+        sreg(16, res);
+    }
 }
 
-void jl(word tail) {
-    if (greg(16) == 1) sreg(15, tail - 1);
+/**
+ * mix bits of key into slot number
+ */
+size_t map_hash(word key) {
+    dword x = key;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
 }
 
-void jge(word tail) {
-    if (greg(16) != 1) sreg(15, tail - 1);
+/**
+ * hash map of handle, nullptr if handle is unknown or freed
+ */
+guest_map *map_of(word handle) {
+    if (handle == 0 || handle > maps.size() || !maps[handle - 1].live) return nullptr;
+    return &maps[handle - 1];
 }
 
-void jg(word tail) {
-    if (greg(16) == 2) sreg(15, tail - 1);
+/**
+ * slot with key or empty slot where key goes
+ */
+size_t map_find(const guest_map &m, word key) {
+    size_t mask = m.used.size() - 1, i = map_hash(key) & mask;
+    while (m.used[i] && m.keys[i] != key) i = (i + 1) & mask;
+    return i;
 }
 
-void load(word r1, word mod) {
-    sreg(r1, gmem(mod));
+/**
+ * double table of hash map, keeping it at most half full
+ */
+void map_grow(guest_map &m) {
+    guest_map bigger;
+    size_t size = max((size_t) 16, m.used.size() * 2);
+    bigger.keys.resize(size);
+    bigger.values.resize(size);
+    bigger.used.assign(size, 0);
+    for (size_t i = 0; i < m.used.size(); i++) {
+        if (!m.used[i]) continue;
+        size_t j = map_find(bigger, m.keys[i]);
+        bigger.keys[j] = m.keys[i];
+        bigger.values[j] = m.values[i];
+        bigger.used[j] = 1;
+    }
+    m.keys.swap(bigger.keys);
+    m.values.swap(bigger.values);
+    m.used.swap(bigger.used);
 }
 
-void store(word r1, word mod) {
-    smem(mod, greg(r1));
+/**
+ * remove key in slot and shift following keys of its probe chain back, so no tombstones are left
+ */
+void map_erase_at(guest_map &m, size_t i) {
+    size_t mask = m.used.size() - 1;
+    m.used[i] = 0;
+    m.count--;
+    for (size_t j = (i + 1) & mask; m.used[j]; j = (j + 1) & mask) {
+        size_t home = map_hash(m.keys[j]) & mask;
+        if (((j - home) & mask) < ((j - i) & mask)) continue;
+        m.keys[i] = m.keys[j];
+        m.values[i] = m.values[j];
+        m.used[i] = 1;
+        m.used[j] = 0;
+        i = j;
+    }
 }
 
-void load2(word r1, word mod) {
-    sreg(r1, gmem(mod));
-    sreg(r1 + 1, gmem(mod + 1));
+/**
+ * hash map syscalls, operands are taken from registers starting with reg. Flag gets 0 if key was found and 1
+ * otherwise, so jeq/ceq branch on found key:
+ *  140 - create: reg gets handle, handles of freed maps are reused
+ *  141 - insert: handle, key, value. Value of present key is replaced
+ *  142 - lookup: handle, key. Next register after key gets value of found key
+ *  143 - erase: handle, key
+ *  144 - size: reg gets number of keys of handle in reg
+ *  145 - iterate: handle, buffer, n, cursor. Writes at most n key, value pairs to buffer, reg gets their number,
+ *        0 when iteration is over. Cursor starts with 0 and is updated for next call
+ *  146 - free: handle
+ * \param[code] - syscall
+ * \param[reg] - first register of operands
+ */
+void map_call(word code, word reg) {
+    if (reg + 4 > 15) halt(132);
+    if (code == 140) {
+        size_t slot = 0;
+        while (slot < maps.size() && maps[slot].live) slot++;
+        if (slot == maps.size()) maps.push_back(guest_map());
+        maps[slot].live = true;
+        sreg(reg, slot + 1);
+        return;
+    }
+    guest_map *m = map_of(greg(reg));
+    bool found = false;
+    if (m == nullptr) {
+        if (code == 144 || code == 145) sreg(reg, 0);
+        sreg(16, 1);
+        return;
+    }
+    word key = greg(reg + 1);
+    size_t i = m->used.empty() ? 0 : map_find(*m, key);
+    found = !m->used.empty() && m->used[i];
+    if (code == 141) {
+        if (!found && (m->count + 1) * 2 > m->used.size()) {
+            map_grow(*m);
+            i = map_find(*m, key);
+        }
+        if (!found) m->count++;
+        m->keys[i] = key;
+        m->values[i] = greg(reg + 2);
+        m->used[i] = 1;
+    } else if (code == 142) {
+        if (found) sreg(reg + 2, m->values[i]);
+    } else if (code == 143) {
+        if (found) map_erase_at(*m, i);
+    } else if (code == 144) {
+        sreg(reg, m->count);
+    } else if (code == 145) {
+        word buffer = greg(reg + 1), n = greg(reg + 2), written = 0;
+        size_t cursor = greg(reg + 3);
+        range_check(buffer, 2 * min((size_t) n, m->count));
+        for (; cursor < m->used.size() && written < n; cursor++) {
+            if (!m->used[cursor]) continue;
+            smem(buffer + 2 * written * 1, m->keys[cursor]);
+            smem(buffer + (2 * written + 1) * 1, m->values[cursor]);
+            written++;
+        }
+        sreg(reg, written);
+        sreg(reg + 3, cursor);
+    } else if (code == 146) {
+        *m = guest_map();
+    }
+    sreg(16, found ? 0 : 1);
 }
 
-void store2(word r1, word mod) {
-    smem(mod, greg(r1));
-    smem(mod + 1, greg(r1 + 1));
+#ifdef __SSE2__
+/**
+ * compare SCAN_WIDTH memory words with symbol. Words are compared as 32 bit halves, word is equal when both are
+ * \param[p] - first word
+ * \param[key] - symbol in both 64 bit lanes
+ * \return bit i is set if p[i] is symbol
+ */
+int scan_mask(const symbol *p, __m128i key) {
+    __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) p), key);
+    __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (p + 2)), key);
+    lo = _mm_and_si128(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    hi = _mm_and_si128(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_movemask_pd(_mm_castsi128_pd(lo)) | _mm_movemask_pd(_mm_castsi128_pd(hi)) << 2;
 }
 
-void loadr(word r1, word r2, word mod) {
-    sreg(r1, gmem(greg(r2) + mod));
+/**
+ * symbol in every lane for scan_mask()
+ */
+__m128i scan_key(symbol c) {
+    return _mm_set1_epi64x((long long) c);
 }
+#endif
 
-void loadr2(word r1, word r2, word mod) {
-    sreg(r1, gmem(greg(r2) + mod));
-    sreg(r1 + 1, gmem(greg(r2) + mod + 1));
+/**
+ * position of first symbol c in p[from, n), n if there is none
+ */
+word find_symbol(const symbol *p, word from, word n, symbol c) {
+    word i = from;
+#ifdef __SSE2__
+    __m128i key = scan_key(c);
+    for (; i + SCAN_WIDTH <= n; i += SCAN_WIDTH) {
+        int mask = scan_mask(p + i, key);
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < n; i++)
+        if (p[i] == c) return i;
+    return n;
 }
 
-void storer(word r1, word r2, word mod) {
-    smem(mod + greg(r2), greg(r1));
+/**
+ * number of symbols c in p[0, n)
+ */
+word count_symbol(const symbol *p, word n, symbol c) {
+    word res = 0, i = 0;
+#ifdef __SSE2__
+    __m128i key = scan_key(c);
+    for (; i + SCAN_WIDTH <= n; i += SCAN_WIDTH) res += __builtin_popcount(scan_mask(p + i, key));
+#endif
+    for (; i < n; i++) res += p[i] == c;
+    return res;
 }
 
-void storer2(word r1, word r2, word mod) {
-    smem(mod + greg(r2), greg(r1));
-    smem(mod + 1 + greg(r2), greg(r1 + 1));
+/**
+ * position of first pattern in p[from, n), n if there is none. Candidates must match first and last symbol of
+ * pattern, which are checked for SCAN_WIDTH positions at once, only then whole pattern is compared
+ * \param[pat] - pattern
+ * \param[m] - length of pattern, not 0
+ */
+word find_pattern(const symbol *p, word from, word n, const symbol *pat, word m) {
+    if (m > n) return n;
+    word i = from, last = n - m;
+#ifdef __SSE2__
+    __m128i first_key = scan_key(pat[0]), last_key = scan_key(pat[m - 1]);
+    for (; i + SCAN_WIDTH <= last + 1; i += SCAN_WIDTH) {
+        int mask = scan_mask(p + i, first_key) & scan_mask(p + i + m - 1, last_key);
+        for (; mask != 0; mask &= mask - 1) {
+            word at = i + __builtin_ctz(mask);
+            if (memcmp(p + at, pat, m * sizeof(symbol)) == 0) return at;
+        }
+    }
+#endif
+    for (; i <= last; i++)
+        if (p[i] == pat[0] && memcmp(p + i, pat, m * sizeof(symbol)) == 0) return i;
+    return n;
 }
 
 /**
- * Get type and args of command and call function
- * \param [type] - command to execute
- * \param [tail] - commands args
+ * split p[0, n) into tokens separated by symbol c, empty tokens are skipped
+ * \param[tokens] - gets offset and length of every token
+ * \param[max] - most tokens to find
+ * \return symbols consumed: n if all tokens were found, else offset of first token which didn't fit
  */
-void switch_c(word type, word tail) {
-    word r1, r2, mod;
-    if (TYPE.at(type)=="RR") {
-        r1 = ts4(tail);
-        r2 = tt4(tail);
-        mod = tl16(tail);
+word split_symbols(const symbol *p, word n, symbol c, vector<word> &tokens, word max) {
+    word start = 0, i = 0;
+#ifdef __SSE2__
+    __m128i key = scan_key(c);
+#endif
+    while (i < n) {
+        int mask;
+        word width;
+#ifdef __SSE2__
+        if (i + SCAN_WIDTH <= n) {
+            mask = scan_mask(p + i, key);
+            width = SCAN_WIDTH;
+        } else
+#endif
+        {
+            mask = p[i] == c;
+            width = 1;
+        }
+        for (; mask != 0; mask &= mask - 1) {
+            word delim = i + __builtin_ctz(mask);
+            if (delim > start) {
+                if (tokens.size() / 2 == max) return start;
+                tokens.push_back(start);
+                tokens.push_back(delim - start);
+            }
+            start = delim + 1;
+        }
+        i += width;
     }
-    else if (TYPE.at(type)=="RI") {
-        mod = tl20(tail);
+    if (n > start) {
+        if (tokens.size() / 2 == max) return start;
+        tokens.push_back(start);
+        tokens.push_back(n - start);
     }
-    else if (TYPE.at(type)=="RM") {
-        r1 = ts4(tail);
-        mod = tl20(tail);
+    return n;
+}
+
+/**
+ * string syscalls on symbol arrays in guest memory (bytes in mipt64, memory words in mipt32), operands are taken
+ * from registers starting with reg. Offsets and lengths are in symbols:
+ *  150 - find: adr, n, c. Reg gets offset of first c, -1 if there is none
+ *  151 - search: adr, n, pattern, m. Reg gets offset of first pattern of m symbols, -1 if there is none
+ *  152 - count: adr, n, pattern, m. Reg gets number of not overlapping patterns
+ *  153 - split: adr, n, c, out, max. Writes offset and length of at most max tokens separated by c to out words,
+ *        reg gets number of tokens and next register symbols consumed, n if every token was written
+ * \param[code] - syscall
+ * \param[reg] - first register of operands
+ */
+void string_call(word code, word reg) {
+    if (reg + 5 > 15) halt(132);
+    word adr = greg(reg), n = greg(reg + 1), c = greg(reg + 2), m = greg(reg + 3);
+    range_check(adr, n);
+    if (code == 151 || code == 152) range_check(c, m);
+    if (lazy_pending != 0) lazy_finish();
+    const symbol *p = (const symbol *) (mem + adr), *pat = (const symbol *) (mem + c);
+    if (code == 150) {
+        word at = find_symbol(p, 0, n, (symbol) c);
+        sreg(reg, at == n ? -1 : at);
+    } else if (code == 151) {
+        word at = m == 0 ? 0 : find_pattern(p, 0, n, pat, m);
+        sreg(reg, at == n && m != 0 ? -1 : at);
+    } else if (code == 152) {
+        word res = 0;
+        if (m == 1) res = count_symbol(p, n, pat[0]);
+        for (word at = 0; m > 1 && (at = find_pattern(p, at, n, pat, m)) != n; at += m) res++;
+        sreg(reg, res);
+    } else if (code == 153) {
+        vector<word> tokens;
+        word consumed = split_symbols(p, n, (symbol) c, tokens, greg(reg + 4));
+        range_check(m, tokens.size());
+        for (word i = 0; i < tokens.size(); i++) smem(m + i * 1, tokens[i]);
+        sreg(reg, tokens.size() / 2);
+        sreg(reg + 1, consumed);
     }
-    switch (type) {
-        case 0:
-            halt(mod);
-            break;
-        case 1:
-            syscall(r1, mod);
-            break;
-        case 2:
-            add(r1, r2, mod);
-            break;
-        case 3:
-            addi(r1, mod);
-            break;
-        case 4:
-            sub(r1, r2, mod);
-            break;
-        case 5:
-            subi(r1, mod);
-            break;
-        case 6:
-            mul(r1, r2);
-            break;
-        case 7:
-            muli(r1, mod);
-            break;
-        case 8:
-            div(r1, r2);
-            break;
-        case 9:
-            divi(r1, mod);
-            break;
-        case 12:
-            lc(r1, mod);
-            break;
-        case 13:
-            shl(r1, r2);
-            break;
-        case 14:
-            shli(r1, mod);
-            break;
-        case 15:
-            shr(r1, r2);
-            break;
-        case 16:
-            shri(r1, mod);
-            break;
-        case 17:
-            and1(r1, r2);
-            break;
-        case 18:
-            andi(r1, mod);
-            break;
-        case 19:
-            or1(r1, r2);
-            break;
-        case 20:
-            ori(r1, mod);
-            break;
-        case 21:
-            xor1(r1, r2);
-            break;
-        case 22:
-            xori(r1, mod);
-            break;
-        case 23:
-            not1(r1);
-            break;
-        case 24:
-            mov(r1, r2, mod);
-            break;
-        case 32:
-            addd(r1, r2);
-            break;
-        case 33:
-            subd(r1, r2);
-            break;
-        case 34:
-            muld(r1, r2);
-            break;
-        case 35:
-            divd(r1, r2);
-            break;
-        case 36:
-            itod(r1, r2);
-            break;
-        case 37:
-            dtoi(r1, r2);
-            break;
-        case 38:
-            push(r1, mod);
-            break;
-        case 39:
-            pop(r1, mod);
-            break;
-        case 40:
-            call(r1, r2, mod);
-            break;
-        case 41:
-            calli(tail);
-            break;
-        case 42:
-            ret(mod);
-            break;
-        case 43:
-            cmp(r1, r2);
-            break;
-        case 44:
-            cmpi(r1, mod);
-            break;
-        case 45:
-            cmpd(r1, r2);
-            break;
-        case 46:
-            jmp(tail);
-            break;
-        case 47:
-            jne(tail);
-            break;
-        case 48:
-            jeq(tail);
-            break;
-        case 49:
-            jle(tail);
+}
+
+/**
+ * dst[i] = src[idx[i]] for n words, src[idx[i]] must be in guest memory
+ */
+void gather(word dst, word src, word idx, word n) {
+    range_check(dst, n);
+    range_check(idx, n);
+    word span = src < MEMSIZE ? MEMSIZE - src : 0;
+    word *to = mem + dst, *base = mem + src;
+    const word *at = mem + idx;
+    for (word i = 0; i < n; i++) {
+        if (i + PREFETCH_AHEAD < n && at[i + PREFETCH_AHEAD] < span) __builtin_prefetch(base + at[i + PREFETCH_AHEAD]);
+        if (at[i] >= span) halt(139);
+        to[i] = base[at[i]];
+    }
+    if (trace_out != nullptr) trace_words(dst, n);
+}
+
+/**
+ * dst[idx[i]] = src[i] for n words, dst[idx[i]] must be in guest memory
+ */
+void scatter(word dst, word src, word idx, word n) {
+    range_check(src, n);
+    range_check(idx, n);
+    word span = dst < MEMSIZE ? MEMSIZE - dst : 0;
+    word *base = mem + dst;
+    const word *from = mem + src, *at = mem + idx;
+    for (word i = 0; i < n; i++) {
+        if (i + PREFETCH_AHEAD < n && at[i + PREFETCH_AHEAD] < span)
+            __builtin_prefetch(base + at[i + PREFETCH_AHEAD], 1);
+        if (at[i] >= span) halt(139);
+        base[at[i]] = from[i];
+        if (trace_out != nullptr) trace_put(TRACE_MEM, dst + at[i], from[i]);
+    }
+}
+
+/**
+ * a[i] = a[idx[i]] for n words with every read done before writes, so permutation is applied in place
+ */
+void permute(word a, word idx, word n) {
+    range_check(a, n);
+    range_check(idx, n);
+    word *base = mem + a;
+    const word *at = mem + idx;
+    vector<word> res(n);
+    for (word i = 0; i < n; i++) {
+        if (i + PREFETCH_AHEAD < n && at[i + PREFETCH_AHEAD] < n) __builtin_prefetch(base + at[i + PREFETCH_AHEAD]);
+        if (at[i] >= n) halt(139);
+        res[i] = base[at[i]];
+    }
+    copy(res.begin(), res.end(), base);
+    if (trace_out != nullptr) trace_words(a, n);
+}
+
+/**
+ * index syscalls on word arrays in guest memory, indices are in words. Operands are taken from registers starting
+ * with reg:
+ *  160 - gather: dst, src, idx, n. dst[i] = src[idx[i]]
+ *  161 - scatter: dst, src, idx, n. dst[idx[i]] = src[i]
+ *  162 - permute: a, idx, n. a[i] = a[idx[i]] in place, idx[i] < n
+ * \param[code] - syscall
+ * \param[reg] - first register of operands
+ */
+void index_call(word code, word reg) {
+    if (reg + 4 > 15) halt(132);
+    if (lazy_pending != 0) lazy_finish();
+    if (code == 160) gather(greg(reg), greg(reg + 1), greg(reg + 2), greg(reg + 3));
+    else if (code == 161) scatter(greg(reg), greg(reg + 1), greg(reg + 2), greg(reg + 3));
+    else if (code == 162) permute(greg(reg), greg(reg + 1), greg(reg + 2));
+}
+
+void syscall(word reg, word arg) {
+    switch (arg) {
+        case 0:
+            if (clone_self != nullptr) finish_clone(0);
+            exit(0);
+        case 100:
+            take_snapshot();
+            wait_input();
+            int scanning_int;
+            scanf("%d", &scanning_int);
+            sreg(reg, scanning_int);
             break;
-        case 50:
-            jl(tail);
+        case 101:
+            take_snapshot();
+            wait_input();
+            double ddi;
+            scanf("%lf", &ddi);
+            dword dwi;
+            dwi = d_t_dw(ddi);
+            sreg(reg, (dwi << 32) >> 32);
+            sreg(reg + 1, dwi >> 32);
             break;
-        case 51:
-            jge(tail);
+        case 102:
+            int sending_int;
+            sending_int = (int) greg(reg);
+            guest_printf("%d", sending_int);
             break;
-        case 52:
-            jg(tail);
+        case 103:
+            dword dwo;
+            dwo = (greg(reg) + (greg(reg + 1) << 32));
+            double ddo;
+            ddo = dw_t_d(dwo);
+            guest_printf("%lg", ddo);
             break;
-        case 64:
-            load(r1, mod);
+        case 104:
+            take_snapshot();
+            wait_input();
+            char scanning_char;
+            scanf("%c", &scanning_char);
+            sreg(reg, scanning_char);
             break;
-        case 65:
-            store(r1, mod);
+        case 105:
+            char sending_char;
+            sending_char = (char) greg(reg);
+            guest_printf("%c", sending_char);
             break;
-        case 66:
-            load2(r1, mod);
+        case 160:
+        case 161:
+        case 162:
+            index_call(arg, reg);
             break;
-        case 67:
-            store2(r1, mod);
+        case 150:
+        case 151:
+        case 152:
+        case 153:
+            string_call(arg, reg);
             break;
-        case 68:
-            loadr(r1, r2, mod);
+        case 140:
+        case 141:
+        case 142:
+        case 143:
+        case 144:
+        case 145:
+        case 146:
+            map_call(arg, reg);
             break;
-        case 69:
-            loadr2(r1, r2, mod);
+        case 120:
+        case 121:
+        case 122:
+        case 123:
+        case 124:
+            mp_call(arg, reg);
             break;
-        case 70:
-            storer(r1, r2, mod);
+        case 110:
+            sreg(reg, guest_fork());
             break;
-        case 71:
-            storer2(r1, r2, mod);
+        case 111:
+            sreg(reg, guest_join(greg(reg)));
             break;
+        case 112:
+            if (clone_self != nullptr) finish_clone(greg(reg));
+            exit((int) greg(reg));
     }
 }
 
-/**
- * main emulating function
- */
-void emulate() {
-    while (true) {
-        word row_com = gmem(greg(15));
-        word type_code = tf8(row_com);
-        word tail = tl24(row_com);
-        switch_c(type_code, tail);
-        sreg(15, greg(15) + 1);
-    }
+void add(word r1, word r2, word mod) {
+    sreg(r1, greg(r1) + greg(r2) + mod);
 }
 
-int main() {
-    file_input();
-    assemble();
-    //bin_input();
+void addi(word r1, word mod) {
+    sreg(r1, greg(r1) + mod);
+}
+
+void sub(word r1, word r2, word mod) {
+    sreg(r1, greg(r1) - greg(r2) - mod);
+}
+
+void subi(word r1 , word mod) {
+    sreg(r1, greg(r1) - mod);
+}
+
+void mul(word r1, word r2) {
+    dword res = greg(r1) * greg(r2);
+    sreg(r1, (res << 32) >> 32);
+    sreg(r1 + 1, res >> 32);
+}
+
+void muli(word r1, word mod) {
+    dword res = greg(r1) * mod;
+    sreg(r1, (res << 32) >> 32);
+    sreg(r1 + 1, res >> 32);
+}
+
+void div(word r1, word r2) {
+    dword fir = (greg(r1 + 1) << 32) + greg(r1);
+    word di = fir / greg(r2);
+    word re = fir % greg(r2);
+    sreg(r1, di);
+    sreg(r1 + 1, re);
+}
+
+void divi(word r1, word mod) {
+    dword big = (greg(r1 + 1) << 32) + greg(r1);
+    word di = big / mod;
+    word re = big % mod;
+    sreg(r1, di);
+    sreg(r1 + 1, re);
+}
+
+void lc(word r1, word mod) {
+    sreg(r1, mod);
+}
+
+void shl(word r1, word r2) {
+    sreg(r1, greg(r1) << greg(r2));
+}
+
+void shli(word r1, word mod) {
+    sreg(r1, greg(r1) << mod);
+}
+
+void shr(word r1, word r2) {
+    sreg(r1, greg(r1) >> greg(r2));
+}
+
+void shri(word r1, word mod) {
+    sreg(r1, greg(r1) >> mod);
+}
+
+void and1(word r1, word r2) {
+    sreg(r1, greg(r1) & greg(r2));
+}
+
+void andi(word r1, word mod) {
+    sreg(r1, greg(r1) & mod);
+}
+
+void or1(word r1, word r2) {
+    sreg(r1, greg(r1) | greg(r2));
+}
+
+void ori(word r1, word mod) {
+    sreg(r1, greg(r1) | mod);
+}
+
+void xor1(word r1, word r2) {
+    sreg(r1, greg(r1) ^ greg(r2));
+}
+
+void xori(word r1, word mod) {
+    sreg(r1, greg(r1) ^ mod);
+}
+
+void not1(word r1) {
+    sreg(r1, ~greg(r1));
+}
+
+void mov(word r1, word r2, word mod) {
+    sreg(r1, greg(r2) + mod);
+}
+
+void addd(word r1, word r2) {
+    dword mul1 = (greg(r1 + 1) << 32) + greg(r1);
+    dword mul2 = (greg(r2 + 1) << 32) + greg(r2);
+    double mu1 = dw_t_d(mul1), mu2 = dw_t_d(mul2);
+    dword res = d_t_dw(mu1+mu2);
+    sreg(r1, (res << 32) >> 32);
+    sreg(r1 + 1, res >> 32);
+}
+
+void subd(word r1, word r2) {
+    dword mul1 = (greg(r1 + 1) << 32) + greg(r1);
+    dword mul2 = (greg(r2 + 1) << 32) + greg(r2);
+    double mu1 = dw_t_d(mul1), mu2 = dw_t_d(mul2);
+    dword res = d_t_dw(mu1-mu2);
+    sreg(r1, (res << 32) >> 32);
+    sreg(r1 + 1, res >> 32);
+}
+
+void muld(word r1, word r2) {
+    dword mul1 = (greg(r1 + 1) << 32) + greg(r1);
+    dword mul2 = (greg(r2 + 1) << 32) + greg(r2);
+    double mu1 = dw_t_d(mul1), mu2 = dw_t_d(mul2);
+    dword res = d_t_dw(mu1*mu2);
+    sreg(r1, (res << 32) >> 32);
+    sreg(r1 + 1, res >> 32);
+}
+
+void divd(word r1, word r2) {
+    dword mul1 = (greg(r1 + 1) << 32) + greg(r1);
+    dword mul2 = (greg(r2 + 1) << 32) + greg(r2);
+    double mu1 = dw_t_d(mul1), mu2 = dw_t_d(mul2);
+    dword res = d_t_dw(mu1/mu2);
+    sreg(r1, (res << 32) >> 32);
+    sreg(r1 + 1, res >> 32);
+}
+
+void itod(word r1, word r2) {
+    dword res;
+    double sour = greg(r2); /////////////////////////////////////////////////////////////why???
+    memcpy(&res, &sour, 8);
+    sreg(r1, (res << 32) >> 32);
+    sreg(r1 + 1, res >> 32);
+}
+
+void dtoi(word r1, word r2) {
+    dword sour = (greg(r2 + 1) << 32) + greg(r2);
+    double res;
+    memcpy(&res, &sour, 8);
+    word re = res;
+    sreg(r1, re);
+}
+
+void push(word r1, word mod) {
+    push_stack(greg(r1) + mod);
+}
+
+void pop(word r1, word mod) {
+    sreg(r1, pop_stack() + mod);
+}
+
+void call(word r1, word r2, word mod) {
+    push_stack(greg(15)+1);
+    sreg(15, greg(r2)+mod-1);
+    sreg(r1, greg(14));
+}
+
+void calli(word tail) {
+    push_stack(greg(15)+1);
+    sreg(15, tail - 1);
+}
+
+void ret(word mod) {
+    sreg(15, pop_stack(mod + 1)-1);
+}
+
+void cmp(word r1, word r2) {
+    if (greg(r1) == greg(r2)) sreg(16, 0);
+    else if (greg(r1) < greg(r2)) sreg(16, 1);
+    else sreg(16, 2);
+}
+
+void cmpi(word r1, word mod) {
+    if (greg(r1) == mod) sreg(16, 0);
+    else if (greg(r1) < mod) sreg(16, 1);
+    else sreg(16, 2);
+}
+
+void cmpd(word r1, word r2) {
+    dword first = (greg(r1 + 1) << 32) + greg(r1);
+    dword second = (greg(r2 + 1) << 32) + greg(r2);
+    double fir = dw_t_d(first), sec = dw_t_d(second);
+    if (fir == sec) sreg(16, 0);
+    else if (fir < sec) sreg(16, 1);
+    else sreg(16, 2);
+}
+
+void jmp(word tail) {
+    sreg(15, tail - 1);
+}
+
+void jne(word tail) {
+    if (greg(16) > 0) sreg(15, tail - 1);
+}
+
+void jeq(word tail) {
+    if (greg(16) == 0) sreg(15, tail - 1);
+}
+
+void jle(word tail) {
+    if (greg(16) < 2) sreg(15, tail - 1);
+}
+
+void jl(word tail) {
+    if (greg(16) == 1) sreg(15, tail - 1);
+}
+
+void jge(word tail) {
+    if (greg(16) != 1) sreg(15, tail - 1);
+}
+
+void jg(word tail) {
+    if (greg(16) == 2) sreg(15, tail - 1);
+}
+
+void load(word r1, word mod) {
+    sreg(r1, gmem(mod));
+}
+
+void store(word r1, word mod) {
+    smem(mod, greg(r1));
+}
+
+void load2(word r1, word mod) {
+    sreg(r1, gmem(mod));
+    sreg(r1 + 1, gmem(mod + 1));
+}
+
+void store2(word r1, word mod) {
+    smem(mod, greg(r1));
+    smem(mod + 1, greg(r1 + 1));
+}
+
+void loadr(word r1, word r2, word mod) {
+    sreg(r1, gmem(greg(r2) + mod));
+}
+
+void loadr2(word r1, word r2, word mod) {
+    sreg(r1, gmem(greg(r2) + mod));
+    sreg(r1 + 1, gmem(greg(r2) + mod + 1));
+}
+
+void storer(word r1, word r2, word mod) {
+    smem(mod + greg(r2), greg(r1));
+}
+
+void storer2(word r1, word r2, word mod) {
+    smem(mod + greg(r2), greg(r1));
+    smem(mod + 1 + greg(r2), greg(r1 + 1));
+}
+
+/**
+ * Get type and args of command and call function
+ * \param [type] - command to execute
+ * \param [tail] - commands args
+ */
+void switch_c(word type, word tail) {
+    word r1, r2, mod;
+    if (TYPE[type] == TYPE_NONE) halt(132);
+    if (TYPE[type] == TYPE_RR) {
+        r1 = ts4(tail);
+        r2 = tt4(tail);
+        mod = tl16(tail);
+    }
+    else if (TYPE[type] == TYPE_RI) {
+        r1 = ts4(tail);
+        mod = tl20(tail);
+    }
+    else if (TYPE[type] == TYPE_RM) {
+        r1 = ts4(tail);
+        mod = tl20(tail);
+    }
+    if ((type >= 40 && type <= 42) || (type >= 46 && type <= 52)) branches++;
+    switch (type) {
+        case 0:
+            halt(mod);
+            break;
+        case 1:
+            syscall(r1, mod);
+            break;
+        case 2:
+            add(r1, r2, mod);
+            break;
+        case 3:
+            addi(r1, mod);
+            break;
+        case 4:
+            sub(r1, r2, mod);
+            break;
+        case 5:
+            subi(r1, mod);
+            break;
+        case 6:
+            mul(r1, r2);
+            break;
+        case 7:
+            muli(r1, mod);
+            break;
+        case 8:
+            div(r1, r2);
+            break;
+        case 9:
+            divi(r1, mod);
+            break;
+        case 12:
+            lc(r1, mod);
+            break;
+        case 13:
+            shl(r1, r2);
+            break;
+        case 14:
+            shli(r1, mod);
+            break;
+        case 15:
+            shr(r1, r2);
+            break;
+        case 16:
+            shri(r1, mod);
+            break;
+        case 17:
+            and1(r1, r2);
+            break;
+        case 18:
+            andi(r1, mod);
+            break;
+        case 19:
+            or1(r1, r2);
+            break;
+        case 20:
+            ori(r1, mod);
+            break;
+        case 21:
+            xor1(r1, r2);
+            break;
+        case 22:
+            xori(r1, mod);
+            break;
+        case 23:
+            not1(r1);
+            break;
+        case 24:
+            mov(r1, r2, mod);
+            break;
+        case 32:
+            addd(r1, r2);
+            break;
+        case 33:
+            subd(r1, r2);
+            break;
+        case 34:
+            muld(r1, r2);
+            break;
+        case 35:
+            divd(r1, r2);
+            break;
+        case 36:
+            itod(r1, r2);
+            break;
+        case 37:
+            dtoi(r1, r2);
+            break;
+        case 38:
+            push(r1, mod);
+            break;
+        case 39:
+            pop(r1, mod);
+            break;
+        case 40:
+            call(r1, r2, mod);
+            break;
+        case 41:
+            calli(tail);
+            break;
+        case 42:
+            ret(mod);
+            break;
+        case 43:
+            cmp(r1, r2);
+            break;
+        case 44:
+            cmpi(r1, mod);
+            break;
+        case 45:
+            cmpd(r1, r2);
+            break;
+        case 46:
+            jmp(tail);
+            break;
+        case 47:
+            jne(tail);
+            break;
+        case 48:
+            jeq(tail);
+            break;
+        case 49:
+            jle(tail);
+            break;
+        case 50:
+            jl(tail);
+            break;
+        case 51:
+            jge(tail);
+            break;
+        case 52:
+            jg(tail);
+            break;
+        case 64:
+            load(r1, mod);
+            break;
+        case 65:
+            store(r1, mod);
+            break;
+        case 66:
+            load2(r1, mod);
+            break;
+        case 67:
+            store2(r1, mod);
+            break;
+        case 68:
+            loadr(r1, r2, mod);
+            break;
+        case 69:
+            loadr2(r1, r2, mod);
+            break;
+        case 70:
+            storer(r1, r2, mod);
+            break;
+        case 71:
+            storer2(r1, r2, mod);
+            break;
+    }
+}
+
+/**
+ * one-shot run got past its start, advise guest memory to transparent huge pages. Short runs never zero
+ * whole huge pages on first touch
+ */
+void promote_memory() {
+    huge_pending = false;
+    preempt_at = ~0ULL;
+    if (madvise(mem, MEMSIZE * sizeof(word), MADV_HUGEPAGE) == 0) mem_backing = "transparent huge pages";
+}
+
+/**
+ * stop batch job at block boundary after its slice, runner continues it when tenant's turn comes
+ */
+void preempt() {
+    if (huge_pending) {
+        promote_memory();
+        return;
+    }
+    result->retired = retired;
+    result->branches = branches;
+    raise(SIGSTOP);
+    preempt_at = retired + slice;
+}
+
+/**
+ * instruction of fused sequence has expected type
+ * \param[row] - instruction
+ * \param[type] - type of sequence element
+ */
+bool fuse_match(word row, word type) {
+    return tf8(row) == type;
+}
+
+#include "fused.inc"
+
+enum {IDIOM_FILL = 1, IDIOM_COPY, IDIOM_SUM, IDIOM_FIND};
+
+/**
+ * loop recognized as idiom: body, then "addi index, step", "cmp index, bound" or "cmpi index, bound" and "jl head"
+ */
+struct loop_idiom {
+    int kind; /// IDIOM_FILL, IDIOM_COPY, IDIOM_SUM or IDIOM_FIND
+    word head; /// address of first instruction
+    word len; /// instructions in loop
+    word index; /// register counted from head to bound
+    word step; /// increment of index
+    word bound_reg; /// register index is compared with, 16 if bound is immediate
+    word bound; /// immediate bound
+    word value; /// register stored by fill, loaded by copy, sum and find
+    word other; /// sum register of sum, register compared by find, 16 if key is immediate
+    word from; /// offset from index of loaded word
+    word to; /// offset from index of stored word
+    word delta; /// step of filled value, addend of sum or immediate key of find
+    word exit; /// jump target of find when key is found
+};
+
+/**
+ * match loop of len instructions at head with idiom:
+ *  fill - "storer value, index, to", optional "addi value, delta"
+ *  copy - "loadr value, index, from", "storer value, index, to"
+ *  sum - "loadr value, index, from", "add other, value, delta"
+ *  find - "loadr value, index, from", "cmp value, other" or "cmpi value, delta", "jeq exit"
+ * followed by loop tail. Registers written by loop must differ from each other and from registers it only reads
+ */
+bool match_idiom(word head, word len, loop_idiom &idiom) {
+    word row[6];
+    for (word i = 0; i < len; i++) row[i] = gmem(head + i);
+    word inc = row[len - 3], test = row[len - 2], jump = row[len - 1], first = tf8(row[0]);
+    if (tf8(inc) != 3 || tl20(inc) == 0 || tf8(jump) != 50 || tl24(jump) != head) return false;
+    idiom = {0, head, len, ts4(inc), tl20(inc), 16, 0, ts4(row[0]), 16, tl16(row[0]), tl16(row[0]), 0, 0};
+    if (tf8(test) == 43 && ts4(test) == idiom.index) idiom.bound_reg = tt4(test);
+    else if (tf8(test) == 44 && ts4(test) == idiom.index) idiom.bound = tl20(test);
+    else return false;
+    if ((first != 68 && first != 70) || tt4(row[0]) != idiom.index) return false;
+    if (len == 4 && first == 70) {
+        idiom.kind = IDIOM_FILL;
+    } else if (len == 5 && first == 70 && tf8(row[1]) == 3 && ts4(row[1]) == idiom.value) {
+        idiom.kind = IDIOM_FILL;
+        idiom.delta = tl20(row[1]);
+    } else if (len == 5 && first == 68 && tf8(row[1]) == 70 && ts4(row[1]) == idiom.value &&
+               tt4(row[1]) == idiom.index) {
+        idiom.kind = IDIOM_COPY;
+        idiom.to = tl16(row[1]);
+    } else if (len == 5 && first == 68 && tf8(row[1]) == 2 && tt4(row[1]) == idiom.value) {
+        idiom.kind = IDIOM_SUM;
+        idiom.other = ts4(row[1]);
+        idiom.delta = tl16(row[1]);
+    } else if (len == 6 && first == 68 && ts4(row[1]) == idiom.value && tf8(row[2]) == 48 &&
+               (tf8(row[1]) == 43 || tf8(row[1]) == 44)) {
+        idiom.kind = IDIOM_FIND;
+        if (tf8(row[1]) == 43) idiom.other = tt4(row[1]);
+        else idiom.delta = tl20(row[1]);
+        idiom.exit = tl24(row[2]);
+    } else return false;
+    bool sums = idiom.kind == IDIOM_SUM;
+    word key = idiom.kind == IDIOM_FIND ? idiom.other : 16;
+    if (idiom.bound_reg == 15 || key == 15) return false;
+    if (idiom.index == idiom.value || (sums && (idiom.other == idiom.index || idiom.other == idiom.value))) return false;
+    for (word w : {idiom.index, idiom.value, sums ? idiom.other : idiom.value})
+        if (w == 15 || w == idiom.bound_reg || w == key) return false;
+    return true;
+}
+
+/**
+ * words loop accesses are in guest memory, and for stores don't overwrite loop itself or instructions not
+ * assembled yet
+ * \param[first] - address accessed by first iteration
+ * \param[count] - number of iterations
+ */
+bool idiom_range(const loop_idiom &idiom, word first, word count, bool store) {
+    word span = (count - 1) * idiom.step;
+    if (first >= MEMSIZE || span >= MEMSIZE - first) return false;
+    if (lazy_pending != 0 && first < lazy_rows.size()) return false;
+    return !store || first + span < idiom.head || first >= idiom.head + idiom.len;
+}
+
+/**
+ * run loop from its head to exit at once, leaving registers, flag, pc and memory as instruction by instruction run
+ * does. Loop isn't run if its index isn't below bound or memory it accesses is out of range
+ * \return number of executed instructions, 0 if loop wasn't run
+ */
+word run_idiom(const loop_idiom &idiom) {
+    word x = greg(idiom.index), bound = idiom.bound_reg == 16 ? idiom.bound : greg(idiom.bound_reg);
+    if (x >= bound) return 0;
+    word count = (bound - x - 1) / idiom.step + 1, s = idiom.step;
+    if (count > MEMSIZE || count > (~(word) 0 - x) / s) return 0;
+    word src = x + idiom.from, dst = x + idiom.to, branch_ops = idiom.kind == IDIOM_FIND ? 2 : 1;
+    bool loads = idiom.kind != IDIOM_FILL, stores = idiom.kind == IDIOM_FILL || idiom.kind == IDIOM_COPY;
+    if ((loads && !idiom_range(idiom, src, count, false)) || (stores && !idiom_range(idiom, dst, count, true))) return 0;
+    if (idiom.kind == IDIOM_FILL) {
+        word v = greg(idiom.value);
+        for (word j = 0; j < count; j++) mem[dst + j * s] = v + j * idiom.delta;
+        sreg(idiom.value, v + count * idiom.delta);
+    } else if (idiom.kind == IDIOM_COPY) {
+        for (word j = 0; j < count; j++) mem[dst + j * s] = mem[src + j * s];
+        sreg(idiom.value, mem[dst + (count - 1) * s]);
+    } else if (idiom.kind == IDIOM_SUM) {
+        word sum = 0;
+        for (word j = 0; j < count; j++) sum += mem[src + j * s];
+        sreg(idiom.other, greg(idiom.other) + sum + count * idiom.delta);
+        sreg(idiom.value, mem[src + (count - 1) * s]);
+    } else if (idiom.kind == IDIOM_FIND) {
+        word key = idiom.other == 16 ? idiom.delta : greg(idiom.other);
+        for (word j = 0; j < count; j++) {
+            if (mem[src + j * s] != key) continue;
+            sreg(idiom.value, key);
+            sreg(idiom.index, x + j * s);
+            sreg(16, 0);
+            sreg(15, idiom.exit);
+            branches += 2 * j + 1;
+            return j * idiom.len + 3;
+        }
+        sreg(idiom.value, mem[src + (count - 1) * s]);
+    }
+    sreg(idiom.index, x + count * s);
+    sreg(16, x + count * s == bound ? 0 : 2);
+    sreg(15, idiom.head + idiom.len);
+    branches += branch_ops * count;
+    return count * idiom.len;
+}
+
+/**
+ * run rest of loop whose backward branch was just taken to head at once if it is idiom
+ * \return number of executed instructions, 0 if loop wasn't run
+ */
+word loop_step(word head) {
+    word slot = head % IDIOM_MISSES;
+    if (idiom_miss[slot] == head + 1) return 0;
+    loop_idiom idiom;
+    for (word len = 4; len <= 6 && head + len <= MEMSIZE; len++)
+        if (match_idiom(head, len, idiom)) return run_idiom(idiom);
+    idiom_miss[slot] = head + 1;
+    return 0;
+}
+
+/**
+ * run started by -coldstart is about to execute its first instruction, send start_time to parent
+ */
+void report_coldstart() {
+    if (write(coldstart_fd, &start_time, sizeof(start_time)) < 0) perror("coldstart");
+    close(coldstart_fd);
+    coldstart_fd = -1;
+}
+
+/**
+ * main emulating function
+ */
+void emulate() {
+    if (pc_hits != nullptr) atexit(write_profile);
+    if (perf) start_perf();
+    if (!replay_output.empty()) put_output(replay_output.data(), replay_output.size());
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    if (coldstart_fd >= 0) report_coldstart();
+    while (true) {
+        retired++;
+        word at = greg(15);
+        word row_com = gmem(at);
+        if (pc_hits != nullptr) profile_step(at, row_com);
+        if (trace_out != nullptr) trace_put(TRACE_PC, at, row_com);
+        word type_code = tf8(row_com);
+        word tail = tl24(row_com);
+        dword jumps = branches;
+        word fused = fuse ? fused_step(type_code, tail) : 0;
+        if (fused == 0) switch_c(type_code, tail);
+        sreg(15, greg(15) + 1);
+        new_block = branches != jumps;
+        if (idioms && new_block && greg(15) <= at) retired += loop_step(greg(15));
+        if (retired >= preempt_at && new_block) preempt();
+    }
+}
+
+/**
+ * read batch jobs list - guest input and output file, optional tenant and expected output file per line
+ */
+vector<job> read_jobs() {
+    vector<job> res;
+    ifstream fin(batch_file);
+    string line;
+    while (getline(fin, line, '\n')) {
+        vector<string> parts = split(line);
+        if (parts.size() >= 2)
+            res.push_back({parts[0], parts[1], parts.size() >= 3 ? parts[2] : "default", parts.size() >= 4 ? parts[3] : ""});
+    }
+    fin.close();
+    return res;
+}
+
+/**
+ * get cpus runner is allowed to use. With no_smt only first hardware thread of each core is taken
+ */
+vector<int> worker_cpus() {
+    vector<int> res;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set)) continue;
+        if (no_smt) {
+            char path[128];
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+            FILE *fp = fopen(path, "r");
+            int first = cpu;
+            if (fp != nullptr) {
+                if (fscanf(fp, "%d", &first) != 1) first = cpu;
+                fclose(fp);
+            }
+            if (first != cpu) continue;
+        }
+        res.push_back(cpu);
+    }
+    if (res.empty()) res.push_back(0);
+    return res;
+}
+
+/**
+ * write job result to shared memory, called on machine exit
+ */
+void report_job() {
+    result->retired = retired;
+    result->branches = branches;
+    memcpy(result->perf_value, perf_value, sizeof(perf_value));
+    if (expected != nullptr && result->mismatch < 0 && out_pos < expected_size) result->mismatch = (long long) out_pos;
+    if (job_store.base != nullptr) {
+        store_entry &e = job_store.index[result - results];
+        uint64_t size = captured.size(), length = size;
+        e.offset = store_reserve(job_store, length);
+        memcpy(job_store.data + e.offset, captured.data(), length);
+        e.length = length;
+        e.truncated = length < size;
+    }
+    result->done = 1;
+}
+
+/**
+ * fault in n bytes of guest memory from begin in chunks, stopping between chunks once job is handed over
+ * \param[writable] - fault pages in writable, otherwise only map them for reading
+ */
+void populate(char *begin, size_t n, bool writable) {
+    const size_t CHUNK = 1 << 21;
+    for (size_t from = 0; from < n && !__atomic_load_n(&prefault_stop, __ATOMIC_RELAXED); from += CHUNK) {
+        size_t len = min(CHUNK, n - from);
+#if defined(MADV_POPULATE_WRITE) && defined(MADV_POPULATE_READ)
+        if (madvise(begin + from, len, writable ? MADV_POPULATE_WRITE : MADV_POPULATE_READ) == 0) continue;
+#endif
+        for (size_t i = from; i < from + len; i += 4096) {
+            if (writable) __atomic_fetch_add(begin + i, 0, __ATOMIC_RELAXED);
+            else (void) __atomic_load_n(begin + i, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * executed on idle priority thread of spare machine: fault in guest memory, so job doesn't wait for page faults.
+ * Pages stay as zero as fork left them. Pages of shared image are only mapped for reading, so they stay shared
+ * until guest writes to them
+ */
+void prefault_memory() {
+    sched_param param = {0};
+    sched_setscheduler(0, SCHED_IDLE, &param);
+    char *begin = (char *) mem;
+    populate(begin, shared_bytes, false);
+    populate(begin + shared_bytes, MEMSIZE * sizeof(word) - shared_bytes, true);
+}
+
+/**
+ * job was handed over to spare machine: stop prefaulting and wait for prefaulter, so guest is the only
+ * one touching its memory
+ */
+void stop_prefault() {
+    __atomic_store_n(&prefault_stop, true, __ATOMIC_RELAXED);
+    if (prefaulter.joinable()) prefaulter.join();
+}
+
+/**
+ * executed in spare machine: pin to cpu, prefer cpu's numa node for guest memory and start prefaulting it
+ * \param[cpu] - cpu of worker
+ */
+void prepare_machine(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+    unsigned int now_cpu = cpu, node = 0;
+    syscall(SYS_getcpu, &now_cpu, &node, nullptr);
+    unsigned long nodemask = 1UL << node;
+    syscall(SYS_mbind, mem, MEMSIZE * sizeof(word), MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, MPOL_MF_MOVE);
+    prefaulter = thread(prefault_memory);
+    machine_cpu = (int) now_cpu;
+    machine_node = (int) node;
+}
+
+/**
+ * executed in job process: connect guest input and output and run the machine
+ * \param[id] - number of job to run
+ */
+void run_job(size_t id) {
+    result = results + id;
+    if (slice > 0) preempt_at = slice;
+    result->cpu = machine_cpu;
+    result->node = machine_node;
+    result->mismatch = -1;
+    if (profile != nullptr) profile_path = string(profile) + "." + to_string(id);
+    if (!jobs[id].expected.empty()) {
+        int fd = open(jobs[id].expected.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            perror(jobs[id].expected.c_str());
+            _exit(127);
+        }
+        expected_size = st.st_size;
+        expected = expected_size > 0 ? (const char *) mmap(nullptr, expected_size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+        close(fd);
+        if (expected == MAP_FAILED) {
+            perror(jobs[id].expected.c_str());
+            _exit(127);
+        }
+    }
+    atexit(report_job);
+    if (freopen(jobs[id].in.c_str(), "r", stdin) == nullptr ||
+        (job_store.base == nullptr && freopen(jobs[id].out.c_str(), "w", stdout) == nullptr)) {
+        perror(jobs[id].in.c_str());
+        _exit(127);
+    }
+    emulate();
+}
+
+/**
+ * fork spare machine for worker slot. It prepares itself and waits for job number in pipe
+ * \param[s] - worker slot
+ * \param[cpu] - cpu of worker
+ * \param[feeds] - pipes to spare machines of every slot, pipe of this slot is written here
+ * \return pid of spare machine, 0 if it can't be forked
+ */
+pid_t spawn_machine(int s, int cpu, vector<int> &feeds) {
+    int fd[2];
+    if (pipe(fd) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fd[0]);
+        close(fd[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        for (int f : feeds) if (f >= 0) close(f);
+        close(fd[1]);
+        prepare_machine(cpu);
+        size_t id;
+        if (read(fd[0], &id, sizeof(id)) != sizeof(id)) _exit(0);
+        close(fd[0]);
+        stop_prefault();
+        run_job(id);
+    }
+    close(fd[0]);
+    feeds[s] = fd[1];
+    return pid;
+}
+
+/**
+ * tenant of batch job, tenants without -tenant option get weight 1
+ */
+tenant_queue &tenant_of(const string &name) {
+    for (tenant_queue &t : tenants) if (t.name == name) return t;
+    tenants.push_back({name, 1, 0, {}});
+    return tenants.back();
+}
+
+/**
+ * choose job to run next slice by deficit round robin over tenants
+ * \param[turn] - tenant whose turn it is, moved along rounds
+ * \param[quantum] - instructions tenant of weight 1 gets per round
+ * \param[id] - chosen job
+ * \return false if no job is waiting
+ */
+bool pick_job(size_t &turn, long long quantum, size_t &id) {
+    bool waiting = false;
+    for (tenant_queue &t : tenants) waiting |= !t.queue.empty();
+    if (!waiting) return false;
+    while (true) {
+        tenant_queue &t = tenants[turn];
+        if (!t.queue.empty() && t.deficit > 0) {
+            id = t.queue.front();
+            t.queue.pop_front();
+            t.deficit -= quantum;
+            return true;
+        }
+        if (t.queue.empty()) t.deficit = min(t.deficit, 0LL);
+        else t.deficit += quantum * t.weight;
+        turn = (turn + 1) % tenants.size();
+    }
+}
+
+/**
+ * batch mode - run assembled programm on every job. Every worker slot keeps spare machine ready,
+ * so job starts with a write to pipe, and the next spare is prepared while other jobs run.
+ * Jobs run in slices of instructions, tenants share workers by deficit round robin
+ */
+void run_batch() {
+    jobs = read_jobs();
+    vector<int> cpus = worker_cpus();
+    if (workers <= 0) workers = (int) cpus.size();
+    results = (job_result *) mmap(nullptr, sizeof(job_result) * (jobs.size() + 1), PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (store_file != nullptr && !store_create(job_store, store_file, jobs.size(), store_capacity)) {
+        perror(store_file);
+        exit(1);
+    }
+    vector<size_t> owner(jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++) tenant_of(jobs[i].tenant);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        owner[i] = &tenant_of(jobs[i].tenant) - tenants.data();
+        tenants[owner[i]].queue.push_back(i);
+    }
+    long long quantum = slice > 0 ? (long long) slice : 1000000;
+    vector<int> codes(jobs.size(), -1);
+    vector<pid_t> job_pid(jobs.size(), 0);
+    vector<dword> charged(jobs.size(), 0);
+    vector<int> feeds(workers, -1);
+    vector<pid_t> spares(workers, 0), running(workers, 0);
+    vector<size_t> slot_job(workers, 0);
+    size_t started = 0, finished = 0, turn = 0;
+    fflush(stdout);
+    for (int s = 0; s < workers; s++) spares[s] = spawn_machine(s, cpus[s % cpus.size()], feeds);
+    while (finished < jobs.size()) {
+        for (int s = 0; s < workers; s++) {
+            size_t id;
+            if (running[s] != 0 || !pick_job(turn, quantum, id)) continue;
+            int cpu = cpus[s % cpus.size()];
+            if (job_pid[id] == 0) {
+                if (spares[s] == 0) spares[s] = spawn_machine(s, cpu, feeds);
+                if (spares[s] == 0) {
+                    started++;
+                    finished++;
+                    continue;
+                }
+                if (write(feeds[s], &id, sizeof(id)) != sizeof(id)) perror("write");
+                close(feeds[s]);
+                feeds[s] = -1;
+                job_pid[id] = spares[s];
+                spares[s] = 0;
+                started++;
+            } else {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                sched_setaffinity(job_pid[id], sizeof(set), &set);
+                kill(job_pid[id], SIGCONT);
+            }
+            running[s] = job_pid[id];
+            slot_job[s] = id;
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, WUNTRACED);
+        if (pid < 0) break;
+        for (int s = 0; s < workers; s++) {
+            if (spares[s] == pid) {
+                spares[s] = 0;
+                close(feeds[s]);
+                feeds[s] = -1;
+            }
+            if (running[s] != pid) continue;
+            size_t id = slot_job[s];
+            tenant_queue &t = tenants[owner[id]];
+            t.deficit += quantum - (long long) (results[id].retired - charged[id]);
+            charged[id] = results[id].retired;
+            if (WIFSTOPPED(status)) {
+                t.queue.push_back(id);
+            } else {
+                if (WIFEXITED(status)) codes[id] = WEXITSTATUS(status);
+                finished++;
+            }
+            running[s] = 0;
+            if (spares[s] == 0 && started < jobs.size()) spares[s] = spawn_machine(s, cpus[s % cpus.size()], feeds);
+        }
+    }
+    for (int s = 0; s < workers; s++) {
+        if (spares[s] == 0) continue;
+        close(feeds[s]);
+        waitpid(spares[s], nullptr, 0);
+    }
+    for (size_t i = 0; i < jobs.size() && job_store.base != nullptr; i++) {
+        store_entry &e = job_store.index[i];
+        e.status = results[i].done ? codes[i] : -1;
+        e.retired = results[i].retired;
+        e.branches = results[i].branches;
+        e.mismatch = results[i].mismatch;
+        memcpy(e.counters, results[i].perf_value, sizeof(e.counters));
+    }
+    store_close(job_store);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (!results[i].done) {
+            printf("job %zu: failed\n", i);
+            continue;
+        }
+        printf("job %zu: exit %d, %llu instructions, cpu %d, node %d\n", i, codes[i], results[i].retired,
+               results[i].cpu, results[i].node);
+        if (!jobs[i].expected.empty()) {
+            if (results[i].mismatch < 0) printf("job %zu: output matches\n", i);
+            else printf("job %zu: wrong output at byte %lld\n", i, results[i].mismatch);
+        }
+        if (perf) print_perf(stdout, results[i].perf_value, results[i].retired, results[i].branches);
+    }
+    munmap(results, sizeof(job_result) * (jobs.size() + 1));
+}
+
+/**
+ * create empty temporary file only this process made, so no link planted under a guessed name is followed
+ * \param[kind] - part of file name
+ * \return path of created file
+ */
+string temp_file(const char *kind) {
+    string path = string("/tmp/mipt-") + kind + "-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    return path;
+}
+
+/**
+ * write input of size n for complexity mode from template or generator command
+ * \param[n] - size of input
+ * \param[path] - file to write input to
+ */
+bool make_input(dword n, const string &path) {
+    if (gen_command != nullptr) {
+        string command = string(gen_command) + " " + to_string(n) + " > " + path;
+        return system(command.c_str()) == 0;
+    }
+    ifstream fin(gen_template);
+    string text((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+    fin.close();
+    FILE *fp = fopen(path.c_str(), "w");
+    if (fp == nullptr) return false;
+    dword seed = 12345;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text.compare(i, 3, "{n}") == 0) {
+            fprintf(fp, "%llu", n);
+            i += 2;
+        } else if (text.compare(i, 5, "{seq}") == 0) {
+            for (dword k = 0; k < n; k++) {
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                fprintf(fp, k + 1 < n ? "%llu " : "%llu", (seed >> 33) % 1000000);
+            }
+            i += 4;
+        } else fputc(text[i], fp);
+    }
+    fclose(fp);
+    return true;
+}
+
+/**
+ * complexity mode - run programm on inputs of doubling sizes, fit instructions count with
+ * a * f(n) + b for every candidate f and report the best fit
+ */
+void run_complexity() {
+    const char *name[] = {"1", "log n", "n", "n log n", "n^2", "n^2 log n", "n^3", "2^n"};
+    const int MODELS = 8;
+    vector<double> sizes, counts;
+    string path = temp_file("input");
+    results = (job_result *) mmap(nullptr, sizeof(job_result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        unlink(path.c_str());
+        return;
+    }
+    jobs.push_back({path, "/dev/null", "default", ""});
+    for (dword n = max(ladder_from, 1ULL); n <= ladder_to; n *= 2) {
+        if (!make_input(n, path)) {
+            fprintf(stderr, "can't make input of size %llu\n", n);
+            break;
+        }
+        results->done = 0;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) run_job(0);
+        int status;
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !results->done) {
+            fprintf(stderr, "machine failed on size %llu\n", n);
+            break;
+        }
+        printf("n = %llu: %llu instructions\n", n, results->retired);
+        sizes.push_back(n);
+        counts.push_back(results->retired);
+    }
+    unlink(path.c_str());
+    munmap(results, sizeof(job_result));
+    if (sizes.size() < 3) {
+        printf("need at least 3 sizes to fit complexity\n");
+        return;
+    }
+    double err[MODELS];
+    int best = -1, second = -1;
+    for (int m = 0; m < MODELS; m++) {
+        double sw = 0, sf = 0, sff = 0, st = 0, sft = 0;
+        vector<double> f(sizes.size());
+        for (size_t i = 0; i < sizes.size(); i++) {
+            double n = sizes[i], w = 1 / (counts[i] * counts[i]);
+            double fn[] = {1, log2(n), n, n * log2(n), n * n, n * n * log2(n), n * n * n, pow(2, n)};
+            f[i] = fn[m];
+            sw += w, sf += w * f[i], sff += w * f[i] * f[i], st += w * counts[i], sft += w * f[i] * counts[i];
+        }
+        double det = sw * sff - sf * sf;
+        double a = m == 0 ? 0 : (sw * sft - sf * st) / det, b = (st - a * sf) / sw;
+        err[m] = INFINITY;
+        if (!isfinite(a) || !isfinite(b) || a < 0 || (m > 0 && fabs(det) < 1e-300)) continue;
+        double sum = 0;
+        for (size_t i = 0; i < sizes.size(); i++) sum += pow((counts[i] - a * f[i] - b) / counts[i], 2);
+        err[m] = sqrt(sum / sizes.size());
+        printf("%-10s relative error %.4lf\n", name[m], err[m]);
+        if (best < 0 || err[m] < err[best]) second = best, best = m;
+        else if (second < 0 || err[m] < err[second]) second = m;
+    }
+    if (best < 0) return;
+    double confidence = second < 0 || err[second] == 0 ? 1 : 1 - err[best] / err[second];
+    printf("best fit: O(%s), confidence %.1lf%%\n", name[best], 100 * confidence);
+}
+
+/**
+ * nearest rank percentile of sorted values
+ */
+dword percentile(const vector<dword> &sorted, double p) {
+    size_t rank = (size_t) ceil(p * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * merge profiles of many runs by image and print hotspot report: share of instructions per label
+ * and percentiles of its per run cost
+ * \param[files] - profiles written with -profile
+ */
+void merge_profiles(const vector<string> &files) {
+    map<string, vector<dword>> totals; /// image - instructions of every run
+    map<string, map<string, vector<dword>>> costs; /// image - label - instructions of every run
+    map<string, map<string, dword>> blocks; /// image - label - blocks of all runs
+    for (const string &file : files) {
+        ifstream fin(file);
+        string line, image;
+        dword instructions = 0;
+        map<string, dword> run;
+        while (getline(fin, line, '\n')) {
+            vector<string> parts = split(line);
+            if (parts.size() == 2 && parts[0] == "image") image = parts[1];
+            else if (parts.size() == 2 && parts[0] == "instructions") instructions = strtoull(parts[1].c_str(), nullptr, 10);
+            else if (parts.size() == 4 && parts[0] == "label") {
+                run[parts[1]] += strtoull(parts[2].c_str(), nullptr, 10);
+                blocks[image][parts[1]] += strtoull(parts[3].c_str(), nullptr, 10);
+            }
+        }
+        fin.close();
+        if (image.empty()) {
+            fprintf(stderr, "%s: not a profile\n", file.c_str());
+            continue;
+        }
+        size_t runs = totals[image].size();
+        for (auto &l : run) costs[image][l.first].resize(runs, 0);
+        for (auto &l : costs[image]) l.second.push_back(run.count(l.first) ? run[l.first] : 0);
+        totals[image].push_back(instructions);
+    }
+    for (auto &img : totals) {
+        vector<dword> sorted = img.second;
+        sort(sorted.begin(), sorted.end());
+        dword sum = 0;
+        for (dword x : sorted) sum += x;
+        printf("image %s: %zu runs, %llu instructions, per run p50 %llu p90 %llu p99 %llu max %llu\n",
+               img.first.c_str(), sorted.size(), sum, percentile(sorted, 0.5), percentile(sorted, 0.9),
+               percentile(sorted, 0.99), sorted.back());
+        vector<pair<dword, string>> hot;
+        for (auto &l : costs[img.first]) {
+            dword total = 0;
+            for (dword x : l.second) total += x;
+            hot.push_back({total, l.first});
+        }
+        sort(hot.rbegin(), hot.rend());
+        printf("  %-20s %7s %14s %12s %10s %10s %10s %10s\n", "label", "share", "instructions", "blocks", "p50", "p90",
+               "p99", "max");
+        for (auto &h : hot) {
+            vector<dword> run = costs[img.first][h.second];
+            sort(run.begin(), run.end());
+            printf("  %-20s %6.2lf%% %14llu %12llu %10llu %10llu %10llu %10llu\n", h.second.c_str(),
+                   sum > 0 ? 100.0 * h.first / sum : 0.0, h.first, blocks[img.first][h.second], percentile(run, 0.5),
+                   percentile(run, 0.9), percentile(run, 0.99), run.back());
+        }
+    }
+}
+
+/**
+ * counters of one run in A/B comparison, read back from its profile
+ */
+struct ab_run {
+    dword value[4] = {0, 0, 0, 0}; /// instructions, syscalls, touched pages, modelled cycles
+    map<string, dword> labels; /// instructions per label
+    string output; /// guest output
+    bool ok = false; /// run finished and wrote profile
+};
+
+/**
+ * run one version of programm on input in forked machine with profile enabled
+ * \param[source] - asm file of version
+ * \param[in] - guest input
+ */
+ab_run run_version(const char *source, const string &in) {
+    ab_run res;
+    string out = temp_file("ab-out"), prof = temp_file("ab-prof");
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        unlink(prof.c_str());
+        unlink(out.c_str());
+        return res;
+    }
+    if (pid == 0) {
+        source_file = source;
+        file_input();
+        source_hash = image_hash();
+        assemble();
+        profile = prof.c_str();
+        start_profile();
+        if (freopen(in.c_str(), "r", stdin) == nullptr || freopen(out.c_str(), "w", stdout) == nullptr) {
+            perror(in.c_str());
+            _exit(127);
+        }
+        emulate();
+    }
+    waitpid(pid, nullptr, 0);
+    ifstream fin(prof);
+    string line;
+    const char *name[4] = {"instructions", "syscalls", "touched", "cycles"};
+    while (getline(fin, line, '\n')) {
+        vector<string> parts = split(line);
+        for (int k = 0; k < 4; k++)
+            if (parts.size() == 2 && parts[0] == name[k]) res.value[k] = strtoull(parts[1].c_str(), nullptr, 10);
+        if (parts.size() == 2 && parts[0] == "instructions") res.ok = true;
+        if (parts.size() == 4 && parts[0] == "label") res.labels[parts[1]] = strtoull(parts[2].c_str(), nullptr, 10);
+    }
+    fin.close();
+    ifstream fout(out);
+    res.output = string((istreambuf_iterator<char>(fout)), istreambuf_iterator<char>());
+    fout.close();
+    unlink(prof.c_str());
+    unlink(out.c_str());
+    return res;
+}
+
+/**
+ * A/B mode - run versions A (source_file) and B (ab_source) on every recorded input and report differences
+ * of instructions, syscalls, touched memory and modelled cycles per input, in total with statistics of per
+ * input ratios, and per label. Counts are deterministic, so one run per input is enough
+ */
+void run_ab() {
+    const char *metric[4] = {"instructions", "syscalls", "touched kB", "cycles"};
+    const dword scale[4] = {1, 1, 4, 1};
+    dword total[2][4] = {{0}};
+    vector<double> ratios[4];
+    size_t better[4] = {0}, worse[4] = {0};
+    map<string, dword> labels[2];
+    for (const string &in : ab_inputs) {
+        ab_run a = run_version(source_file, in), b = run_version(ab_source, in);
+        if (!a.ok) printf("%s: version A failed\n", in.c_str());
+        if (!b.ok) printf("%s: version B failed\n", in.c_str());
+        if (!a.ok || !b.ok) continue;
+        printf("%s:%s\n", in.c_str(), a.output == b.output ? "" : " outputs differ");
+        for (int k = 0; k < 4; k++) {
+            dword x = a.value[k] * scale[k], y = b.value[k] * scale[k];
+            printf("  %-14s %14llu %14llu %+9.2lf%%\n", metric[k], x, y, x > 0 ? 100.0 * ((double) y - x) / x : 0.0);
+            total[0][k] += x, total[1][k] += y;
+            if (x > 0 && y > 0) ratios[k].push_back((double) y / x);
+            better[k] += y < x, worse[k] += y > x;
+        }
+        for (auto &l : a.labels) labels[0][l.first] += l.second;
+        for (auto &l : b.labels) labels[1][l.first] += l.second;
+    }
+    printf("total over %zu inputs:\n", ab_inputs.size());
+    printf("  %-14s %14s %14s %10s %10s %10s %10s %7s\n", "", "A", "B", "change", "geomean", "min", "max",
+           "B<A/B>A");
+    for (int k = 0; k < 4; k++) {
+        double log_sum = 0, low = INFINITY, high = 0;
+        for (double r : ratios[k]) log_sum += log(r), low = min(low, r), high = max(high, r);
+        double mean = ratios[k].empty() ? 1 : exp(log_sum / ratios[k].size());
+        if (ratios[k].empty()) low = high = 1;
+        printf("  %-14s %14llu %14llu %+9.2lf%% %10.4lf %10.4lf %10.4lf %3zu/%-3zu\n", metric[k], total[0][k],
+               total[1][k], total[0][k] > 0 ? 100.0 * ((double) total[1][k] - total[0][k]) / total[0][k] : 0.0,
+               mean, low, high, better[k], worse[k]);
+    }
+    vector<pair<dword, string>> order;
+    for (int v = 0; v < 2; v++)
+        for (auto &l : labels[v])
+            if (v == 0 || !labels[0].count(l.first)) {
+                dword x = labels[0][l.first], y = labels[1][l.first];
+                order.push_back({x > y ? x - y : y - x, l.first});
+            }
+    sort(order.rbegin(), order.rend());
+    printf("per label instructions:\n  %-20s %14s %14s %10s\n", "label", "A", "B", "change");
+    for (auto &o : order) {
+        dword x = labels[0][o.second], y = labels[1][o.second];
+        if (x == 0 && y == 0) continue;
+        printf("  %-20s %14llu %14llu ", o.second.c_str(), x, y);
+        if (x > 0) printf("%+9.2lf%%\n", 100.0 * ((double) y - x) / x);
+        else printf("%10s\n", "new");
+    }
+}
+
+/**
+ * handler call of instruction in generated fused sequence, operands are decoded from tail
+ * \param[type] - type of instruction
+ */
+string fused_call(int type) {
+    const map<int, string> HANDLER = {
+            {2,  "add r1 r2 mod"},
+            {3,  "addi r1 mod"},
+            {4,  "sub r1 r2 mod"},
+            {5,  "subi r1 mod"},
+            {6,  "mul r1 r2"},
+            {7,  "muli r1 mod"},
+            {8,  "div r1 r2"},
+            {9,  "divi r1 mod"},
+            {12, "lc r1 mod"},
+            {13, "shl r1 r2"},
+            {14, "shli r1 mod"},
+            {15, "shr r1 r2"},
+            {16, "shri r1 mod"},
+            {17, "and1 r1 r2"},
+            {18, "andi r1 mod"},
+            {19, "or1 r1 r2"},
+            {20, "ori r1 mod"},
+            {21, "xor1 r1 r2"},
+            {22, "xori r1 mod"},
+            {23, "not1 r1"},
+            {24, "mov r1 r2 mod"},
+            {32, "addd r1 r2"},
+            {33, "subd r1 r2"},
+            {34, "muld r1 r2"},
+            {35, "divd r1 r2"},
+            {36, "itod r1 r2"},
+            {37, "dtoi r1 r2"},
+            {38, "push r1 mod"},
+            {39, "pop r1 mod"},
+            {43, "cmp r1 r2"},
+            {44, "cmpi r1 mod"},
+            {45, "cmpd r1 r2"},
+            {64, "load r1 mod"},
+            {65, "store r1 mod"},
+            {66, "load2 r1 mod"},
+            {67, "store2 r1 mod"},
+            {68, "loadr r1 r2 mod"},
+            {69, "loadr2 r1 r2 mod"},
+            {70, "storer r1 r2 mod"},
+            {71, "storer2 r1 r2 mod"}
+    };
+    vector<string> parts = split(HANDLER.at(type));
+    string res = parts[0] + "(";
+    for (size_t i = 1; i < parts.size(); i++) {
+        if (i > 1) res += ", ";
+        if (parts[i] == "r1") res += "ts4(tail)";
+        else if (parts[i] == "r2") res += "tt4(tail)";
+        else res += TYPE[type] == TYPE_RR ? "tl16(tail)" : "tl20(tail)";
+    }
+    return res + ")";
+}
+
+/**
+ * generate fused.inc from profiles: fused_step() executes the n sequences which save most dispatches in one step.
+ * Every following instruction is fetched, checked and counted right before it executes, so fused sequence gives
+ * the same result as executing its instructions one by one
+ * \param[n] - number of sequences
+ * \param[file] - generated file
+ * \param[files] - profiles
+ */
+void write_fused(size_t n, const char *file, const vector<string> &files) {
+    map<vector<int>, dword> counts;
+    for (const string &f : files) {
+        ifstream fin(f);
+        string line;
+        while (getline(fin, line, '\n')) {
+            vector<string> parts = split(line);
+            if (parts.size() != 3 || parts[0] != "seq") continue;
+            vector<int> seq;
+            for (const char *c = parts[1].c_str(); *c != 0; c += *c == '+') seq.push_back(strtol(c, (char **) &c, 10));
+            counts[seq] += strtoull(parts[2].c_str(), nullptr, 10);
+        }
+        fin.close();
+    }
+    vector<pair<dword, vector<int>>> top;
+    for (auto &c : counts) top.push_back({c.second * (c.first.size() - 1), c.first});
+    sort(top.begin(), top.end(), [](const pair<dword, vector<int>> &a, const pair<dword, vector<int>> &b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    if (top.size() > n) top.resize(n);
+    sort(top.begin(), top.end(), [](const pair<dword, vector<int>> &a, const pair<dword, vector<int>> &b) {
+        if (a.second[0] != b.second[0]) return a.second[0] < b.second[0];
+        if (a.second.size() != b.second.size()) return a.second.size() > b.second.size();
+        return a.first > b.first;
+    });
+    FILE *fp = fopen(file, "w");
+    if (fp == nullptr) {
+        perror(file);
+        exit(1);
+    }
+    fprintf(fp, "// generated by mipt32 -fuse from %zu profiles, do not edit\n\n", files.size());
+    fprintf(fp, "/**\n * execute instruction at pc together with following ones if they form frequent sequence\n");
+    fprintf(fp, " * \\param[type] - type of instruction at pc\n * \\param[tail] - operands of instruction at pc\n");
+    fprintf(fp, " * \\return number of executed instructions, 0 if no sequence starts at pc\n */\n");
+    fprintf(fp, "word fused_step(word type, word tail) {\n");
+    if (!top.empty()) {
+        fprintf(fp, "    word pc = greg(15), next;\n    switch (type) {\n");
+        for (size_t i = 0; i < top.size(); i++) {
+            const vector<int> &seq = top[i].second;
+            if (i == 0 || seq[0] != top[i - 1].second[0]) fprintf(fp, "        case %d:\n", seq[0]);
+            fprintf(fp, "            // %llu dispatches saved\n", top[i].first);
+            fprintf(fp, "            if (pc + %zu < MEMSIZE", seq.size() - 1);
+            for (size_t k = 1; k < seq.size(); k++) fprintf(fp, " && fuse_match(gmem(pc + %zu), %d)", k, seq[k]);
+            fprintf(fp, ") {\n                %s;\n", fused_call(seq[0]).c_str());
+            for (size_t k = 1; k < seq.size(); k++) {
+                string at = k == 1 ? "pc" : "pc + " + to_string(k - 1);
+                fprintf(fp, "                next = gmem(pc + %zu);\n", k);
+                fprintf(fp, "                if (greg(15) != %s || !fuse_match(next, %d)) return %zu;\n", at.c_str(), seq[k], k);
+                fprintf(fp, "                sreg(15, pc + %zu);\n                tail = tl24(next);\n                retired++;\n", k);
+                fprintf(fp, "                %s;\n", fused_call(seq[k]).c_str());
+            }
+            fprintf(fp, "                return %zu;\n            }\n", seq.size());
+            if (i + 1 == top.size() || top[i + 1].second[0] != seq[0]) fprintf(fp, "            break;\n");
+        }
+        fprintf(fp, "    }\n");
+    } else fprintf(fp, "    (void) type;\n    (void) tail;\n");
+    fprintf(fp, "    return 0;\n}\n");
+    fclose(fp);
+    fprintf(stderr, "%s: %zu sequences\n", file, top.size());
+}
+
+/**
+ * print entry and output of batch job from result store
+ * \param[file] - result store
+ * \param[id] - number of job
+ */
+void lookup_result(const char *file, dword id) {
+    result_store st;
+    if (!store_open(st, file)) {
+        fprintf(stderr, "%s: not a result store\n", file);
+        exit(1);
+    }
+    const char *output;
+    const store_entry *e = store_get(st, id, &output);
+    if (e == nullptr) {
+        fprintf(stderr, "no valid entry of job %llu in %s\n", id, file);
+        exit(1);
+    }
+    fprintf(stderr, "job %llu: exit %d, %llu instructions, %llu bytes of output%s\n", id, e->status,
+            (dword) e->retired, (dword) e->length, e->truncated ? " (truncated)" : "");
+    if (e->mismatch >= 0) fprintf(stderr, "job %llu: wrong output at byte %lld\n", id, (long long) e->mismatch);
+    fwrite(output, 1, e->length, stdout);
+    store_close(st);
+}
+
+/**
+ * start recording execution trace to trace_file. Fused sequences, loop idioms and clones are turned off, so every
+ * instruction gets its own records
+ */
+void start_trace() {
+    trace_out = fopen(trace_file, "wb");
+    if (trace_out == nullptr) {
+        perror(trace_file);
+        exit(1);
+    }
+    trace_put(TRACE_MAGIC, MEMSIZE, 17);
+    trace_buf[0].step = 0;
+    fuse = false;
+    idioms = false;
+    fork_width = 0;
+    atexit(flush_trace);
+}
+
+/**
+ * header of trace index: start of every key's entries, then entries of all keys ordered by key and step
+ */
+struct trace_index_header {
+    dword magic; /// TRACE_MAGIC
+    dword kind; /// TRACE_PC - executions by pc, TRACE_REG - writes by register, TRACE_MEM - writes by address
+    dword keys; /// number of keys
+    dword entries; /// number of entries
+};
+
+/**
+ * entry of trace index
+ */
+struct trace_entry {
+    dword step; /// instruction which made record
+    dword value; /// executed instruction or written value
+};
+
+const char *TRACE_INDEX[3] = {".pc", ".reg", ".mem"}; /// suffixes of index files of kinds
+
+/**
+ * build per pc execution lists, per register and per address write lists of trace in files trace.pc, trace.reg
+ * and trace.mem. Entries are placed by counting sort in two sequential passes over the mapped trace, so lists
+ * come out ordered by step and memory used doesn't depend on trace size
+ * \param[path] - trace recorded with -trace
+ */
+void index_trace(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(trace_record)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        exit(1);
+    }
+    auto *rec = (const trace_record *) mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    dword n = st.st_size / sizeof(trace_record);
+    if (rec == MAP_FAILED || rec[0].kind != TRACE_MAGIC) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        exit(1);
+    }
+    madvise((void *) rec, st.st_size, MADV_SEQUENTIAL);
+    dword keys[3] = {rec[0].where, rec[0].value, rec[0].where};
+    vector<dword> start[3];
+    for (int k = 0; k < 3; k++) start[k].assign(keys[k] + 1, 0);
+    for (dword i = 1; i < n; i++) {
+        dword k = rec[i].kind - TRACE_PC;
+        if (k < 3 && rec[i].where < keys[k]) start[k][rec[i].where + 1]++;
+    }
+    trace_entry *entry[3];
+    for (int k = 0; k < 3; k++) {
+        for (dword key = 0; key < keys[k]; key++) start[k][key + 1] += start[k][key];
+        string name = string(path) + TRACE_INDEX[k];
+        size_t table = sizeof(trace_index_header) + (keys[k] + 1) * sizeof(dword);
+        size_t size = table + start[k][keys[k]] * sizeof(trace_entry);
+        int out = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        char *base = out < 0 || ftruncate(out, size) != 0 ? (char *) MAP_FAILED :
+                     (char *) mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+        if (base == MAP_FAILED) {
+            perror(name.c_str());
+            exit(1);
+        }
+        close(out);
+        *(trace_index_header *) base = {TRACE_MAGIC, (dword) k + TRACE_PC, keys[k], start[k][keys[k]]};
+        memcpy(base + sizeof(trace_index_header), start[k].data(), (keys[k] + 1) * sizeof(dword));
+        entry[k] = (trace_entry *) (base + table);
+    }
+    for (dword i = 1; i < n; i++) {
+        dword k = rec[i].kind - TRACE_PC;
+        if (k < 3 && rec[i].where < keys[k]) entry[k][start[k][rec[i].where]++] = {rec[i].step, rec[i].value};
+    }
+    fprintf(stderr, "%s: %llu records, %llu executions, %llu register writes, %llu memory writes\n", path, n - 1,
+            start[0][keys[0] - 1], start[1][keys[1] - 1], start[2][keys[2] - 1]);
+    munmap((void *) rec, st.st_size);
+}
+
+/**
+ * mapped trace index
+ */
+struct trace_index {
+    const trace_index_header *head;
+    const dword *start; /// first entry of every key, keys + 1 values
+    const trace_entry *entry;
+};
+
+/**
+ * map index file of kind built by index_trace()
+ */
+trace_index open_index(const char *path, int kind) {
+    string name = string(path) + TRACE_INDEX[kind - TRACE_PC];
+    int fd = open(name.c_str(), O_RDONLY);
+    struct stat st;
+    const char *base = (const char *) MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(trace_index_header))
+        base = (const char *) mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd >= 0) close(fd);
+    if (base == MAP_FAILED || ((const trace_index_header *) base)->magic != TRACE_MAGIC) {
+        fprintf(stderr, "%s: no index, build it with -index-trace %s\n", name.c_str(), path);
+        exit(1);
+    }
+    trace_index res;
+    res.head = (const trace_index_header *) base;
+    res.start = (const dword *) (base + sizeof(trace_index_header));
+    res.entry = (const trace_entry *) (res.start + res.head->keys + 1);
+    return res;
+}
+
+/**
+ * answer question about indexed trace, printing one "step value" line per found entry:
+ *  write <address> <step> - last write to address before step. Writes of words covering address count in mipt64
+ *  pc <pc> - all executions of instruction at pc
+ *  reg <register> - value history of register
+ * \param[path] - trace indexed with -index-trace
+ */
+void query_trace(const char *path, const char *what, const vector<string> &args) {
+    dword key = args.empty() ? 0 : strtoull(args[0].c_str(), nullptr, 10);
+    if (strcmp(what, "write") == 0 && args.size() >= 2) {
+        trace_index ix = open_index(path, TRACE_MEM);
+        dword before = strtoull(args[1].c_str(), nullptr, 10), best = 0, value = 0;
+        if (key >= ix.head->keys) {
+            fprintf(stderr, "address %llu is outside traced memory\n", key);
+            exit(1);
+        }
+        const trace_entry *first = ix.entry + ix.start[key], *last = ix.entry + ix.start[key + 1];
+        const trace_entry *e = lower_bound(first, last, before, [](const trace_entry &x, dword step) {
+            return x.step < step;
+        });
+        if (e != first) {
+            best = (e - 1)->step;
+            value = (e - 1)->value;
+        }
+        if (best == 0) fprintf(stderr, "no write to %llu before step %llu\n", key, before);
+        else printf("%llu %llu\n", best, value);
+    } else if ((strcmp(what, "pc") == 0 || strcmp(what, "reg") == 0) && args.size() >= 1) {
+        trace_index ix = open_index(path, what[0] == 'p' ? TRACE_PC : TRACE_REG);
+        if (key >= ix.head->keys) {
+            fprintf(stderr, "%s %llu is outside trace, keys are below %llu\n", what, key, ix.head->keys);
+            exit(1);
+        }
+        for (dword i = ix.start[key]; i < ix.start[key + 1]; i++)
+            printf("%llu %llu\n", ix.entry[i].step, ix.entry[i].value);
+    } else {
+        fprintf(stderr, "query is one of: write <address> <step>, pc <pc>, reg <register>\n");
+        exit(1);
+    }
+}
+
+/**
+ * milliseconds from one moment to another
+ * \param[from] - earlier moment
+ * \param[to] - later moment
+ */
+double elapsed_ms(const timespec &from, const timespec &to) {
+    return (to.tv_sec - from.tv_sec) * 1e3 + (to.tv_nsec - from.tv_nsec) / 1e6;
+}
+
+/**
+ * copy standard input of emulator to memfd, so every run of the programm gets all of it
+ * \return descriptor of input to give runs, /dev/null if emulator reads terminal
+ */
+int copy_input() {
+    int input = isatty(0) ? open("/dev/null", O_RDONLY) : memfd_create("coldstart-input", 0);
+    if (!isatty(0)) {
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(0, buf, sizeof(buf))) > 0)
+            if (write(input, buf, n) != n) break;
+    }
+    return input;
+}
+
+/**
+ * exec emulator as fresh process on whole input, guest output goes to /dev/null. Child takes its clock right
+ * before execve and the exec'd emulator reports moment it is about to execute first guest instruction through
+ * pipe MIPT_COLDSTART names
+ * \param[args] - arguments of exec'd emulator, null terminated
+ * \param[input] - standard input of run, read from start
+ * \param[first] - milliseconds from execve to first instruction are written here
+ * \param[total] - milliseconds from execve to exit are written here
+ * \return false if run ended before first instruction
+ */
+bool timed_run(vector<char *> &args, int input, double &first, double &total) {
+    lseek(input, 0, SEEK_SET);
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    timespec moments[2], end;
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(input, 0);
+        dup2(open("/dev/null", O_WRONLY), 1);
+        setenv("MIPT_COLDSTART", to_string(fds[1]).c_str(), 1);
+        clock_gettime(CLOCK_MONOTONIC, moments);
+        if (write(fds[1], moments, sizeof(timespec)) < 0) _exit(127);
+        execv("/proc/self/exe", args.data());
+        _exit(127);
+    }
+    close(fds[1]);
+    size_t got = 0;
+    ssize_t n;
+    while (got < sizeof(moments) && (n = read(fds[0], (char *) moments + got, sizeof(moments) - got)) > 0) got += n;
+    close(fds[0]);
+    waitpid(pid, nullptr, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (got < sizeof(moments)) return false;
+    first = elapsed_ms(moments[0], moments[1]);
+    total = elapsed_ms(moments[0], end);
+    return true;
+}
+
+/**
+ * exec emulator with the same arguments except -coldstart as fresh process coldstart_runs times. Every run gets
+ * the whole standard input of this process
+ * \param[argc] - number of arguments
+ * \param[argv] - arguments of emulator
+ */
+void run_coldstart(int argc, char **argv) {
+    vector<char *> args;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-coldstart") == 0 && i + 1 < argc) i++;
+        else args.push_back(argv[i]);
+    }
+    args.push_back(nullptr);
+    int input = copy_input();
+    vector<double> first, total;
+    for (int run = 0; run < coldstart_runs; run++) {
+        double to_first, to_exit;
+        if (!timed_run(args, input, to_first, to_exit)) {
+            fprintf(stderr, "run %d ended before first instruction\n", run);
+            continue;
+        }
+        first.push_back(to_first);
+        total.push_back(to_exit);
+    }
+    close(input);
+    if (first.empty()) return;
+    sort(first.begin(), first.end());
+    sort(total.begin(), total.end());
+    printf("cold start over %zu runs, ms:\n", first.size());
+    printf("  %-28s %10s %10s %10s\n", "", "median", "min", "max");
+    printf("  %-28s %10.3lf %10.3lf %10.3lf\n", "exec to first instruction", first[first.size() / 2], first[0], first.back());
+    printf("  %-28s %10.3lf %10.3lf %10.3lf\n", "exec to exit", total[total.size() / 2], total[0], total.back());
+    bool met = first[first.size() / 2] < 1;
+    printf("target 1 ms to first instruction: %s\n", met ? "met" : "missed");
+    if (!met && getauxval(AT_BASE) != 0) printf("emulator is linked dynamically, the target needs -static build\n");
+}
+
+/**
+ * exec emulator with the same arguments except -hugebench hugebench_runs times with guest memory on regular pages
+ * (-nohuge) and as many times on huge pages, alternating them, and compare time from first instruction to exit
+ * \param[argc] - number of arguments
+ * \param[argv] - arguments of emulator
+ */
+void run_hugebench(int argc, char **argv) {
+    vector<char *> huge, regular;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-hugebench") == 0 && i + 1 < argc) i++;
+        else if (strcmp(argv[i], "-nohuge") != 0) huge.push_back(argv[i]);
+    }
+    regular = huge;
+    regular.push_back((char *) "-nohuge");
+    huge.push_back(nullptr);
+    regular.push_back(nullptr);
+    int input = copy_input();
+    vector<double> times[2];
+    for (int run = 0; run < hugebench_runs; run++) {
+        for (int side = 0; side < 2; side++) {
+            double first, total;
+            if (timed_run(side == 0 ? regular : huge, input, first, total)) times[side].push_back(total - first);
+            else fprintf(stderr, "run %d ended before first instruction\n", run);
+        }
+    }
+    close(input);
+    if (times[0].empty() || times[1].empty()) return;
+    const char *name[2] = {"regular pages", page_mode == 2 ? "hugetlbfs pages" : "transparent huge pages"};
+    printf("guest memory pages over %d runs, ms from first instruction to exit:\n", hugebench_runs);
+    printf("  %-28s %10s %10s %10s\n", "", "median", "min", "max");
+    for (int side = 0; side < 2; side++) {
+        sort(times[side].begin(), times[side].end());
+        printf("  %-28s %10.3lf %10.3lf %10.3lf\n", name[side], times[side][times[side].size() / 2], times[side][0],
+               times[side].back());
+    }
+    double base = times[0][times[0].size() / 2], now = times[1][times[1].size() / 2];
+    printf("huge pages: %+.2lf%% time, %.3lfx speed\n", (now - base) / base * 100, now > 0 ? base / now : 0);
+}
+
+/**
+ * parse command line options:
+ *  -stats - print execution statistics to stderr on exit
+ *  -hugetlb - back guest memory with hugetlbfs pages, falls back to transparent huge pages
+ *  -nohuge - back guest memory with regular pages only
+ *  -batch <file> - run programm on every "input output [tenant [expected]]" line of file, one machine per job
+ *  -j <n> - number of batch jobs executed at once, one per allowed cpu by default
+ *  -nosmt - place batch workers on one hardware thread per core
+ *  -results <file> - write batch outputs and statuses to one mapped, indexed result store instead of output files
+ *  -results-size <mb> - megabytes preallocated for outputs in result store, 64 by default
+ *  -lookup <file> <job> - print status and output of job from result store
+ *  -trace <file> - record every executed instruction, register and memory write of run to file
+ *  -index-trace <file> - build per pc, register and address lists of trace for -query
+ *  -query <file> <question> - answer "write <address> <step>", "pc <pc>" or "reg <register>" from indexed trace
+ *  -profile <file> - write per label instructions and blocks of run to file, file.job for batch jobs
+ *  -merge <files> - aggregate profiles by image into hotspot report
+ *  -ab <source> <inputs> - compare counters of programm with its version from source on recorded inputs
+ *  -fuse <n> <file> <profiles> - generate fused.inc executing n most frequent instruction sequences of profiles at once
+ *  -nofuse - execute fused sequences instruction by instruction
+ *  -noidioms - execute fill, copy, sum and find loops instruction by instruction
+ *  -gen <command> - estimate complexity on inputs printed by "command n"
+ *  -template <file> - estimate complexity on inputs made from file, {n} is size and {seq} n numbers
+ *  -ladder <from> <to> - sizes complexity is estimated on, doubled from first to last
+ *  -slice <n> - preempt batch jobs at first block boundary after n instructions
+ *  -tenant <name:weight> - share of workers batch jobs of tenant get, 1 by default
+ *  -share <dir> - map image published in registry dir by other process, or assemble and publish it there
+ *  -lazy - assemble instructions when they are first executed or accessed
+ *  -snapshots <dir> - start from snapshot taken at first input by earlier run of the same programm
+ *  -idle <ms> - compress guest memory of machine waiting for input longer than ms
+ *  -forks <n> - most guest clones running at once, number of allowed cpus by default, 0 - no clones
+ *  -perf - count host cycles, instructions, branch and cache misses of each run or batch job
+ *  -coldstart <n> - start the run n times as fresh process, print time from exec to first instruction and to exit
+ *  -hugebench <n> - run n times on regular and n times on huge pages, print time of execution on both
+ */
+void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-stats") == 0) stats = true;
+        else if (strcmp(argv[i], "-hugetlb") == 0) page_mode = 2;
+        else if (strcmp(argv[i], "-nohuge") == 0) page_mode = 0;
+        else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc) batch_file = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-nosmt") == 0) no_smt = true;
+        else if (strcmp(argv[i], "-results") == 0 && i + 1 < argc) store_file = argv[++i];
+        else if (strcmp(argv[i], "-results-size") == 0 && i + 1 < argc) store_capacity = strtoull(argv[++i], nullptr, 10) << 20;
+        else if (strcmp(argv[i], "-lookup") == 0 && i + 2 < argc) {
+            lookup_result(argv[i + 1], strtoull(argv[i + 2], nullptr, 10));
+            exit(0);
+        }
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) trace_file = argv[++i];
+        else if (strcmp(argv[i], "-index-trace") == 0 && i + 1 < argc) {
+            index_trace(argv[i + 1]);
+            exit(0);
+        }
+        else if (strcmp(argv[i], "-query") == 0 && i + 2 < argc) {
+            query_trace(argv[i + 1], argv[i + 2], vector<string>(argv + i + 3, argv + argc));
+            exit(0);
+        }
+        else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc) profile = argv[++i];
+        else if (strcmp(argv[i], "-fuse") == 0 && i + 2 < argc) {
+            write_fused(strtoul(argv[i + 1], nullptr, 10), argv[i + 2], vector<string>(argv + i + 3, argv + argc));
+            exit(0);
+        }
+        else if (strcmp(argv[i], "-nofuse") == 0) fuse = false;
+        else if (strcmp(argv[i], "-noidioms") == 0) idioms = false;
+        else if (strcmp(argv[i], "-ab") == 0 && i + 1 < argc) {
+            ab_source = argv[i + 1];
+            ab_inputs = vector<string>(argv + i + 2, argv + argc);
+            break;
+        }
+        else if (strcmp(argv[i], "-merge") == 0) {
+            merge_profiles(vector<string>(argv + i + 1, argv + argc));
+            exit(0);
+        }
+        else if (strcmp(argv[i], "-gen") == 0 && i + 1 < argc) gen_command = argv[++i];
+        else if (strcmp(argv[i], "-template") == 0 && i + 1 < argc) gen_template = argv[++i];
+        else if (strcmp(argv[i], "-ladder") == 0 && i + 2 < argc) {
+            ladder_from = strtoull(argv[++i], nullptr, 10);
+            ladder_to = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "-slice") == 0 && i + 1 < argc) slice = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "-tenant") == 0 && i + 1 < argc) {
+            string spec = argv[++i];
+            size_t colon = spec.find(':');
+            tenant_of(spec.substr(0, colon)).weight = colon == string::npos ? 1 : max(1LL, atoll(spec.c_str() + colon + 1));
+        }
+        else if (strcmp(argv[i], "-share") == 0 && i + 1 < argc) share_dir = argv[++i];
+        else if (strcmp(argv[i], "-lazy") == 0) lazy = true;
+        else if (strcmp(argv[i], "-snapshots") == 0 && i + 1 < argc) snapshot_dir = argv[++i];
+        else if (strcmp(argv[i], "-idle") == 0 && i + 1 < argc) idle_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-forks") == 0 && i + 1 < argc) fork_width = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-perf") == 0) perf = true;
+        else if (strcmp(argv[i], "-coldstart") == 0 && i + 1 < argc) coldstart_runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-hugebench") == 0 && i + 1 < argc) hugebench_runs = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    if (coldstart_runs > 0) {
+        run_coldstart(argc, argv);
+        return 0;
+    }
+    if (hugebench_runs > 0) {
+        run_hugebench(argc, argv);
+        return 0;
+    }
+    if (getenv("MIPT_COLDSTART") != nullptr) coldstart_fd = atoi(getenv("MIPT_COLDSTART"));
+    huge_pending = page_mode == 1 && ab_source == nullptr && batch_file == nullptr && gen_command == nullptr &&
+                   gen_template == nullptr;
+    mem = (word *) alloc_table(MEMSIZE * sizeof(word), &mem_backing, !huge_pending);
+    if (huge_pending) preempt_at = HUGE_AFTER;
+    if (ab_source != nullptr) {
+        run_ab();
+        return 0;
+    }
+    if (stats || (perf && batch_file == nullptr)) atexit(print_stats);
+    file_input();
+    source_hash = image_hash();
+    if (snapshot_dir == nullptr || !load_snapshot()) {
+        if (share_dir == nullptr || !map_shared_image()) {
+            if (lazy && share_dir == nullptr) lazy_assemble();
+            else assemble();
+            if (share_dir != nullptr) publish_image();
+        }
+    }
+    //bin_input();
+    if (profile != nullptr) start_profile();
+    if (batch_file != nullptr) {
+        run_batch();
+        return 0;
+    }
+    if (gen_command != nullptr || gen_template != nullptr) {
+        run_complexity();
+        return 0;
+    }
+    if (trace_file != nullptr) start_trace();
     emulate();
 }
\ No newline at end of file
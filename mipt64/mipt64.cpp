@@ -27,52 +27,370 @@
 #include <string>
 #include <cstring>
 #include <fstream>
+#include <cstdarg>
+#include <cmath>
+#include <thread>
+#include <deque>
+#include <algorithm>
+#include <ctime>
+#include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <csignal>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/auxv.h>
+#include "../result_store/result_store.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 #define MEMSIZE 2097152
+#define HUGEPAGE 2097152 /// guest memory and tables are aligned to huge page size
 #define ASMINP "input.fasm" /// file to get asm code
 typedef unsigned long long int dword;
 
 /**
- * conformity between number of command and its type in {"RI", "RR", "RM", "J"}
- */
-map<dword, string> TYPE = {
-        {0,  "RR"},
-        {1,  "RR"},
-        {2,  "RR"},
-        {3,  "RR"},
-        {4,  "RR"},
-        {5,  "RR"},
-        {6,  "RR"},
-        {7,  "RR"},
-        {8,  "RR"},
-        {9,  "RR"},
-        {10, "RR"},
-        {11, "RR"},
-        {12, "RR"},
-        {13, "RR"},
-        {14, "RR"},
-        {15, "RR"},
-        {16, "RR"},
-        {17, "RR"},
-        {18, "RR"},
-        {19, "B"},
-        {20, "RR"},
-        {21, "RR"},
-        {22, "RR"},
-        {23, "RR"},
-        {24, "RR"},
-        {25, "RR"},
-        {26, "RR"},
-        {27, "RR"},
-        {28, "RM"},
-        {29, "RM"}
+ * formats of instructions, TYPE_NONE for unused opcodes
+ */
+enum {TYPE_NONE, TYPE_RR, TYPE_RM, TYPE_B};
+
+/**
+ * conformity between number of command and its type, constant table indexed by opcode
+ */
+const unsigned char TYPE[64] = {
+        TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR,
+        TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR,
+        TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR,
+        TYPE_RR, TYPE_B, TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR,
+        TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RR, TYPE_RM, TYPE_RM
 };
 
 vector<string> input; /// asm input commands placed here
 map<string, dword> label; /// map of labels - name of label as first element, number of row label start as second. Only significant rows are taken
-char mem[MEMSIZE]; /// addresses space of processor
+char *arena; /// memory of all programms, allocated by alloc_table()
+char *mem; /// addresses space of running programm inside arena
+dword mem_limit = MEMSIZE; /// size of addresses space of running programm
+FILE *guest_in = stdin, *guest_out = stdout; /// input and output of running programm
 dword regs[33]; /// 16 register and 1 addictional sign register
+dword image_size = 0; /// number of bytes assembled programm takes
+
+const char *share_dir = nullptr; /// registry directory of images shared between emulator processes
+int image_fd = -1; /// memfd with published image of this process
+size_t shared_bytes = 0; /// start of guest memory mapped from shared image, its pages are copied on first write
+pid_t image_owner = 0; /// process which published image
+string image_entry; /// registry file of published image
+
+int idle_ms = 0; /// compress guest memory after waiting input this long, 0 - never
+vector<vector<unsigned char>> packed; /// compressed guest pages
+vector<char> is_packed; /// 1 if guest page is compressed and unmapped till next access
+size_t packed_pages = 0, packed_bytes = 0; /// compression statistics
+
+/**
+ * host open addressing hash table of guest words, linear probing with backward shift deletion
+ */
+struct guest_map {
+    vector<dword> keys, values;
+    vector<char> used;
+    size_t count = 0;
+    bool live = false; /// handle is not freed
+};
+
+/**
+ * programm of packed mode - window of arena, registers and files of it
+ */
+struct program {
+    string source, in, out;
+    FILE *fin = nullptr, *fout = nullptr;
+    dword base = 0; /// start of window in arena
+    dword regs[33] = {};
+    dword retired = 0;
+    int code = 0; /// exit code
+    bool done = false;
+    vector<guest_map> maps; /// hash maps of programm, swapped in while it runs
+};
+
+const char *source_file = ASMINP; /// asm file to assemble
+vector<guest_map> maps; /// hash maps of machine, handle is index + 1
+const char *pack_file = nullptr; /// "source input output" list of programms packed into one arena
+dword window = 65536; /// bytes of arena every packed programm gets
+bool packing = false; /// several programms share arena and run by turns
+int stop_code = 0; /// exit code of stopped packed programm
+
+/**
+ * thrown on preemption or stop of packed programm and caught by run_pack() scheduler, so frames of syscalls
+ * the programm was in are unwound
+ */
+struct pack_switch {
+    bool stopped; /// programm stopped, otherwise preempted
+};
+
+bool lazy = false; /// assemble instructions only when execution or memory access first reaches them
+vector<int> lazy_rows; /// per memory word: row of input waiting to be assembled into it plus 1, 0 - nothing waits
+size_t lazy_pending = 0; /// number of instructions not assembled yet
+
+const char *snapshot_dir = nullptr; /// cache of machine snapshots taken at first input, per image
+bool input_used = false; /// machine has executed input syscall
+bool snapshot_loaded = false; /// machine was restored from snapshot
+dword snapshot_retired = 0; /// instructions executed before snapshot
+string replay_output; /// output produced before snapshot, repeated when machine is restored from it
+string prefix_output; /// output produced before first input
+
+/**
+ * result of guest clone, read by machine which joins it
+ */
+struct clone_slot {
+    dword result; /// value clone passed with syscall 112 or its exit code
+    dword retired; /// instructions executed by clone
+    int done; /// clone finished and result is set
+};
+
+typedef dword limb; /// limb of multi-precision number, one per memory word
+typedef unsigned __int128 wide_limb; /// holds sum or product of two limbs
+const int LIMB_BITS = 64;
+const dword LIMB_STEP = 8; /// address step between limbs
+const size_t KARATSUBA_LIMBS = 32; /// shorter numbers are multiplied by schoolbook method
+
+typedef char symbol; /// character of string syscalls, one per byte
+const dword SCAN_WIDTH = 16; /// symbols compared at once by scan_mask()
+const dword PREFETCH_AHEAD = 16; /// elements between prefetched and accessed one of index syscalls
+
+int matmul_threads = 1; /// host threads of matrix multiply syscall
+const dword MATMUL_BLOCK_K = 128; /// rows of B kept in cache while row of C is summed
+const dword MATMUL_BLOCK_N = 512; /// columns of C summed at once
+
+const size_t CLONE_SLOTS = 65536; /// clones one programm run may fork
+/**
+ * shared by machine and all its clones
+ */
+struct clone_area {
+    int running; /// clones alive now
+    size_t next; /// slots handed out
+    clone_slot slot[CLONE_SLOTS];
+};
+
+clone_area *clones = nullptr; /// mapped on first guest fork
+clone_slot *clone_self = nullptr; /// slot of this machine if it is a clone
+dword clone_start = 0; /// instructions executed when this clone was forked
+map<dword, pid_t> clone_pid; /// process of every clone this machine forked, by handle
+int fork_width = -1; /// most clones running at once, number of allowed cpus by default
+
+int page_mode = 1; /// pages to back tables with: 0 - regular, 1 - transparent huge pages, 2 - hugetlbfs
+const char *mem_backing = "regular pages"; /// pages guest memory actually got
+bool stats = false; /// print execution statistics on exit
+dword retired = 0; /// number of executed instructions
+dword branches = 0; /// number of executed branch instructions
+bool perf = false; /// count host hardware events while emulating
+const char *profile = nullptr; /// file to write per label profile to, batch jobs add ".job" to it
+string profile_path; /// profile file of this run
+dword source_hash = 0; /// hash of programm source, identifies image in profiles
+dword *pc_hits = nullptr; /// executions of every instruction of image
+dword *block_hits = nullptr; /// executions of every instruction of image as first one of block
+size_t profile_size = 0; /// number of instructions in image
+bool new_block = true; /// previous instruction was branch
+dword type_hits[64]; /// executions of every instruction type, counted with profile
+const char *ab_source = nullptr; /// version B of programm, compared with version A from source_file on ab_inputs
+vector<string> ab_inputs; /// recorded inputs of A/B comparison
+const int SEQ_OPS = 64; /// instruction types counted in sequences
+vector<dword> seq_hits; /// executions of pairs, then triples of straight-line instruction types inside blocks
+int seq_last[2] = {-1, -1}; /// types of two previous straight-line instructions of block, -1 - none
+bool fuse = true; /// execute frequent instruction sequences of fused.inc in one step
+bool idioms = true; /// run fill, copy, sum and find loops found at backward branches as host bulk operations
+const char *trace_file = nullptr; /// file to record execution trace of run to
+FILE *trace_out = nullptr; /// execution trace being recorded
+const dword IDIOM_MISSES = 256; /// loop heads remembered as no idiom
+dword idiom_miss[IDIOM_MISSES]; /// head + 1 of loop which is no idiom, by slot of head modulo IDIOM_MISSES
+const int PERF_COUNTERS = 5;
+const char *perf_name[PERF_COUNTERS] = {"host cycles", "host instructions", "host branch misses",
+                                        "host L1D misses", "host LLC misses"};
+int perf_fd[PERF_COUNTERS] = {-1, -1, -1, -1, -1}; /// perf_event_open counters
+long long perf_value[PERF_COUNTERS] = {-1, -1, -1, -1, -1}; /// counted events, -1 if counter is unavailable
+timespec start_time; /// moment emulation started
+
+/**
+ * job of batch mode - guest input and output files
+ */
+struct job {
+    string in, out, tenant, expected;
+};
+
+/**
+ * tenant of batch mode - jobs waiting for cpu and share of cpu in deficit round robin
+ */
+struct tenant_queue {
+    string name;
+    long long weight; /// quantums tenant gets per round
+    long long deficit; /// instructions tenant may still start slices for in this round
+    deque<size_t> queue; /// new and preempted jobs of tenant
+};
+
+/**
+ * result of batch job, written by job process to memory shared with runner
+ */
+struct job_result {
+    int done; /// 1 if machine stopped by halt or exit syscall
+    int cpu, node; /// where job was executed
+    dword retired; /// number of executed instructions
+    dword branches; /// number of executed branch instructions
+    long long perf_value[PERF_COUNTERS]; /// host hardware events, -1 if unavailable
+    long long mismatch; /// offset of first output byte differing from expected output, -1 if output matched
+};
+
+const char *batch_file = nullptr; /// jobs list for batch mode, one "input output" pair per line
+int workers = 0; /// number of jobs executed at once, 0 - one per allowed cpu
+bool no_smt = false; /// use only one hardware thread of each core
+vector<job> jobs; /// batch jobs
+job_result *results = nullptr; /// results of batch jobs, shared between runner and machines
+job_result *result = nullptr; /// result slot of current job
+dword slice = 0; /// instructions batch job runs before it is preempted at block boundary, 0 - never
+dword preempt_at = ~0ULL; /// number of executed instructions to preempt job after
+const dword HUGE_AFTER = 1000000; /// instructions one-shot run executes before its memory is advised to huge pages
+bool huge_pending = false; /// guest memory of one-shot run stays on regular pages until HUGE_AFTER instructions
+int coldstart_runs = 0; /// fresh processes to measure start of, 0 - measure nothing
+int hugebench_runs = 0; /// runs on each kind of pages to compare, 0 - compare nothing
+int coldstart_fd = -1; /// pipe to report moment of first instruction to -coldstart parent through, -1 - none
+vector<tenant_queue> tenants; /// tenants of batch mode with weights from -tenant options
+const char *expected = nullptr; /// expected output of batch job, mapped from file
+size_t expected_size = 0; /// size of expected output
+size_t out_pos = 0; /// number of bytes guest has output
+const char *store_file = nullptr; /// result store batch outputs and statuses are written to
+dword store_capacity = 64 << 20; /// bytes preallocated for outputs in result store
+result_store job_store; /// mapped result store, shared by runner and jobs
+string captured; /// output of batch job kept for result store
+const char *gen_command = nullptr; /// host command "gen_command n" printing input of size n for complexity mode
+const char *gen_template = nullptr; /// input template for complexity mode, {n} is size and {seq} n numbers
+dword ladder_from = 64, ladder_to = 4096; /// sizes of complexity mode, doubled from first to last
+int machine_cpu = 0, machine_node = 0; /// where machine of batch job was prepared
+thread prefaulter; /// idle priority thread faulting in guest memory of spare machine
+bool prefault_stop = false; /// job was handed over, prefaulter must stop before guest runs
+
+/**
+ * allocate zeroed table aligned to huge page. Tries hugetlbfs pages if asked, then transparent huge pages, then regular pages
+ * \param[size] - size of table in bytes
+ * \param[kind] - if not null, kind of pages table got is written here
+ * \param[huge] - advise transparent huge pages right away, otherwise table starts on regular pages
+ */
+void *alloc_table(size_t size, const char **kind = nullptr, bool huge = true) {
+    size = (size + HUGEPAGE - 1) / HUGEPAGE * HUGEPAGE;
+    if (page_mode == 2) {
+        void *res = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (res != MAP_FAILED) {
+            if (kind) *kind = "hugetlbfs pages";
+            return res;
+        }
+    }
+    char *raw = (char *) mmap(nullptr, size + HUGEPAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    char *res = (char *) (((uintptr_t) raw + HUGEPAGE - 1) / HUGEPAGE * HUGEPAGE);
+    if (res > raw) munmap(raw, res - raw);
+    if (res < raw + HUGEPAGE) munmap(res + size, raw + HUGEPAGE - res);
+    if (kind) *kind = "regular pages";
+    if (page_mode > 0 && huge && madvise(res, size, MADV_HUGEPAGE) == 0 && kind) *kind = "transparent huge pages";
+    return res;
+}
+
+/**
+ * open disabled perf_event_open counter of this process, user space only
+ * \param[type] - perf event type
+ * \param[config] - perf event of that type
+ */
+int open_counter(unsigned int type, unsigned long long config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * read and close host counters, called on machine exit
+ */
+void stop_perf() {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (perf_fd[i] < 0) continue;
+        ioctl(perf_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd[i], &perf_value[i], sizeof(long long)) != sizeof(long long)) perf_value[i] = -1;
+        close(perf_fd[i]);
+        perf_fd[i] = -1;
+    }
+}
+
+/**
+ * start host counters of cycles, instructions, branch misses, L1D and LLC read misses. Counters kernel
+ * doesn't give stay unavailable
+ */
+void start_perf() {
+    const unsigned long long miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    perf_fd[0] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    perf_fd[1] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    perf_fd[2] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    perf_fd[3] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | miss);
+    perf_fd[4] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | miss);
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (perf_fd[i] < 0) continue;
+        ioctl(perf_fd[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    atexit(stop_perf);
+}
+
+/**
+ * print host counters next to guest instructions and branches
+ * \param[fp] - file to print to
+ * \param[value] - counted host events
+ * \param[instructions] - executed guest instructions
+ * \param[jumps] - executed guest branches
+ */
+void print_perf(FILE *fp, const long long *value, dword instructions, dword jumps) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (value[i] < 0) fprintf(fp, "%s: unavailable\n", perf_name[i]);
+        else fprintf(fp, "%s: %lld\n", perf_name[i], value[i]);
+    }
+    if (value[0] >= 0 && instructions > 0)
+        fprintf(fp, "host cycles per guest instruction: %.2lf\n", (double) value[0] / instructions);
+    if (value[2] >= 0 && jumps > 0)
+        fprintf(fp, "host mispredicts per guest branch: %.4lf\n", (double) value[2] / jumps);
+}
+
+/**
+ * print instructions count, speed and pages used for guest memory to stderr
+ */
+void print_stats() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fflush(stdout);
+    double time = (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9;
+    fprintf(stderr, "instructions: %llu\n", retired);
+    fprintf(stderr, "branches: %llu\n", branches);
+    fprintf(stderr, "time: %.6lf s\n", time);
+    if (time > 0) fprintf(stderr, "speed: %.2lf MIPS\n", (retired - snapshot_retired) / time / 1e6);
+    fprintf(stderr, "memory: %s\n", mem_backing);
+    if (snapshot_loaded) fprintf(stderr, "snapshot: started after %llu instructions\n", snapshot_retired);
+    if (perf) print_perf(stderr, perf_value, retired, branches);
+    if (packed_pages > 0) fprintf(stderr, "compressed: %zu pages to %zu bytes\n", packed_pages, packed_bytes);
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (fp == nullptr) return;
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+        if (strncmp(line, "AnonHugePages:", 14) == 0 || strncmp(line, "Private_Hugetlb:", 16) == 0)
+            fprintf(stderr, "%s", line);
+    fclose(fp);
+}
 
 /// masks to separate command to its part
 dword m0_5 = 0b0000000000000000000000000000000011111100000000000000000000000000;
@@ -142,11 +460,158 @@ dword t16_18(dword x) {
     return (x & m16_18) >> 13;
 }
 
+/**
+ * guest fork: clone machine copy-on-write into new process, it shares code image and continues after syscall
+ * \return handle of clone in machine, 0 in clone, -1 if every worker is busy and machine should go on alone.
+ * Batch jobs get -1: their output is checked and stored by the job process only
+ */
+dword guest_fork() {
+    if (packing) return -1;
+    if (result != nullptr) return -1;
+    if (clones == nullptr) {
+        void *area = mmap(nullptr, sizeof(clone_area), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (area == MAP_FAILED) return -1;
+        clones = (clone_area *) area;
+        cpu_set_t set;
+        if (fork_width < 0) fork_width = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 1;
+    }
+    if (__atomic_add_fetch(&clones->running, 1, __ATOMIC_SEQ_CST) > fork_width) {
+        __atomic_sub_fetch(&clones->running, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    size_t id = __atomic_fetch_add(&clones->next, 1, __ATOMIC_SEQ_CST);
+    fflush(stdout);
+    pid_t pid = id < CLONE_SLOTS ? fork() : -1;
+    if (pid < 0) {
+        __atomic_sub_fetch(&clones->running, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    if (pid == 0) {
+        clone_self = clones->slot + id;
+        clone_start = retired;
+        clone_pid.clear();
+        preempt_at = ~0ULL;
+        return 0;
+    }
+    clone_pid[id + 1] = pid;
+    return id + 1;
+}
+
+/**
+ * stop clone machine: pass result to machine which joins it and exit without exit handlers of forking machine
+ * \param[value] - result
+ */
+void finish_clone(dword value) {
+    clone_self->result = value;
+    clone_self->retired = retired - clone_start;
+    __atomic_store_n(&clone_self->done, 1, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&clones->running, 1, __ATOMIC_SEQ_CST);
+    fflush(stdout);
+    _exit(0);
+}
+
+/**
+ * wait for clone forked by this machine and take its result, instructions it executed are added to this machine
+ * \param[handle] - handle returned by guest fork
+ * \return result of clone, -1 if handle is unknown or clone crashed
+ */
+dword guest_join(dword handle) {
+    auto it = clone_pid.find(handle);
+    if (it == clone_pid.end()) return -1;
+    waitpid(it->second, nullptr, 0);
+    clone_pid.erase(it);
+    clone_slot &slot = clones->slot[handle - 1];
+    if (!slot.done) {
+        __atomic_sub_fetch(&clones->running, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    retired += slot.retired;
+    return slot.result;
+}
+
+/**
+ * stop machine with exit code. In packed mode only running programm stops
+ */
+[[noreturn]] void stop_machine(int code) {
+    if (clone_self != nullptr) finish_clone(code);
+    if (packing) {
+        stop_code = code;
+        throw pack_switch{true};
+    }
+    exit(code);
+}
+
+/**
+ * stop machine accessing memory out of its addresses space
+ */
+void fault(dword adr) {
+    fprintf(stderr, "memory fault at address %llu\n", adr);
+    stop_machine(139);
+}
+
+/**
+ * stop machine whose syscall operands starting with register reg would take pc
+ */
+void operand_fault(dword reg) {
+    fprintf(stderr, "syscall operands from register %llu reach pc\n", reg);
+    stop_machine(132);
+}
+
+enum {TRACE_PC = 1, TRACE_REG, TRACE_MEM};
+const dword TRACE_MAGIC = 0x314352545450494d; /// "MIPTTRC1"
+const size_t TRACE_BUFFER = 65536; /// records collected before they are written
+
+/**
+ * fixed size record of execution trace. First record of trace is header with TRACE_MAGIC as kind, number of
+ * memory addresses as where and number of registers as value
+ */
+struct trace_record {
+    dword step; /// instruction which made record, counted from 1
+    dword kind; /// TRACE_PC, TRACE_REG or TRACE_MEM
+    dword where; /// pc of executed instruction, written register or memory address
+    dword value; /// executed instruction, new value of register or memory word
+};
+
+trace_record trace_buf[TRACE_BUFFER]; /// records not written to trace yet
+size_t trace_used = 0; /// number of records in trace_buf
+
+/**
+ * write collected records to trace file, called on exit
+ */
+void flush_trace() {
+    fwrite(trace_buf, sizeof(trace_record), trace_used, trace_out);
+    fflush(trace_out);
+    trace_used = 0;
+}
+
+/**
+ * add record of current instruction to trace
+ */
+void trace_put(dword kind, dword where, dword value) {
+    if (trace_used == TRACE_BUFFER) flush_trace();
+    trace_buf[trace_used++] = {retired, kind, where, value};
+}
+
+/**
+ * add n memory words from address to trace, for syscalls which write guest memory directly
+ */
+void trace_words(dword adr, dword n) {
+    for (dword i = 0; i < n; i++) {
+        dword val;
+        memcpy(&val, mem + adr + i * 8, 8);
+        trace_put(TRACE_MEM, adr + i * 8, val);
+    }
+}
+
+void lazy_touch(dword adr);
+
 /**
  * get value from memory
  * \param[adr] - adress to get value from it
  */
 dword gmem(dword adr) {
+    if (adr > mem_limit - 8) fault(adr);
+    if (lazy_pending != 0) lazy_touch(adr);
     dword res;
     memcpy(&res, mem + adr, 8);
     return res;
@@ -158,6 +623,9 @@ dword gmem(dword adr) {
  * \param[val] - value to set
  */
 void smem(dword adr, dword val) {
+    if (adr > mem_limit - 8) fault(adr);
+    if (lazy_pending != 0) lazy_touch(adr);
+    if (trace_out != nullptr) trace_put(TRACE_MEM, adr, val);
     memcpy(mem + adr, &val, 8);
     mem[adr] = val;
 }
@@ -176,6 +644,7 @@ dword greg(dword adr) {
  * \param[val] - value to set
  */
 void sreg(dword adr, dword val) {
+    if (trace_out != nullptr && adr != 31) trace_put(TRACE_REG, adr, val);
     regs[adr] = val;
 }
 
@@ -203,9 +672,23 @@ dword pop_stack(dword x = 8) {
  * Get assembler code from asm file and (!) write it to input vector
  */
 void file_input() {
-    string temp, temp1, temp2;
-    ifstream fin(ASMINP);
-    while (getline(fin, temp, '\n')) {
+    string text, temp, temp1, temp2;
+    int fd = open(source_file, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        text.resize(st.st_size);
+        ssize_t got = 0;
+        for (size_t done = 0; done < text.size(); done += got)
+            if ((got = read(fd, &text[done], text.size() - done)) <= 0) {
+                text.resize(done);
+                break;
+            }
+    }
+    if (fd >= 0) close(fd);
+    for (size_t from = 0, to; from < text.size(); from = to + 1) {
+        to = text.find('\n', from);
+        if (to == string::npos) to = text.size();
+        temp = text.substr(from, to - from);
         temp = temp.substr(0, temp.find(';'));
         if (temp.find(':') != string::npos) {
             temp1 = temp.substr(0, temp.find(':') + 1);
@@ -217,7 +700,6 @@ void file_input() {
         while (temp.length() > 0 && (temp[0] == ' ' || temp[0] == '\t')) temp.erase(0, 1);
         if (temp.length() > 0) input.push_back(temp);
     }
-    fin.close();
 }
 
 /**
@@ -266,7 +748,7 @@ void parse_labels() {
  * \param[lexemes] - command splitted by split function
  */
 dword make_comm(vector<string> &lexemes, dword pc) {
-    map<string, dword> CODE = {
+    static const map<string, dword> CODE = {
             {"halt", 0},
             {"svc",  1},
             {"add",  2},
@@ -298,19 +780,19 @@ dword make_comm(vector<string> &lexemes, dword pc) {
             {"ld",   28},
             {"st",   29}
     };
-    map<string, dword> REGISTER = {
+    static const map<string, dword> REGISTER = {
             {"rz", 27},
             {"fp", 28},
             {"sp", 29},
             {"lr", 30},
             {"pc", 31}
     };
-    dword coded = CODE[lexemes[0]] << 26;
-    if (TYPE[coded >> 26] == "RR") {
+    dword coded = CODE.count(lexemes[0]) ? CODE.at(lexemes[0]) << 26 : 0;
+    if (TYPE[coded >> 26] == TYPE_RR) {
         dword rd, rs;
         string SRD = lexemes[1].substr(0, lexemes[1].length() - 1);
         if (REGISTER.find(SRD) != REGISTER.end()) {
-            rd = REGISTER[SRD] << 21;
+            rd = REGISTER.at(SRD) << 21;
         } else {
             SRD = SRD.substr(1, SRD.length() - 1);
             rd = ((dword) strtol(SRD.c_str(), nullptr, 10)) << 21;
@@ -324,7 +806,7 @@ dword make_comm(vector<string> &lexemes, dword pc) {
         } else {
             SRS = SRS.substr(0, SRS.length() - 1);
             if (REGISTER.find(SRS) != REGISTER.end()) {
-                rs = REGISTER[SRS] << 16;
+                rs = REGISTER.at(SRS) << 16;
             } else {
                 SRS = SRS.substr(1, SRS.length() - 1);
                 rs = ((dword) strtol(SRS.c_str(), nullptr, 10)) << 16;
@@ -342,7 +824,7 @@ dword make_comm(vector<string> &lexemes, dword pc) {
                 string SRI = lexemes[3].substr(0, lexemes[3].length() - 1);
                 dword ri;
                 if (REGISTER.find(SRI) != REGISTER.end()) {
-                    ri = REGISTER[SRI] << 11;
+                    ri = REGISTER.at(SRI) << 11;
                 } else {
                     SRI = SRI.substr(1, SRI.length() - 1);
                     ri = ((dword) strtol(SRI.c_str(), nullptr, 10)) << 11;
@@ -354,18 +836,18 @@ dword make_comm(vector<string> &lexemes, dword pc) {
             }
         }
     }
-    if (TYPE[coded >> 26] == "RM") {
+    if (TYPE[coded >> 26] == TYPE_RM) {
         dword ra, rd;
         string SRD = lexemes[1].substr(0, lexemes[1].length() - 1);
         if (REGISTER.find(SRD) != REGISTER.end()) {
-            rd = REGISTER[SRD] << 21;
+            rd = REGISTER.at(SRD) << 21;
         } else {
             SRD = SRD.substr(1, SRD.length() - 1);
             rd = ((dword) strtol(SRD.c_str(), nullptr, 10)) << 21;
         }
         string SRA = lexemes[2].substr(0, lexemes[2].length() - 1);
         if (REGISTER.find(SRA) != REGISTER.end()) {
-            ra = REGISTER[SRA] << 16;
+            ra = REGISTER.at(SRA) << 16;
         } else {
             SRA = SRA.substr(1, SRA.length() - 1);
             ra = ((dword) strtol(SRA.c_str(), nullptr, 10)) << 16;
@@ -377,7 +859,7 @@ dword make_comm(vector<string> &lexemes, dword pc) {
         } else {
             string SRI = lexemes[3].substr(0, lexemes[3].length() - 1);
             dword ri;
-            if (REGISTER.find(SRI) != REGISTER.end()) ri = REGISTER[SRI] << 11;
+            if (REGISTER.find(SRI) != REGISTER.end()) ri = REGISTER.at(SRI) << 11;
             else {
                 SRI = SRI.substr(1, SRI.length() - 1);
                 ri = ((dword) strtol(SRI.c_str(), nullptr, 10)) << 11;
@@ -388,7 +870,7 @@ dword make_comm(vector<string> &lexemes, dword pc) {
             return coded;
         }
     }
-    if (TYPE[coded >> 26] == "B") {
+    if (TYPE[coded >> 26] == TYPE_B) {
         string fp = lexemes[1];
         if (label.find(fp) != label.end()) {
             long long lim = label[fp] - pc;
@@ -402,11 +884,11 @@ dword make_comm(vector<string> &lexemes, dword pc) {
         fp = fp.substr(0, fp.length() - 1);
         if (REGISTER.find(fp) != REGISTER.end()) {
             string sp = lexemes[2].substr(0, lexemes[2].length());
-            if (REGISTER[fp] == 27) {
+            if (REGISTER.at(fp) == 27) {
                 dword im = label[sp];
                 dword ra = 27 << 21;
                 coded += ra + im;
-            } else if (REGISTER[fp] == 31) {
+            } else if (REGISTER.at(fp) == 31) {
                 long long lim = label[fp] - pc;
                 if (lim < 0) {
                     lim *= -1;
@@ -429,423 +911,3205 @@ dword make_comm(vector<string> &lexemes, dword pc) {
     return 0;
 }
 
+enum {ROW_CODE, ROW_DATA, ROW_END};
+
+/**
+ * assemble row which is not an instruction, shared by assemble() and lazy_assemble(): place word, double
+ * or bytes at pc and move pc past them, or set start address for end row
+ * \param[splited] - row splitted by split function
+ * \param[pc] - address of row
+ * \return ROW_DATA or ROW_END, ROW_CODE if row is instruction and nothing was done
+ */
+int assemble_data(const vector<string> &splited, dword &pc) {
+    if (splited[0] == "end") {
+        sreg(31, label[splited[1]] + 8);
+        return ROW_END;
+    } else if (splited[0] == "word") {
+        smem(pc, (dword) strtol(splited[1].c_str(), nullptr, 10));
+        pc += 8;
+    } else if (splited[0] == "double") {
+        double temp = strtod(splited[1].c_str(), nullptr);
+        dword tmp;
+        memcpy(&tmp, &temp, 8);
+        smem(pc, tmp);
+        pc += 8;
+    } else if (splited[0] == "bytes") {
+        dword size = (dword) strtol(splited[1].c_str(), nullptr, 10);
+        for (dword j = 0; j < size / 8; j++) {
+            smem(pc, 0);
+            pc += 8;
+        }
+        if (size % 8 > 4) {
+            smem(pc, 0);
+        } else if (size % 8 > 0) {
+            dword hos = gmem(pc);
+            smem(pc, hos & 0b0000000000000000000000000000000011111111111111111111111111111111);
+        }
+    } else return ROW_CODE;
+    return ROW_DATA;
+}
+
 /**
  * write prepared command to memory
  */
 void assemble() {
     dword pc = 0;
     parse_labels();
-    for (int i = 0; i < input.size(); i++) {
+    for (size_t i = 0; i < input.size(); i++) {
         vector<string> splited = split(input[i]);
-        if (splited[0] == "end") {
-            sreg(31, label[splited[1]] + 8);
-            break;
-        } else if (splited[0] == "word") {
-            smem(pc, (dword) strtol(splited[1].c_str(), nullptr, 10));
-            pc += 8;
-        } else if (splited[0] == "double") {
-            double temp = strtod(splited[1].c_str(), nullptr);
-            dword tmp;
-            memcpy(&tmp, &temp, 8);
-            smem(pc, tmp);
-            pc += 8;
-        } else if (splited[0] == "bytes") {
-            dword size = (dword) strtol(splited[1].c_str(), nullptr, 10);
-            for (int j = 0; j < size / 8; j++) {
-                smem(pc, 0);
-                pc += 8;
-            }
-            if (size % 8 > 4) {
-                smem(pc, 0);
-            } else if (size % 8 > 0) {
-                dword hos = gmem(pc);
-                smem(pc, hos & 0b0000000000000000000000000000000011111111111111111111111111111111);
-            }
-        } else {
-            dword comm = make_comm(splited, pc);
-            smem(pc, comm);
+        int kind = assemble_data(splited, pc);
+        if (kind == ROW_END) break;
+        if (kind == ROW_CODE) {
+            smem(pc, make_comm(splited, pc));
             pc += 8;
         }
     }
-    sreg(29, MEMSIZE - 8);
+    image_size = pc + 8;
+    sreg(29, mem_limit - 8);
     sreg(27, 0);
 }
 
-/// every functions here emulate processor command. See processor doc to get information
-
-void halt(dword rd, dword rs, dword imm) {
-    exit((int) imm);
+/**
+ * lazy mode: assemble instructions still waiting in memory words value at address overlaps
+ * \param[adr] - address being read or written
+ */
+void lazy_touch(dword adr) {
+    for (dword slot = adr / 8; slot <= (adr + 7) / 8; slot++) {
+        if (slot >= lazy_rows.size() || lazy_rows[slot] == 0) continue;
+        vector<string> splited = split(input[lazy_rows[slot] - 1]);
+        lazy_rows[slot] = 0;
+        lazy_pending--;
+        dword saved[33];
+        memcpy(saved, regs, sizeof(regs));
+        memset(regs, 0, sizeof(regs)); // make_comm sees registers as they were before execution, like in assemble()
+        dword comm = make_comm(splited, slot * 8);
+        memcpy(regs, saved, sizeof(regs));
+        memcpy(mem + slot * 8, &comm, 8);
+    }
 }
 
-void svc(dword rd, dword rs, dword imm) {
-    switch (imm) {
-        case 0:
-            exit(0);
-        case 100:
-            dword scanning_int;
-            scanf("%lld", &scanning_int);
-            sreg(rd, scanning_int);
-            break;
-        case 101:
-            double ddi;
-            dword dwi;
-            scanf("%lf", &ddi);
-            memcpy(&dwi, &ddi, 8);
-            sreg(rd, (dwi << 32) >> 32);
-            sreg(rd + 1, dwi >> 32);
-            break;
-        case 102:
-            dword sending_int;
-            sending_int = greg(rd);
-            if (rd == 31 or rd == 30) printf("%lld", sending_int / 2 + 4);
-            else printf("%lld", sending_int);
-            break;
-        case 103:
-            dword dwo;
-            dwo = greg(rd);
-            double ddo;
-            memcpy(&ddo, &dwo, 8);
-            printf("%lg", ddo);
-            break;
-        case 104:
-            char scanning_char;
-            scanf("%c", &scanning_char);
-            sreg(rd, scanning_char);
-            break;
-        case 105:
-            char sending_char;
-            sending_char = (char) greg(rd);
-            printf("%c", sending_char);
-            break;
+/**
+ * lazy mode: only find labels, place data and start address. Every instruction is assembled by lazy_touch()
+ * on first access to its memory word
+ */
+void lazy_assemble() {
+    dword pc = 0;
+    parse_labels();
+    lazy_rows.clear();
+    for (size_t i = 0; i < input.size(); i++) {
+        int kind = assemble_data(split(input[i]), pc);
+        if (kind == ROW_END) break;
+        if (kind == ROW_CODE) {
+            if (lazy_rows.size() <= pc / 8) lazy_rows.resize(pc / 8 + 1, 0);
+            lazy_rows[pc / 8] = i + 1;
+            lazy_pending++;
+            pc += 8;
+        }
     }
+    image_size = pc + 8;
+    sreg(29, mem_limit - 8);
+    sreg(27, 0);
 }
 
-void add(dword rd, dword rs, dword imm) {
-    if (rd == 31 and rs == 31) sreg(rd, imm);
-    else sreg(rd, greg(rs) + imm);
+/**
+ * lazy mode: assemble every waiting instruction, when whole image is needed
+ */
+void lazy_finish() {
+    for (dword slot = 0; lazy_pending != 0 && slot < lazy_rows.size(); slot++) lazy_touch(slot * 8);
 }
 
-void sub(dword rd, dword rs, dword imm) {
-    sreg(rd, greg(rs) - imm);
+/**
+ * FNV-1a hash of programm source, names image in registry
+ */
+dword image_hash() {
+    dword hash = 14695981039346656037ULL;
+    for (const string &row : input) {
+        for (char c : row) hash = (hash ^ (unsigned char) c) * 1099511628211ULL;
+        hash = (hash ^ '\n') * 1099511628211ULL;
+    }
+    return hash;
 }
 
-void mul(dword rd, dword rs, dword imm) {
-    sreg(rd, greg(rs) * imm);
+/**
+ * path to registry entry of image - file with "pid fd size pc" of process holding image memfd
+ */
+string image_path() {
+    char name[64];
+    snprintf(name, sizeof(name), "/mipt64-%016llx", image_hash());
+    return string(share_dir) + name;
 }
 
-void div(dword rd, dword rs, dword imm) {
-    sreg(rd, greg(rs) / imm);
+/**
+ * map image published by other process over guest memory. Pages are shared with every process mapping it
+ * until guest writes to them. Memfd must hold source hash after the image: pid and fd of registry entry may
+ * belong to other process by now
+ * \return true if image was found and mapped
+ */
+bool map_shared_image() {
+    image_entry = image_path();
+    FILE *fp = fopen(image_entry.c_str(), "r");
+    if (fp == nullptr) return false;
+    int pid = 0, fd = 0;
+    dword size = 0, pc = 0;
+    int got = fscanf(fp, "%d %d %llu %llu", &pid, &fd, &size, &pc);
+    fclose(fp);
+    if (got != 4 || size == 0 || size > MEMSIZE) return false;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", pid, fd);
+    int image = open(path, O_RDONLY | O_CLOEXEC);
+    if (image < 0) return false;
+    struct stat st;
+    int seals = fcntl(image, F_GET_SEALS);
+    int need = F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW;
+    dword pages = (size + 4095) / 4096 * 4096, hash = 0;
+    if (fstat(image, &st) != 0 || (dword) st.st_size != pages + 8 || seals < 0 || (seals & need) != need ||
+        pread(image, &hash, 8, pages) != 8 || hash != source_hash) {
+        close(image);
+        return false;
+    }
+    void *res = mmap(mem, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image, 0);
+    close(image);
+    if (res == MAP_FAILED) return false;
+    shared_bytes = pages;
+    parse_labels();
+    image_size = size;
+    sreg(31, pc);
+    sreg(29, mem_limit - 8);
+    sreg(27, 0);
+    return true;
 }
 
-void mod(dword rd, dword rs, dword imm) {
-    sreg(rd, greg(rs) % imm);
+/**
+ * remove registry entry of image on exit of publishing process
+ */
+void unpublish_image() {
+    if (getpid() == image_owner) unlink(image_entry.c_str());
 }
 
-void And(dword rd, dword rs, dword imm) {
-    sreg(rd, greg(rs) & imm);
+/**
+ * copy assembled image to sealed memfd, map it back as guest memory and register it for other processes.
+ * Registry entry name is taken by map_shared_image() before assembling changes input. Source hash follows
+ * the page aligned image in memfd
+ */
+void publish_image() {
+    size_t size = (image_size + 4095) / 4096 * 4096;
+    image_fd = memfd_create("mipt64-image", MFD_ALLOW_SEALING);
+    if (image_fd < 0) return;
+    if (ftruncate(image_fd, size + 8) != 0 || write(image_fd, mem, size) != (ssize_t) size ||
+        write(image_fd, &source_hash, 8) != 8 || fcntl(image_fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        close(image_fd);
+        image_fd = -1;
+        return;
+    }
+    if (mmap(mem, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image_fd, 0) != MAP_FAILED) shared_bytes = size;
+    string temp = image_entry + ".tmp" + to_string(getpid());
+    FILE *fp = fopen(temp.c_str(), "w");
+    if (fp == nullptr) return;
+    fprintf(fp, "%d %d %llu %llu\n", getpid(), image_fd, (dword) image_size, (dword) greg(31));
+    fclose(fp);
+    if (rename(temp.c_str(), image_entry.c_str()) != 0) return;
+    image_owner = getpid();
+    atexit(unpublish_image);
 }
 
-void Or(dword rd, dword rs, dword imm) {
-    sreg(rd, greg(rs) | imm);
+/**
+ * write length of lz sequence part exceeding token nibble
+ */
+void lz_put_len(vector<unsigned char> &out, size_t len) {
+    while (len >= 255) {
+        out.push_back(255);
+        len -= 255;
+    }
+    out.push_back(len);
 }
 
-void Xor(dword rd, dword rs, dword imm) {
-    sreg(rd, greg(rs) ^ imm);
+/**
+ * compress bytes with lz77 codec: sequences of token (literals and match length nibbles),
+ * literals, 2 bytes match offset
+ * \param[src] - bytes to compress
+ * \param[n] - number of bytes, at most 65535
+ * \param[out] - compressed bytes
+ */
+void lz_compress(const unsigned char *src, size_t n, vector<unsigned char> &out) {
+    out.clear();
+    unsigned short table[4096] = {0};
+    size_t anchor = 0, i = 0;
+    while (i + 4 <= n) {
+        uint32_t seq;
+        memcpy(&seq, src + i, 4);
+        size_t h = (seq * 2654435761u) >> 20;
+        size_t cand = table[h];
+        table[h] = i + 1;
+        if (cand == 0 || memcmp(src + cand - 1, src + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        size_t m = cand - 1, len = 4, lit = i - anchor;
+        while (i + len < n && src[m + len] == src[i + len]) len++;
+        out.push_back((min(lit, (size_t) 15) << 4) | min(len - 4, (size_t) 15));
+        if (lit >= 15) lz_put_len(out, lit - 15);
+        out.insert(out.end(), src + anchor, src + i);
+        out.push_back((i - m) & 255);
+        out.push_back((i - m) >> 8);
+        if (len - 4 >= 15) lz_put_len(out, len - 4 - 15);
+        i += len;
+        anchor = i;
+    }
+    size_t lit = n - anchor;
+    out.push_back(min(lit, (size_t) 15) << 4);
+    if (lit >= 15) lz_put_len(out, lit - 15);
+    out.insert(out.end(), src + anchor, src + n);
 }
 
-void nand(dword rd, dword rs, dword imm) {
-    sreg(rd, (greg(rs) ^ imm) & greg(rs));
+/**
+ * decompress bytes compressed by lz_compress
+ * \param[src] - compressed bytes
+ * \param[dst] - place for n decompressed bytes
+ */
+void lz_decompress(const unsigned char *src, unsigned char *dst, size_t n) {
+    size_t o = 0, p = 0;
+    while (o < n) {
+        size_t token = src[p++], lit = token >> 4, len = token & 15;
+        if (lit == 15) {
+            while (src[p++] == 255) lit += 255;
+            lit += src[p - 1];
+        }
+        memcpy(dst + o, src + p, lit);
+        o += lit;
+        p += lit;
+        if (o >= n) break;
+        size_t off = src[p] + (src[p + 1] << 8);
+        p += 2;
+        if (len == 15) {
+            while (src[p++] == 255) len += 255;
+            len += src[p - 1];
+        }
+        len += 4;
+        for (size_t k = 0; k < len; k++) dst[o + k] = dst[o - off + k];
+        o += len;
+    }
 }
 
-void shl(dword rd, dword rs, dword imm) {
-    sreg(rd, greg(rs) << (imm & 0b111111));
+/**
+ * decompress compressed guest page back in place
+ * \param[page] - number of guest page
+ */
+void unpack_guest_page(size_t page) {
+    char *begin = (char *) mem;
+    mprotect(begin + page * 4096, 4096, PROT_READ | PROT_WRITE);
+    lz_decompress(packed[page].data(), (unsigned char *) begin + page * 4096, 4096);
+    is_packed[page] = 0;
 }
 
-void shr(dword rd, dword rs, dword imm) {
-    sreg(rd, greg(rs) >> (imm & 0b111111));
+/**
+ * decompress guest page on first access after machine was idle
+ */
+void unpack_page(int sig, siginfo_t *info, void *) {
+    char *adr = (char *) info->si_addr, *begin = (char *) mem;
+    if (adr >= begin && adr < begin + MEMSIZE && is_packed[(adr - begin) / 4096]) {
+        unpack_guest_page((adr - begin) / 4096);
+        return;
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
-void addd(dword rd, dword rs, dword imm) {
-    double drs, drd, dimm;
-    dword in = greg(rs);
-    memcpy(&drs, &in, 8);
-    memcpy(&dimm, &imm, 8);
-    drd = drs + dimm;
-    dword out;
-    memcpy(&out, &drd, 8);
-    sreg(rd, out);
+/**
+ * compress resident guest pages of idle machine and give their memory back to system.
+ * Pages are protected, so next access decompresses them in unpack_page(). Zero pages are only released. Page
+ * is counted as packed only if it could be protected and released: 4K pages of hugetlbfs memory can't, and
+ * packing stops at the first such page
+ */
+void pack_memory() {
+    size_t pages = MEMSIZE / 4096;
+    if (is_packed.empty()) {
+        is_packed.assign(pages, 0);
+        packed.resize(pages);
+        struct sigaction sa = {};
+        sa.sa_sigaction = unpack_page;
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigaction(SIGSEGV, &sa, nullptr);
+    }
+    vector<unsigned char> resident(pages);
+    if (mincore(mem, MEMSIZE, resident.data()) != 0) return;
+    static const char zero[4096] = {0};
+    char *begin = (char *) mem;
+    for (size_t i = 0; i < pages; i++) {
+        if (is_packed[i]) continue;
+        char *page = begin + i * 4096;
+        if (!(resident[i] & 1) || memcmp(page, zero, 4096) == 0) {
+            if (resident[i] & 1) madvise(page, 4096, MADV_DONTNEED);
+            vector<unsigned char>().swap(packed[i]);
+            continue;
+        }
+        lz_compress((unsigned char *) page, 4096, packed[i]);
+        packed[i].shrink_to_fit();
+        if (mprotect(page, 4096, PROT_NONE) != 0 || madvise(page, 4096, MADV_DONTNEED) != 0) {
+            mprotect(page, 4096, PROT_READ | PROT_WRITE);
+            vector<unsigned char>().swap(packed[i]);
+            return;
+        }
+        is_packed[i] = 1;
+        packed_pages++;
+        packed_bytes += packed[i].size();
+    }
 }
 
-void subd(dword rd, dword rs, dword imm) {
-    double drs, drd, dimm;
-    dword in = greg(rs);
-    memcpy(&drs, &in, 8);
-    memcpy(&dimm, &imm, 8);
-    drd = drs - dimm;
-    dword out;
-    memcpy(&out, &drd, 8);
-    sreg(rd, out);
+/**
+ * decompress compressed pages of guest range ahead of host threads reading it. unpack_page() makes a page
+ * accessible before it is filled, so a page faulted in by one thread could be read half-filled by another
+ * \param[adr] - address of range
+ * \param[n] - bytes in range
+ */
+void unpack_range(dword adr, dword n) {
+    if (is_packed.empty() || n == 0) return;
+    for (size_t page = adr / 4096; page <= (adr + n - 1) / 4096; page++)
+        if (is_packed[page]) unpack_guest_page(page);
 }
 
-void muld(dword rd, dword rs, dword imm) {
-    double drs, drd, dimm;
-    dword in = greg(rs);
-    memcpy(&drs, &in, 8);
-    memcpy(&dimm, &imm, 8);
-    drd = drs * dimm;
-    dword out;
-    memcpy(&out, &drd, 8);
-    sreg(rd, out);
+/**
+ * called before input syscall: if no input comes in idle_ms, compress machine memory while waiting
+ */
+void wait_input() {
+    if (idle_ms <= 0) return;
+#ifdef __GLIBC__
+    if (guest_in->_IO_read_ptr < guest_in->_IO_read_end) return;
+#endif
+    pollfd fd = {fileno(guest_in), POLLIN, 0};
+    if (poll(&fd, 1, idle_ms) == 0) pack_memory();
 }
 
-void divd(dword rd, dword rs, dword imm) {
-    double drs, drd, dimm;
-    dword in = greg(rs);
-    memcpy(&drs, &in, 8);
-    memcpy(&dimm, &imm, 8);
-    drd = drs / dimm;
-    dword out;
-    memcpy(&out, &drd, 8);
-    sreg(rd, out);
+/**
+ * write guest output. For batch job with expected output, machine stops on first byte differing from it
+ * or going past its end
+ * \param[buf] - bytes to output
+ * \param[n] - number of bytes
+ */
+void put_output(const char *buf, size_t n) {
+    if (expected != nullptr && (out_pos + n > expected_size || memcmp(buf, expected + out_pos, n) != 0)) {
+        size_t same = 0;
+        while (same < n && out_pos + same < expected_size && buf[same] == expected[out_pos + same]) same++;
+        if (job_store.base != nullptr) captured.append(buf, same);
+        else fwrite(buf, 1, same, guest_out);
+        out_pos += same;
+        result->mismatch = (long long) out_pos;
+        stop_machine(1);
+    }
+    if (snapshot_dir != nullptr && !input_used) prefix_output.append(buf, n);
+    if (job_store.base != nullptr) captured.append(buf, n);
+    else fwrite(buf, 1, n, guest_out);
+    out_pos += n;
 }
 
-void itod(dword rd, dword rs, dword imm) {
-    dword in = greg(rs);
-    double dout = (double) in + (double) imm;
-    dword out;
-    memcpy(&out, &dout, 8);
-    sreg(rd, out);
+/**
+ * printf for guest output syscalls
+ */
+void guest_printf(const char *format, ...) {
+    char buf[64];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    put_output(buf, min(n, (int) sizeof(buf) - 1));
 }
 
-void dtoi(dword rd, dword rs, dword imm) {
-    dword in = greg(rs);
-    double din, dimm;
-    memcpy(&din, &in, 8);
-    memcpy(&dimm, &imm, 8);
-    double dout = din + dimm;
-    dword out;
-    memcpy(&out, &dout, 8);
-    sreg(rd, out);
+/**
+ * instruction may be part of fused sequence - it neither branches, writes pc nor calls system
+ * \param[row] - instruction
+ */
+bool fusable(dword row) {
+    dword type = t0_5(row);
+    return type > 1 && type != 19 && type <= 29 && t6_10(row) != 31;
 }
 
-void bl(dword ra, dword imm) {
-    sreg(30, greg(31));
-    if (ra == 27) {
-        sreg(31, imm);
-    } else {
-        if ((imm >> 20) % 2 == 1) {
-            imm <<= 1;
-            imm /= 2;
-            sreg(31, greg(31) - imm);
-        } else {
-            sreg(31, greg(31) - imm);
+/**
+ * collect profile of instruction before it executes
+ * \param[pc] - address of instruction
+ * \param[row] - instruction
+ */
+void profile_step(dword pc, dword row) {
+    size_t i = pc / 8;
+    if (i >= profile_size) return;
+    pc_hits[i]++;
+    if (new_block) block_hits[i]++;
+    type_hits[t0_5(row)]++;
+    if (new_block || !fusable(row)) seq_last[0] = seq_last[1] = -1;
+    if (!fusable(row)) return;
+    int type = t0_5(row);
+    if (seq_last[1] >= 0) seq_hits[seq_last[1] * SEQ_OPS + type]++;
+    if (seq_last[0] >= 0) seq_hits[SEQ_OPS * SEQ_OPS + (seq_last[0] * SEQ_OPS + seq_last[1]) * SEQ_OPS + type]++;
+    seq_last[0] = seq_last[1];
+    seq_last[1] = type;
+}
+
+/**
+ * modelled cost of instruction type in cycles of simple in-order pipeline, compares programm versions
+ * \param[type] - type of instruction
+ */
+dword cycle_cost(dword type) {
+    switch (type) {
+        case 1:
+            return 50;
+        case 5:
+        case 6:
+        case 16:
+            return 20;
+        case 13:
+        case 14:
+        case 15:
+        case 17:
+        case 18:
+        case 21:
+            return 4;
+        case 4:
+            return 3;
+        case 19:
+        case 28:
+        case 29:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+/**
+ * number of guest memory pages with nonzero contents, pages never faulted in are skipped and compressed
+ * pages are counted
+ */
+dword touched_pages() {
+    size_t size = mem_limit, pages = size / 4096;
+    vector<unsigned char> resident(pages);
+    if (mincore(mem, size, resident.data()) != 0) return 0;
+    static const char zero[4096] = {0};
+    dword res = 0;
+    for (size_t i = 0; i < pages; i++)
+        if (((resident[i] & 1) && memcmp((char *) mem + i * 4096, zero, 4096) != 0) ||
+            (i < is_packed.size() && is_packed[i]))
+            res++;
+    return res;
+}
+
+/**
+ * write profile of run - image hash, executed instructions, syscalls, modelled cycles, touched pages, per label
+ * instructions and blocks and executions of instruction type sequences. Instruction belongs to the closest label above it
+ */
+void write_profile() {
+    vector<pair<size_t, string>> starts;
+    for (auto &l : label) starts.push_back({(l.second + 8) / 8, l.first});
+    sort(starts.begin(), starts.end());
+    vector<dword> ins(starts.size() + 1, 0), blocks(starts.size() + 1, 0);
+    size_t k = 0;
+    for (size_t i = 0; i < profile_size; i++) {
+        while (k < starts.size() && starts[k].first <= i) k++;
+        ins[k] += pc_hits[i];
+        blocks[k] += block_hits[i];
+    }
+    FILE *fp = fopen(profile_path.c_str(), "w");
+    if (fp == nullptr) {
+        perror(profile_path.c_str());
+        return;
+    }
+    fprintf(fp, "image %016llx\n", source_hash);
+    fprintf(fp, "instructions %llu\n", retired);
+    dword cycles = 0;
+    for (int t = 0; t < 64; t++) cycles += type_hits[t] * cycle_cost(t);
+    fprintf(fp, "syscalls %llu\n", type_hits[1]);
+    fprintf(fp, "cycles %llu\n", cycles);
+    fprintf(fp, "touched %llu\n", touched_pages());
+    if (ins[0] > 0) fprintf(fp, "label <none> %llu %llu\n", ins[0], blocks[0]);
+    for (size_t i = 0; i < starts.size(); i++)
+        fprintf(fp, "label %s %llu %llu\n", starts[i].second.c_str(), ins[i + 1], blocks[i + 1]);
+    for (size_t i = 0; i < seq_hits.size(); i++) {
+        if (seq_hits[i] == 0) continue;
+        size_t j = i - SEQ_OPS * SEQ_OPS;
+        if (i < SEQ_OPS * SEQ_OPS) fprintf(fp, "seq %zu+%zu %llu\n", i / SEQ_OPS, i % SEQ_OPS, seq_hits[i]);
+        else fprintf(fp, "seq %zu+%zu+%zu %llu\n", j / SEQ_OPS / SEQ_OPS, j / SEQ_OPS % SEQ_OPS, j % SEQ_OPS, seq_hits[i]);
+    }
+    fclose(fp);
+}
+
+/**
+ * allocate profile tables for assembled image. Fusion is off, so every instruction is counted
+ */
+void start_profile() {
+    profile_size = image_size / 8 + 1;
+    pc_hits = (dword *) alloc_table(profile_size * sizeof(dword));
+    block_hits = (dword *) alloc_table(profile_size * sizeof(dword));
+    seq_hits.assign(SEQ_OPS * SEQ_OPS + SEQ_OPS * SEQ_OPS * SEQ_OPS, 0);
+    fuse = false;
+    idioms = false;
+    profile_path = profile;
+}
+
+/**
+ * snapshot file of image in snapshot cache
+ */
+string snapshot_path() {
+    char name[64];
+    snprintf(name, sizeof(name), "/mipt64-%016llx.snap", source_hash);
+    return string(snapshot_dir) + name;
+}
+
+/**
+ * called before input syscall: on first input, when no input is consumed yet, save machine to snapshot cache -
+ * registers, nonzero memory pages, counters and output produced so far. Machine that has forked clones takes
+ * no snapshot: their handles, output and instructions can't be restored
+ */
+void take_snapshot() {
+    if (snapshot_dir == nullptr || input_used) return;
+    input_used = true;
+    if (snapshot_loaded || !maps.empty() || packing || clones != nullptr) return;
+    string path = snapshot_path();
+    if (access(path.c_str(), F_OK) == 0) return;
+    lazy_finish();
+    string temp = path + ".tmp" + to_string(getpid());
+    FILE *fp = fopen(temp.c_str(), "wb");
+    if (fp == nullptr) return;
+    dword head[6] = {0x50414e5354504d49ULL, source_hash, retired - 1, branches, image_size, prefix_output.size()};
+    fwrite(head, sizeof(head), 1, fp);
+    fwrite(regs, sizeof(regs), 1, fp);
+    fwrite(prefix_output.data(), 1, prefix_output.size(), fp);
+    const char *begin = (const char *) mem;
+    static const char zero[4096] = {0};
+    for (uint32_t page = 0; page < MEMSIZE / 4096; page++) {
+        if (memcmp(begin + page * 4096, zero, 4096) == 0) continue;
+        fwrite(&page, sizeof(page), 1, fp);
+        fwrite(begin + page * 4096, 1, 4096, fp);
+    }
+    bool ok = ferror(fp) == 0;
+    if (fclose(fp) == 0 && ok && rename(temp.c_str(), path.c_str()) == 0) return;
+    unlink(temp.c_str());
+}
+
+/**
+ * restore machine from snapshot of image instead of assembling it and executing instructions before first input
+ * \return true if snapshot was found
+ */
+bool load_snapshot() {
+    FILE *fp = fopen(snapshot_path().c_str(), "rb");
+    if (fp == nullptr) return false;
+    dword head[6];
+    dword saved[33];
+    if (fread(head, sizeof(head), 1, fp) != 1 || head[0] != 0x50414e5354504d49ULL || head[1] != source_hash ||
+        fread(saved, sizeof(saved), 1, fp) != 1) {
+        fclose(fp);
+        return false;
+    }
+    string output(head[5], 0);
+    if (fread(&output[0], 1, head[5], fp) != head[5]) {
+        fclose(fp);
+        return false;
+    }
+    char *begin = (char *) mem;
+    uint32_t page;
+    while (fread(&page, sizeof(page), 1, fp) == 1 && page < MEMSIZE / 4096)
+        if (fread(begin + page * 4096, 1, 4096, fp) != 4096) break;
+    fclose(fp);
+    memcpy(regs, saved, sizeof(regs));
+    parse_labels();
+    retired = snapshot_retired = head[2];
+    branches = head[3];
+    image_size = head[4];
+    replay_output = output;
+    snapshot_loaded = true;
+    return true;
+}
+
+/**
+ * stop machine if n memory words from address don't fit in guest memory
+ * \param[adr] - address of first word
+ * \param[n] - number of words
+ */
+void range_check(dword adr, dword n) {
+    if (n > mem_limit / 8) fault(adr);
+}
+
+/**
+ * read multi-precision number from guest memory
+ * \param[adr] - address of lowest limb
+ * \param[n] - number of limbs
+ */
+vector<limb> mp_load(dword adr, dword n) {
+    range_check(adr, n);
+    vector<limb> res(n);
+    for (dword i = 0; i < n; i++) res[i] = (limb) gmem(adr + i * LIMB_STEP);
+    return res;
+}
+
+/**
+ * write multi-precision number to guest memory
+ * \param[adr] - address of lowest limb
+ * \param[x] - limbs
+ */
+void mp_store(dword adr, const vector<limb> &x) {
+    range_check(adr, x.size());
+    for (size_t i = 0; i < x.size(); i++) smem(adr + i * LIMB_STEP, x[i]);
+}
+
+/**
+ * add x to r from limb at, carry goes on to the end of r
+ */
+void mp_add_at(vector<limb> &r, size_t at, const vector<limb> &x) {
+    wide_limb carry = 0;
+    for (size_t i = 0; at + i < r.size() && (i < x.size() || carry != 0); i++) {
+        wide_limb sum = (wide_limb) r[at + i] + (i < x.size() ? x[i] : 0) + carry;
+        r[at + i] = (limb) sum;
+        carry = sum >> LIMB_BITS;
+    }
+}
+
+/**
+ * subtract x from r, r is not less than x
+ */
+void mp_sub_from(vector<limb> &r, const vector<limb> &x) {
+    limb borrow = 0;
+    for (size_t i = 0; i < r.size() && (i < x.size() || borrow != 0); i++) {
+        wide_limb sub = (wide_limb) (i < x.size() ? x[i] : 0) + borrow;
+        borrow = r[i] < sub;
+        r[i] -= (limb) sub;
+    }
+}
+
+/**
+ * product of n limb numbers, Karatsuba method from KARATSUBA_LIMBS limbs
+ * \return 2n limbs
+ */
+vector<limb> mp_mul(const limb *a, const limb *b, size_t n) {
+    vector<limb> res(2 * n, 0);
+    if (n < KARATSUBA_LIMBS) {
+        for (size_t i = 0; i < n; i++) {
+            wide_limb carry = 0;
+            for (size_t j = 0; j < n; j++) {
+                wide_limb t = (wide_limb) a[i] * b[j] + res[i + j] + carry;
+                res[i + j] = (limb) t;
+                carry = t >> LIMB_BITS;
+            }
+            res[i + n] = (limb) carry;
         }
+        return res;
     }
+    size_t h = n / 2, m = n - h;
+    vector<limb> sa(a + h, a + n), sb(b + h, b + n);
+    sa.push_back(0), sb.push_back(0);
+    mp_add_at(sa, 0, vector<limb>(a, a + h));
+    mp_add_at(sb, 0, vector<limb>(b, b + h));
+    vector<limb> low = mp_mul(a, b, h), high = mp_mul(a + h, b + h, m), mid = mp_mul(sa.data(), sb.data(), m + 1);
+    mp_sub_from(mid, low);
+    mp_sub_from(mid, high);
+    mp_add_at(res, 0, low);
+    mp_add_at(res, h, mid);
+    mp_add_at(res, 2 * h, high);
+    return res;
 }
 
-void cmp(dword rd, dword rs, dword imm) {
-    if (greg(rd) == greg(rs) + imm) sreg(32, 0);
-    if (greg(rd) < greg(rs) + imm) sreg(32, 1);
-    if (greg(rd) > greg(rs) + imm) sreg(32, 2);
+/**
+ * multi-precision syscalls on little-endian limb arrays, operands are taken from registers starting with reg:
+ *  120 - add: dst, a, b, n. reg gets carry
+ *  121 - sub: dst, a, b, n. reg gets borrow
+ *  122 - mul: dst of 2n limbs, a, b, n
+ *  123 - divmod by limb: dst, a, n, d. reg gets remainder, -1 if d is 0
+ *  124 - compare: a, b, n. reg and flag get 0 if a = b, 1 if a < b, 2 if a > b, as with cmp
+ * \param[code] - syscall
+ * \param[reg] - first register of operands
+ */
+void mp_call(dword code, dword reg) {
+    if (reg + 4 > 31) operand_fault(reg);
+    dword n = greg(reg + 3);
+    if (code == 120 || code == 121) {
+        vector<limb> a = mp_load(greg(reg + 1), n), b = mp_load(greg(reg + 2), n);
+        limb carry = 0;
+        for (dword i = 0; i < n; i++) {
+            if (code == 120) {
+                wide_limb sum = (wide_limb) a[i] + b[i] + carry;
+                a[i] = (limb) sum;
+                carry = (limb) (sum >> LIMB_BITS);
+            } else {
+                wide_limb sub = (wide_limb) b[i] + carry;
+                carry = a[i] < sub;
+                a[i] -= (limb) sub;
+            }
+        }
+        mp_store(greg(reg), a);
+        sreg(reg, carry);
+    } else if (code == 122) {
+        vector<limb> a = mp_load(greg(reg + 1), n), b = mp_load(greg(reg + 2), n);
+        mp_store(greg(reg), mp_mul(a.data(), b.data(), n));
+    } else if (code == 123) {
+        n = greg(reg + 2);
+        limb d = (limb) greg(reg + 3);
+        vector<limb> a = mp_load(greg(reg + 1), n);
+        if (d == 0) {
+            sreg(reg, -1);
+            return;
+        }
+        wide_limb rem = 0;
+        for (dword i = n; i-- > 0;) {
+            wide_limb cur = rem << LIMB_BITS | a[i];
+            a[i] = (limb) (cur / d);
+            rem = cur % d;
+        }
+        mp_store(greg(reg), a);
+        sreg(reg, (limb) rem);
+    } else if (code == 124) {
+        n = greg(reg + 2);
+        vector<limb> a = mp_load(greg(reg), n), b = mp_load(greg(reg + 1), n);
+        dword res = 0;
+        for (dword i = n; i-- > 0 && res == 0;)
+            if (a[i] != b[i]) res = a[i] < b[i] ? 1 : 2;
+        sreg(reg, res);
+        sreg(32, res);
+    }
 }
 
-void cmpd(dword rd, dword rs, dword imm) {
-    double drd, drs, dimm;
-    dword wrd = greg(rd);
-    dword wrs = greg(rs);
-    memcpy(&drd, &wrd, 8);
-    memcpy(&drs, &wrs, 8);
-    memcpy(&dimm, &imm, 8);
-    if (drd == drs + dimm) sreg(32, 0);
-    if (drd < drs + dimm) sreg(32, 1);
-    if (drd > drs + dimm) sreg(32, 2);
+/**
+ * mix bits of key into slot number
+ */
+size_t map_hash(dword key) {
+    dword x = key;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
 }
 
-void cne(dword rd, dword rs, dword imm) {
-    if (greg(32) > 0) add(rd, rs, imm);
+/**
+ * hash map of handle, nullptr if handle is unknown or freed
+ */
+guest_map *map_of(dword handle) {
+    if (handle == 0 || handle > maps.size() || !maps[handle - 1].live) return nullptr;
+    return &maps[handle - 1];
 }
 
-void ceq(dword rd, dword rs, dword imm) {
-    if (greg(32) == 0) add(rd, rs, imm);
+/**
+ * slot with key or empty slot where key goes
+ */
+size_t map_find(const guest_map &m, dword key) {
+    size_t mask = m.used.size() - 1, i = map_hash(key) & mask;
+    while (m.used[i] && m.keys[i] != key) i = (i + 1) & mask;
+    return i;
 }
 
-void cle(dword rd, dword rs, dword imm) {
-    if (greg(32) < 2) add(rd, rs, imm);
+/**
+ * double table of hash map, keeping it at most half full
+ */
+void map_grow(guest_map &m) {
+    guest_map bigger;
+    size_t size = max((size_t) 16, m.used.size() * 2);
+    bigger.keys.resize(size);
+    bigger.values.resize(size);
+    bigger.used.assign(size, 0);
+    for (size_t i = 0; i < m.used.size(); i++) {
+        if (!m.used[i]) continue;
+        size_t j = map_find(bigger, m.keys[i]);
+        bigger.keys[j] = m.keys[i];
+        bigger.values[j] = m.values[i];
+        bigger.used[j] = 1;
+    }
+    m.keys.swap(bigger.keys);
+    m.values.swap(bigger.values);
+    m.used.swap(bigger.used);
 }
 
-void clt(dword rd, dword rs, dword imm) {
-    if (greg(32) == 1) add(rd, rs, imm);
+/**
+ * remove key in slot and shift following keys of its probe chain back, so no tombstones are left
+ */
+void map_erase_at(guest_map &m, size_t i) {
+    size_t mask = m.used.size() - 1;
+    m.used[i] = 0;
+    m.count--;
+    for (size_t j = (i + 1) & mask; m.used[j]; j = (j + 1) & mask) {
+        size_t home = map_hash(m.keys[j]) & mask;
+        if (((j - home) & mask) < ((j - i) & mask)) continue;
+        m.keys[i] = m.keys[j];
+        m.values[i] = m.values[j];
+        m.used[i] = 1;
+        m.used[j] = 0;
+        i = j;
+    }
 }
 
-void cge(dword rd, dword rs, dword imm) {
-    if (greg(32) != 1) add(rd, rs, imm);
+/**
+ * hash map syscalls, operands are taken from registers starting with reg. Flag gets 0 if key was found and 1
+ * otherwise, so jeq/ceq branch on found key:
+ *  140 - create: reg gets handle, handles of freed maps are reused
+ *  141 - insert: handle, key, value. Value of present key is replaced
+ *  142 - lookup: handle, key. Next register after key gets value of found key
+ *  143 - erase: handle, key
+ *  144 - size: reg gets number of keys of handle in reg
+ *  145 - iterate: handle, buffer, n, cursor. Writes at most n key, value pairs to buffer, reg gets their number,
+ *        0 when iteration is over. Cursor starts with 0 and is updated for next call
+ *  146 - free: handle
+ * \param[code] - syscall
+ * \param[reg] - first register of operands
+ */
+void map_call(dword code, dword reg) {
+    if (reg + 4 > 31) operand_fault(reg);
+    if (code == 140) {
+        size_t slot = 0;
+        while (slot < maps.size() && maps[slot].live) slot++;
+        if (slot == maps.size()) maps.push_back(guest_map());
+        maps[slot].live = true;
+        sreg(reg, slot + 1);
+        return;
+    }
+    guest_map *m = map_of(greg(reg));
+    bool found = false;
+    if (m == nullptr) {
+        if (code == 144 || code == 145) sreg(reg, 0);
+        sreg(32, 1);
+        return;
+    }
+    dword key = greg(reg + 1);
+    size_t i = m->used.empty() ? 0 : map_find(*m, key);
+    found = !m->used.empty() && m->used[i];
+    if (code == 141) {
+        if (!found && (m->count + 1) * 2 > m->used.size()) {
+            map_grow(*m);
+            i = map_find(*m, key);
+        }
+        if (!found) m->count++;
+        m->keys[i] = key;
+        m->values[i] = greg(reg + 2);
+        m->used[i] = 1;
+    } else if (code == 142) {
+        if (found) sreg(reg + 2, m->values[i]);
+    } else if (code == 143) {
+        if (found) map_erase_at(*m, i);
+    } else if (code == 144) {
+        sreg(reg, m->count);
+    } else if (code == 145) {
+        dword buffer = greg(reg + 1), n = greg(reg + 2), written = 0;
+        size_t cursor = greg(reg + 3);
+        range_check(buffer, 2 * min((size_t) n, m->count));
+        for (; cursor < m->used.size() && written < n; cursor++) {
+            if (!m->used[cursor]) continue;
+            smem(buffer + 2 * written * 8, m->keys[cursor]);
+            smem(buffer + (2 * written + 1) * 8, m->values[cursor]);
+            written++;
+        }
+        sreg(reg, written);
+        sreg(reg + 3, cursor);
+    } else if (code == 146) {
+        *m = guest_map();
+    }
+    sreg(32, found ? 0 : 1);
 }
 
-void cgt(dword rd, dword rs, dword imm) {
-    if (greg(32) == 2) add(rd, rs, imm);
+#ifdef __SSE2__
+/**
+ * compare SCAN_WIDTH bytes with symbol
+ * \param[p] - first byte
+ * \param[key] - symbol in every byte
+ * \return bit i is set if p[i] is symbol
+ */
+int scan_mask(const symbol *p, __m128i key) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), key));
 }
 
-void ld(dword rd, dword ra, dword imm) {
-    if (ra == 29) {
-        sreg(rd, pop_stack(imm));
-    } else {
-        sreg(rd, gmem(greg(ra) + imm));
+/**
+ * symbol in every lane for scan_mask()
+ */
+__m128i scan_key(symbol c) {
+    return _mm_set1_epi8(c);
+}
+#endif
+
+/**
+ * stop machine if n bytes from address don't fit in guest memory
+ * \param[adr] - address of first byte
+ * \param[n] - number of bytes
+ */
+void bytes_check(dword adr, dword n) {
+    if (n > mem_limit || adr > mem_limit - n) fault(adr);
+}
+
+/**
+ * position of first symbol c in p[from, n), n if there is none
+ */
+dword find_symbol(const symbol *p, dword from, dword n, symbol c) {
+    dword i = from;
+#ifdef __SSE2__
+    __m128i key = scan_key(c);
+    for (; i + SCAN_WIDTH <= n; i += SCAN_WIDTH) {
+        int mask = scan_mask(p + i, key);
+        if (mask != 0) return i + __builtin_ctz(mask);
     }
+#endif
+    for (; i < n; i++)
+        if (p[i] == c) return i;
+    return n;
 }
 
-void st(dword rd, dword ra, dword imm) {
-    if (ra == 29) {
-        push_stack(greg(rd), imm);
-    } else {
-        smem(greg(ra) + imm, greg(rd));
+/**
+ * number of symbols c in p[0, n)
+ */
+dword count_symbol(const symbol *p, dword n, symbol c) {
+    dword res = 0, i = 0;
+#ifdef __SSE2__
+    __m128i key = scan_key(c);
+    for (; i + SCAN_WIDTH <= n; i += SCAN_WIDTH) res += __builtin_popcount(scan_mask(p + i, key));
+#endif
+    for (; i < n; i++) res += p[i] == c;
+    return res;
+}
+
+/**
+ * position of first pattern in p[from, n), n if there is none. Candidates must match first and last symbol of
+ * pattern, which are checked for SCAN_WIDTH positions at once, only then whole pattern is compared
+ * \param[pat] - pattern
+ * \param[m] - length of pattern, not 0
+ */
+dword find_pattern(const symbol *p, dword from, dword n, const symbol *pat, dword m) {
+    if (m > n) return n;
+    dword i = from, last = n - m;
+#ifdef __SSE2__
+    __m128i first_key = scan_key(pat[0]), last_key = scan_key(pat[m - 1]);
+    for (; i + SCAN_WIDTH <= last + 1; i += SCAN_WIDTH) {
+        int mask = scan_mask(p + i, first_key) & scan_mask(p + i + m - 1, last_key);
+        for (; mask != 0; mask &= mask - 1) {
+            dword at = i + __builtin_ctz(mask);
+            if (memcmp(p + at, pat, m * sizeof(symbol)) == 0) return at;
+        }
     }
+#endif
+    for (; i <= last; i++)
+        if (p[i] == pat[0] && memcmp(p + i, pat, m * sizeof(symbol)) == 0) return i;
+    return n;
 }
 
 /**
- * Get type and args of command and call function
- * \param [type] - command to execute
- * \param [tail] - commands args
+ * split p[0, n) into tokens separated by symbol c, empty tokens are skipped
+ * \param[tokens] - gets offset and length of every token
+ * \param[max] - most tokens to find
+ * \return symbols consumed: n if all tokens were found, else offset of first token which didn't fit
  */
-void switch_c(dword row) {
-    dword type = t0_5(row);
-    dword rd = 0, rs = 0, imm = 0, ra = 0;
-    if (TYPE[type] == "RR") {
-        rd = t6_10(row);
-        rs = t11_15(row);
-        if (rs == 27) imm = t16_31(row);
-        else if (rs == 31) imm = t16_31(row);
-        else {
-            if (type == 13 or type == 14 or type == 15 or type == 16) {
-                dword fw = greg(t16_20(row));
-                dword sw = t21_23(row);
-                dword tw = t24_31(row);
-                double f, r;
-                memcpy(&f, &fw, 8);
-                r = f * (1 << sw) + tw;
-                memcpy(&imm, &r, 8);
-            } else imm = (greg(t16_20(row)) << t21_23(row)) + t24_31(row);
-        }
-    } else if (TYPE[type] == "RM") {
-        rd = t6_10(row);
-        ra = t11_15(row);
-        if (ra == 27 or ra == 29 or ra == 31) imm = t16_31(row);
-        else {
-            dword ri = t16_20(row);
-            if (ri == 27) imm = t21_31(row);
-            else imm = greg(ra) + (greg(t16_20(row)) << t21_23(row)) + t24_31(row);
+dword split_symbols(const symbol *p, dword n, symbol c, vector<dword> &tokens, dword max) {
+    dword start = 0, i = 0;
+#ifdef __SSE2__
+    __m128i key = scan_key(c);
+#endif
+    while (i < n) {
+        int mask;
+        dword width;
+#ifdef __SSE2__
+        if (i + SCAN_WIDTH <= n) {
+            mask = scan_mask(p + i, key);
+            width = SCAN_WIDTH;
+        } else
+#endif
+        {
+            mask = p[i] == c;
+            width = 1;
         }
-    } else if (TYPE[type] == "B") {
-        ra = t6_10(row);
-        if (ra == 27 or ra == 31 or ra == 0) imm = t21_31(row);
-        else imm = greg(ra) + (greg(t11_15(row)) << t16_18(row)) + t19_31(row);
+        for (; mask != 0; mask &= mask - 1) {
+            dword delim = i + __builtin_ctz(mask);
+            if (delim > start) {
+                if (tokens.size() / 2 == max) return start;
+                tokens.push_back(start);
+                tokens.push_back(delim - start);
+            }
+            start = delim + 1;
+        }
+        i += width;
     }
-    switch (type) {
+    if (n > start) {
+        if (tokens.size() / 2 == max) return start;
+        tokens.push_back(start);
+        tokens.push_back(n - start);
+    }
+    return n;
+}
+
+/**
+ * string syscalls on symbol arrays in guest memory (bytes in mipt64, memory words in mipt32), operands are taken
+ * from registers starting with reg. Offsets and lengths are in symbols:
+ *  150 - find: adr, n, c. Reg gets offset of first c, -1 if there is none
+ *  151 - search: adr, n, pattern, m. Reg gets offset of first pattern of m symbols, -1 if there is none
+ *  152 - count: adr, n, pattern, m. Reg gets number of not overlapping patterns
+ *  153 - split: adr, n, c, out, max. Writes offset and length of at most max tokens separated by c to out words,
+ *        reg gets number of tokens and next register symbols consumed, n if every token was written
+ * \param[code] - syscall
+ * \param[reg] - first register of operands
+ */
+void string_call(dword code, dword reg) {
+    if (reg + 5 > 31) operand_fault(reg);
+    dword adr = greg(reg), n = greg(reg + 1), c = greg(reg + 2), m = greg(reg + 3);
+    bytes_check(adr, n);
+    if (code == 151 || code == 152) bytes_check(c, m);
+    if (lazy_pending != 0) lazy_finish();
+    const symbol *p = (const symbol *) (mem + adr), *pat = (const symbol *) (mem + c);
+    if (code == 150) {
+        dword at = find_symbol(p, 0, n, (symbol) c);
+        sreg(reg, at == n ? -1 : at);
+    } else if (code == 151) {
+        dword at = m == 0 ? 0 : find_pattern(p, 0, n, pat, m);
+        sreg(reg, at == n && m != 0 ? -1 : at);
+    } else if (code == 152) {
+        dword res = 0;
+        if (m == 1) res = count_symbol(p, n, pat[0]);
+        for (dword at = 0; m > 1 && (at = find_pattern(p, at, n, pat, m)) != n; at += m) res++;
+        sreg(reg, res);
+    } else if (code == 153) {
+        vector<dword> tokens;
+        dword consumed = split_symbols(p, n, (symbol) c, tokens, greg(reg + 4));
+        range_check(m, tokens.size());
+        for (dword i = 0; i < tokens.size(); i++) smem(m + i * 8, tokens[i]);
+        sreg(reg, tokens.size() / 2);
+        sreg(reg + 1, consumed);
+    }
+}
+
+/**
+ * word of host copy of guest memory, which may be unaligned
+ */
+dword load_word(const char *p) {
+    dword res;
+    memcpy(&res, p, 8);
+    return res;
+}
+
+/**
+ * stop machine if array of n words doesn't fit in guest memory
+ * \return number of words from address to end of guest memory
+ */
+dword words_span(dword adr, dword n) {
+    if (n > mem_limit / 8) fault(adr);
+    bytes_check(adr, n * 8);
+    return (mem_limit - adr) / 8;
+}
+
+/**
+ * dst[i] = src[idx[i]] for n words, src[idx[i]] must be in guest memory
+ */
+void gather(dword dst, dword src, dword idx, dword n) {
+    words_span(dst, n);
+    words_span(idx, n);
+    dword span = src < mem_limit ? (mem_limit - src) / 8 : 0;
+    char *to = mem + dst, *base = mem + src;
+    const char *at = mem + idx;
+    for (dword i = 0; i < n; i++) {
+        if (i + PREFETCH_AHEAD < n) {
+            dword ahead = load_word(at + (i + PREFETCH_AHEAD) * 8);
+            if (ahead < span) __builtin_prefetch(base + ahead * 8);
+        }
+        dword k = load_word(at + i * 8);
+        if (k >= span) fault(src + k * 8);
+        memcpy(to + i * 8, base + k * 8, 8);
+    }
+    if (trace_out != nullptr) trace_words(dst, n);
+}
+
+/**
+ * dst[idx[i]] = src[i] for n words, dst[idx[i]] must be in guest memory
+ */
+void scatter(dword dst, dword src, dword idx, dword n) {
+    words_span(src, n);
+    words_span(idx, n);
+    dword span = dst < mem_limit ? (mem_limit - dst) / 8 : 0;
+    char *base = mem + dst;
+    const char *from = mem + src, *at = mem + idx;
+    for (dword i = 0; i < n; i++) {
+        if (i + PREFETCH_AHEAD < n) {
+            dword ahead = load_word(at + (i + PREFETCH_AHEAD) * 8);
+            if (ahead < span) __builtin_prefetch(base + ahead * 8, 1);
+        }
+        dword k = load_word(at + i * 8);
+        if (k >= span) fault(dst + k * 8);
+        memcpy(base + k * 8, from + i * 8, 8);
+        if (trace_out != nullptr) trace_put(TRACE_MEM, dst + k * 8, load_word(from + i * 8));
+    }
+}
+
+/**
+ * a[i] = a[idx[i]] for n words with every read done before writes, so permutation is applied in place
+ */
+void permute(dword a, dword idx, dword n) {
+    words_span(a, n);
+    words_span(idx, n);
+    char *base = mem + a;
+    const char *at = mem + idx;
+    vector<dword> res(n);
+    for (dword i = 0; i < n; i++) {
+        if (i + PREFETCH_AHEAD < n) {
+            dword ahead = load_word(at + (i + PREFETCH_AHEAD) * 8);
+            if (ahead < n) __builtin_prefetch(base + ahead * 8);
+        }
+        dword k = load_word(at + i * 8);
+        if (k >= n) fault(a + k * 8);
+        res[i] = load_word(base + k * 8);
+    }
+    memcpy(base, res.data(), n * 8);
+    if (trace_out != nullptr) trace_words(a, n);
+}
+
+/**
+ * index syscalls on word arrays in guest memory, indices are in words. Operands are taken from registers starting
+ * with reg:
+ *  160 - gather: dst, src, idx, n. dst[i] = src[idx[i]]
+ *  161 - scatter: dst, src, idx, n. dst[idx[i]] = src[i]
+ *  162 - permute: a, idx, n. a[i] = a[idx[i]] in place, idx[i] < n
+ * \param[code] - syscall
+ * \param[reg] - first register of operands
+ */
+void index_call(dword code, dword reg) {
+    if (reg + 4 > 31) operand_fault(reg);
+    if (lazy_pending != 0) lazy_finish();
+    if (code == 160) gather(greg(reg), greg(reg + 1), greg(reg + 2), greg(reg + 3));
+    else if (code == 161) scatter(greg(reg), greg(reg + 1), greg(reg + 2), greg(reg + 3));
+    else if (code == 162) permute(greg(reg), greg(reg + 1), greg(reg + 2));
+}
+
+/**
+ * stop machine if matrix doesn't fit in guest memory or its rows overlap (stride less than columns)
+ * \param[adr] - address of first element
+ * \param[rows] - number of rows
+ * \param[cols] - number of columns
+ * \param[ld] - leading stride in elements
+ */
+void matrix_check(dword adr, dword rows, dword cols, dword ld) {
+    if (rows == 0 || cols == 0) return;
+    if (ld < cols || rows > mem_limit || ld > mem_limit || adr > mem_limit - 8 ||
+        ((rows - 1) * ld + cols - 1) * 8 > mem_limit - 8 - adr)
+        fault(adr);
+}
+
+/**
+ * rows [from, to) of c = a * b. Every element is summed in order of k from zero with separate multiply and add
+ * like loop of ld, muld, addd does, so blocking, SIMD and threads don't change a bit of result
+ * \param[c] - host result, n elements per row
+ */
+void matmul_rows(double *c, const char *a, const char *b, dword from, dword to, dword n, dword k, dword lda,
+                 dword ldb) {
+    for (dword jj = 0; jj < n; jj += MATMUL_BLOCK_N) {
+        dword jn = min(n, jj + MATMUL_BLOCK_N);
+        for (dword pp = 0; pp < k; pp += MATMUL_BLOCK_K) {
+            dword pn = min(k, pp + MATMUL_BLOCK_K);
+            for (dword i = from; i < to; i++) {
+                double *row = c + i * n;
+                for (dword p = pp; p < pn; p++) {
+                    double x;
+                    memcpy(&x, a + (i * lda + p) * 8, 8);
+                    const char *brow = b + p * ldb * 8;
+                    dword j = jj;
+#ifdef __SSE2__
+                    __m128d vx = _mm_set1_pd(x);
+                    for (; j + 2 <= jn; j += 2) {
+                        __m128d vb = _mm_loadu_pd((const double *) (brow + j * 8));
+                        _mm_storeu_pd(row + j, _mm_add_pd(_mm_loadu_pd(row + j), _mm_mul_pd(vx, vb)));
+                    }
+#endif
+                    for (; j < jn; j++) {
+                        double y;
+                        memcpy(&y, brow + j * 8, 8);
+                        row[j] += x * y;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * matrix multiply syscall: C = A * B for row-major double matrices, operands are taken from registers starting
+ * with reg: C, A, B, m, n, k, lda, ldb, ldc. A is m x k, B is k x n, C is m x n, strides are in elements.
+ * C may overlap A or B, they are read before C is written
+ * \param[reg] - first register of operands
+ */
+void matmul(dword reg) {
+    if (reg + 9 > 31) operand_fault(reg);
+    dword c = greg(reg), a = greg(reg + 1), b = greg(reg + 2), m = greg(reg + 3), n = greg(reg + 4);
+    dword k = greg(reg + 5), lda = greg(reg + 6), ldb = greg(reg + 7), ldc = greg(reg + 8);
+    matrix_check(a, m, k, lda);
+    matrix_check(b, k, n, ldb);
+    matrix_check(c, m, n, ldc);
+    if (m == 0 || n == 0) return;
+    if (lazy_pending != 0) lazy_finish();
+    if (k > 0) {
+        unpack_range(a, ((m - 1) * lda + k) * 8);
+        unpack_range(b, ((k - 1) * ldb + n) * 8);
+    }
+    vector<double> res(m * n, 0.0);
+    dword parts = max(1LL, min((long long) matmul_threads, (long long) m));
+    vector<thread> pool;
+    for (dword t = 1; t < parts; t++)
+        pool.emplace_back(matmul_rows, res.data(), mem + a, mem + b, m * t / parts, m * (t + 1) / parts, n, k, lda, ldb);
+    matmul_rows(res.data(), mem + a, mem + b, 0, m / parts, n, k, lda, ldb);
+    for (thread &t : pool) t.join();
+    for (dword i = 0; i < m; i++) {
+        memcpy(mem + c + i * ldc * 8, res.data() + i * n, n * 8);
+        if (trace_out != nullptr) trace_words(c + i * ldc * 8, n);
+    }
+}
+
+/// every functions here emulate processor command. See processor doc to get information
+
+void halt(dword rd, dword rs, dword imm) {
+    stop_machine((int) imm);
+}
+
+void svc(dword rd, dword rs, dword imm) {
+    switch (imm) {
         case 0:
-            halt(rd, rs, imm);
-            break;
-        case 1:
-            svc(rd, rs, imm);
-            break;
-        case 2:
-            add(rd, rs, imm);
-            break;
-        case 3:
-            sub(rd, rs, imm);
-            break;
-        case 4:
-            mul(rd, rs, imm);
-            break;
-        case 5:
-            div(rd, rs, imm);
-            break;
-        case 6:
-            mod(rd, rs, imm);
-            break;
-        case 7:
-            And(rd, rs, imm);
-            break;
-        case 8:
-            Or(rd, rs, imm);
-            break;
-        case 9:
-            Xor(rd, rs, imm);
-            break;
-        case 10:
-            nand(rd, rs, imm);
-            break;
-        case 11:
-            shl(rd, rs, imm);
-            break;
-        case 12:
-            shr(rd, rs, imm);
-            break;
-        case 13:
-            addd(rd, rs, imm);
-            break;
-        case 14:
-            subd(rd, rs, imm);
-            break;
-        case 15:
-            muld(rd, rs, imm);
-            break;
-        case 16:
-            divd(rd, rs, imm);
-            break;
-        case 17:
-            itod(rd, rs, imm);
+            stop_machine(0);
+        case 100:
+            take_snapshot();
+            wait_input();
+            dword scanning_int;
+            fscanf(guest_in, "%lld", &scanning_int);
+            sreg(rd, scanning_int);
             break;
-        case 18:
-            dtoi(rd, rs, imm);
+        case 101:
+            take_snapshot();
+            wait_input();
+            double ddi;
+            dword dwi;
+            fscanf(guest_in, "%lf", &ddi);
+            memcpy(&dwi, &ddi, 8);
+            sreg(rd, (dwi << 32) >> 32);
+            sreg(rd + 1, dwi >> 32);
             break;
-        case 19:
-            bl(ra, imm);
+        case 102:
+            dword sending_int;
+            sending_int = greg(rd);
+            if (rd == 31 or rd == 30) guest_printf("%lld", sending_int / 2 + 4);
+            else guest_printf("%lld", sending_int);
             break;
-        case 20:
-            cmp(rd, rs, imm);
+        case 103:
+            dword dwo;
+            dwo = greg(rd);
+            double ddo;
+            memcpy(&ddo, &dwo, 8);
+            guest_printf("%lg", ddo);
             break;
-        case 21:
-            cmpd(rd, rs, imm);
+        case 104:
+            take_snapshot();
+            wait_input();
+            char scanning_char;
+            fscanf(guest_in, "%c", &scanning_char);
+            sreg(rd, scanning_char);
             break;
-        case 22:
-            cne(rd, rs, imm);
+        case 105:
+            char sending_char;
+            sending_char = (char) greg(rd);
+            guest_printf("%c", sending_char);
             break;
-        case 23:
-            ceq(rd, rs, imm);
+        case 130:
+            matmul(rd);
             break;
-        case 24:
-            cle(rd, rs, imm);
+        case 160:
+        case 161:
+        case 162:
+            index_call(imm, rd);
             break;
-        case 25:
-            clt(rd, rs, imm);
+        case 150:
+        case 151:
+        case 152:
+        case 153:
+            string_call(imm, rd);
             break;
-        case 26:
-            cge(rd, rs, imm);
+        case 140:
+        case 141:
+        case 142:
+        case 143:
+        case 144:
+        case 145:
+        case 146:
+            map_call(imm, rd);
             break;
-        case 27:
-            cgt(rd, rs, imm);
+        case 120:
+        case 121:
+        case 122:
+        case 123:
+        case 124:
+            mp_call(imm, rd);
             break;
-        case 28:
-            ld(rd, ra, imm);
+        case 110:
+            sreg(rd, guest_fork());
             break;
-        case 29:
-            st(rd, ra, imm);
+        case 111:
+            sreg(rd, guest_join(greg(rd)));
             break;
+        case 112:
+            if (clone_self != nullptr) finish_clone(greg(rd));
+            stop_machine((int) greg(rd));
     }
 }
 
-/**
- * main emulating function
- */
-void emulate() {
-    while (true) {
-        dword row_com = gmem(greg(31));
-        switch_c(row_com);
-        sreg(31, greg(31) + 8);
-    }
+void add(dword rd, dword rs, dword imm) {
+    if (rd == 31 and rs == 31) sreg(rd, imm);
+    else sreg(rd, greg(rs) + imm);
 }
 
-int main() {
-    file_input();
-    assemble();
+void sub(dword rd, dword rs, dword imm) {
+    sreg(rd, greg(rs) - imm);
+}
+
+void mul(dword rd, dword rs, dword imm) {
+    sreg(rd, greg(rs) * imm);
+}
+
+void div(dword rd, dword rs, dword imm) {
+    sreg(rd, greg(rs) / imm);
+}
+
+void mod(dword rd, dword rs, dword imm) {
+    sreg(rd, greg(rs) % imm);
+}
+
+void And(dword rd, dword rs, dword imm) {
+    sreg(rd, greg(rs) & imm);
+}
+
+void Or(dword rd, dword rs, dword imm) {
+    sreg(rd, greg(rs) | imm);
+}
+
+void Xor(dword rd, dword rs, dword imm) {
+    sreg(rd, greg(rs) ^ imm);
+}
+
+void nand(dword rd, dword rs, dword imm) {
+    sreg(rd, (greg(rs) ^ imm) & greg(rs));
+}
+
+void shl(dword rd, dword rs, dword imm) {
+    sreg(rd, greg(rs) << (imm & 0b111111));
+}
+
+void shr(dword rd, dword rs, dword imm) {
+    sreg(rd, greg(rs) >> (imm & 0b111111));
+}
+
+void addd(dword rd, dword rs, dword imm) {
+    double drs, drd, dimm;
+    dword in = greg(rs);
+    memcpy(&drs, &in, 8);
+    memcpy(&dimm, &imm, 8);
+    drd = drs + dimm;
+    dword out;
+    memcpy(&out, &drd, 8);
+    sreg(rd, out);
+}
+
+void subd(dword rd, dword rs, dword imm) {
+    double drs, drd, dimm;
+    dword in = greg(rs);
+    memcpy(&drs, &in, 8);
+    memcpy(&dimm, &imm, 8);
+    drd = drs - dimm;
+    dword out;
+    memcpy(&out, &drd, 8);
+    sreg(rd, out);
+}
+
+void muld(dword rd, dword rs, dword imm) {
+    double drs, drd, dimm;
+    dword in = greg(rs);
+    memcpy(&drs, &in, 8);
+    memcpy(&dimm, &imm, 8);
+    drd = drs * dimm;
+    dword out;
+    memcpy(&out, &drd, 8);
+    sreg(rd, out);
+}
+
+void divd(dword rd, dword rs, dword imm) {
+    double drs, drd, dimm;
+    dword in = greg(rs);
+    memcpy(&drs, &in, 8);
+    memcpy(&dimm, &imm, 8);
+    drd = drs / dimm;
+    dword out;
+    memcpy(&out, &drd, 8);
+    sreg(rd, out);
+}
+
+void itod(dword rd, dword rs, dword imm) {
+    dword in = greg(rs);
+    double dout = (double) in + (double) imm;
+    dword out;
+    memcpy(&out, &dout, 8);
+    sreg(rd, out);
+}
+
+void dtoi(dword rd, dword rs, dword imm) {
+    dword in = greg(rs);
+    double din, dimm;
+    memcpy(&din, &in, 8);
+    memcpy(&dimm, &imm, 8);
+    double dout = din + dimm;
+    dword out;
+    memcpy(&out, &dout, 8);
+    sreg(rd, out);
+}
+
+void bl(dword ra, dword imm) {
+    sreg(30, greg(31));
+    if (ra == 27) {
+        sreg(31, imm);
+    } else {
+        if ((imm >> 20) % 2 == 1) {
+            imm <<= 1;
+            imm /= 2;
+            sreg(31, greg(31) - imm);
+        } else {
+            sreg(31, greg(31) - imm);
+        }
+    }
+}
+
+void cmp(dword rd, dword rs, dword imm) {
+    if (greg(rd) == greg(rs) + imm) sreg(32, 0);
+    if (greg(rd) < greg(rs) + imm) sreg(32, 1);
+    if (greg(rd) > greg(rs) + imm) sreg(32, 2);
+}
+
+void cmpd(dword rd, dword rs, dword imm) {
+    double drd, drs, dimm;
+    dword wrd = greg(rd);
+    dword wrs = greg(rs);
+    memcpy(&drd, &wrd, 8);
+    memcpy(&drs, &wrs, 8);
+    memcpy(&dimm, &imm, 8);
+    if (drd == drs + dimm) sreg(32, 0);
+    if (drd < drs + dimm) sreg(32, 1);
+    if (drd > drs + dimm) sreg(32, 2);
+}
+
+void cne(dword rd, dword rs, dword imm) {
+    if (greg(32) > 0) add(rd, rs, imm);
+}
+
+void ceq(dword rd, dword rs, dword imm) {
+    if (greg(32) == 0) add(rd, rs, imm);
+}
+
+void cle(dword rd, dword rs, dword imm) {
+    if (greg(32) < 2) add(rd, rs, imm);
+}
+
+void clt(dword rd, dword rs, dword imm) {
+    if (greg(32) == 1) add(rd, rs, imm);
+}
+
+void cge(dword rd, dword rs, dword imm) {
+    if (greg(32) != 1) add(rd, rs, imm);
+}
+
+void cgt(dword rd, dword rs, dword imm) {
+    if (greg(32) == 2) add(rd, rs, imm);
+}
+
+void ld(dword rd, dword ra, dword imm) {
+    if (ra == 29) {
+        sreg(rd, pop_stack(imm));
+    } else {
+        sreg(rd, gmem(greg(ra) + imm));
+    }
+}
+
+void st(dword rd, dword ra, dword imm) {
+    if (ra == 29) {
+        push_stack(greg(rd), imm);
+    } else {
+        smem(greg(ra) + imm, greg(rd));
+    }
+}
+
+/**
+ * immediate operand of RR instruction
+ * \param[row] - instruction
+ * \param[type] - type of instruction
+ */
+dword rr_imm(dword row, dword type) {
+    dword imm, rs = t11_15(row);
+    if (rs == 27) imm = t16_31(row);
+    else if (rs == 31) imm = t16_31(row);
+    else {
+        if (type == 13 or type == 14 or type == 15 or type == 16) {
+            dword fw = greg(t16_20(row));
+            dword sw = t21_23(row);
+            dword tw = t24_31(row);
+            double f, r;
+            memcpy(&f, &fw, 8);
+            r = f * (1 << sw) + tw;
+            memcpy(&imm, &r, 8);
+        } else imm = (greg(t16_20(row)) << t21_23(row)) + t24_31(row);
+    }
+    return imm;
+}
+
+/**
+ * address operand of RM instruction
+ * \param[row] - instruction
+ */
+dword rm_imm(dword row) {
+    dword imm, ra = t11_15(row);
+    if (ra == 27 or ra == 29 or ra == 31) imm = t16_31(row);
+    else {
+        dword ri = t16_20(row);
+        if (ri == 27) imm = t21_31(row);
+        else imm = greg(ra) + (greg(t16_20(row)) << t21_23(row)) + t24_31(row);
+    }
+    return imm;
+}
+
+/**
+ * Get type and args of command and call function
+ * \param [type] - command to execute
+ * \param [tail] - commands args
+ */
+void switch_c(dword row) {
+    dword type = t0_5(row);
+    dword rd = 0, rs = 0, imm = 0, ra = 0;
+    if (TYPE[type] == TYPE_RR) {
+        rd = t6_10(row);
+        rs = t11_15(row);
+        imm = rr_imm(row, type);
+    } else if (TYPE[type] == TYPE_RM) {
+        rd = t6_10(row);
+        ra = t11_15(row);
+        imm = rm_imm(row);
+    } else if (TYPE[type] == TYPE_B) {
+        ra = t6_10(row);
+        if (ra == 27 or ra == 31 or ra == 0) imm = t21_31(row);
+        else imm = greg(ra) + (greg(t11_15(row)) << t16_18(row)) + t19_31(row);
+    }
+    if (type == 19 || (rd == 31 && (type == 2 || (type >= 22 && type <= 27)))) branches++;
+    switch (type) {
+        case 0:
+            halt(rd, rs, imm);
+            break;
+        case 1:
+            svc(rd, rs, imm);
+            break;
+        case 2:
+            add(rd, rs, imm);
+            break;
+        case 3:
+            sub(rd, rs, imm);
+            break;
+        case 4:
+            mul(rd, rs, imm);
+            break;
+        case 5:
+            div(rd, rs, imm);
+            break;
+        case 6:
+            mod(rd, rs, imm);
+            break;
+        case 7:
+            And(rd, rs, imm);
+            break;
+        case 8:
+            Or(rd, rs, imm);
+            break;
+        case 9:
+            Xor(rd, rs, imm);
+            break;
+        case 10:
+            nand(rd, rs, imm);
+            break;
+        case 11:
+            shl(rd, rs, imm);
+            break;
+        case 12:
+            shr(rd, rs, imm);
+            break;
+        case 13:
+            addd(rd, rs, imm);
+            break;
+        case 14:
+            subd(rd, rs, imm);
+            break;
+        case 15:
+            muld(rd, rs, imm);
+            break;
+        case 16:
+            divd(rd, rs, imm);
+            break;
+        case 17:
+            itod(rd, rs, imm);
+            break;
+        case 18:
+            dtoi(rd, rs, imm);
+            break;
+        case 19:
+            bl(ra, imm);
+            break;
+        case 20:
+            cmp(rd, rs, imm);
+            break;
+        case 21:
+            cmpd(rd, rs, imm);
+            break;
+        case 22:
+            cne(rd, rs, imm);
+            break;
+        case 23:
+            ceq(rd, rs, imm);
+            break;
+        case 24:
+            cle(rd, rs, imm);
+            break;
+        case 25:
+            clt(rd, rs, imm);
+            break;
+        case 26:
+            cge(rd, rs, imm);
+            break;
+        case 27:
+            cgt(rd, rs, imm);
+            break;
+        case 28:
+            ld(rd, ra, imm);
+            break;
+        case 29:
+            st(rd, ra, imm);
+            break;
+    }
+}
+
+/**
+ * one-shot run got past its start, advise guest memory to transparent huge pages. Short runs never zero
+ * whole huge pages on first touch
+ */
+void promote_memory() {
+    huge_pending = false;
+    preempt_at = ~0ULL;
+    if (madvise(arena, MEMSIZE, MADV_HUGEPAGE) == 0) mem_backing = "transparent huge pages";
+}
+
+/**
+ * stop batch job at block boundary after its slice, runner continues it when tenant's turn comes.
+ * Packed programm returns to scheduler
+ */
+void preempt() {
+    if (huge_pending) {
+        promote_memory();
+        return;
+    }
+    if (packing) throw pack_switch{false};
+    result->retired = retired;
+    result->branches = branches;
+    raise(SIGSTOP);
+    preempt_at = retired + slice;
+}
+
+/**
+ * instruction of fused sequence has expected type and doesn't write pc
+ * \param[row] - instruction
+ * \param[type] - type of sequence element
+ */
+bool fuse_match(dword row, dword type) {
+    return t0_5(row) == type && t6_10(row) != 31;
+}
+
+#include "fused.inc"
+
+enum {IDIOM_FILL = 1, IDIOM_COPY, IDIOM_SUM, IDIOM_FIND};
+
+/**
+ * loop recognized as idiom: body, then "add index, index, rz, 0, step", "cmp index, bound_reg, bound" and
+ * "clt pc, rz, head"
+ */
+struct loop_idiom {
+    int kind; /// IDIOM_FILL, IDIOM_COPY, IDIOM_SUM or IDIOM_FIND
+    dword head; /// address of first instruction
+    dword len; /// instructions in loop
+    dword index; /// register counted from head to bound
+    dword step; /// increment of index
+    dword bound_reg; /// register index is compared with plus bound, rz if bound is immediate
+    dword bound; /// immediate part of bound
+    dword value; /// register stored by fill, loaded by copy, sum and find
+    dword other; /// sum register of sum, register compared by find plus delta
+    dword from; /// offset from index of loaded word
+    dword to; /// offset from index of stored word
+    dword delta; /// step of filled value, addend of sum or immediate part of key of find
+    dword exit; /// jump target of find when key is found
+};
+
+/**
+ * "ld" or "st" of word at index register plus offset, which is "ld value, index, rz, 0, offset"
+ */
+bool indexed_access(dword row, dword type) {
+    dword ra = t11_15(row);
+    return t0_5(row) == type && ra != 27 && ra != 29 && ra != 31 && t16_20(row) == 27;
+}
+
+/**
+ * immediate of RR instruction which doesn't change while loop runs: it doesn't read registers besides rz
+ */
+bool constant_imm(dword row) {
+    return t11_15(row) == 27 || t11_15(row) == 31 || t16_20(row) == 27;
+}
+
+/**
+ * match loop of len instructions at head with idiom:
+ *  fill - "st value, index, rz, 0, to", optional "add value, value, rz, 0, delta"
+ *  copy - "ld value, index, rz, 0, from", "st value, index, rz, 0, to"
+ *  sum - "ld value, index, rz, 0, from", "add other, other, value, 0, delta"
+ *  find - "ld value, index, rz, 0, from", "cmp value, other, delta", "ceq pc, rz, exit"
+ * followed by loop tail. Registers written by loop must differ from each other and from registers it only reads
+ */
+bool match_idiom(dword head, dword len, loop_idiom &idiom) {
+    dword row[6];
+    for (dword i = 0; i < len; i++) row[i] = gmem(head + i * 8);
+    dword inc = row[len - 3], test = row[len - 2], jump = row[len - 1];
+    if (t0_5(inc) != 2 || t6_10(inc) != t11_15(inc) || t16_20(inc) != 27 || t0_5(test) != 20 ||
+        t6_10(test) != t6_10(inc) || !constant_imm(test) || t0_5(jump) != 25 || t6_10(jump) != 31 ||
+        (t11_15(jump) != 27 && t11_15(jump) != 31) || t16_31(jump) + 8 != head)
+        return false;
+    idiom = {0, head, len, t6_10(inc), rr_imm(inc, 2), t11_15(test), rr_imm(test, 20), t6_10(row[0]), 27,
+             t21_31(row[0]), t21_31(row[0]), 0, 0};
+    if (idiom.step == 0 || idiom.bound_reg == 31 || t11_15(row[0]) != idiom.index) return false;
+    if (len == 4 && indexed_access(row[0], 29)) {
+        idiom.kind = IDIOM_FILL;
+    } else if (len == 5 && indexed_access(row[0], 29) && t0_5(row[1]) == 2 && t6_10(row[1]) == idiom.value &&
+               t11_15(row[1]) == idiom.value && t16_20(row[1]) == 27) {
+        idiom.kind = IDIOM_FILL;
+        idiom.delta = rr_imm(row[1], 2);
+    } else if (len == 5 && indexed_access(row[0], 28) && indexed_access(row[1], 29) &&
+               t6_10(row[1]) == idiom.value && t11_15(row[1]) == idiom.index) {
+        idiom.kind = IDIOM_COPY;
+        idiom.to = t21_31(row[1]);
+    } else if (len == 5 && indexed_access(row[0], 28) && t0_5(row[1]) == 2 && t6_10(row[1]) == t11_15(row[1]) &&
+               t16_20(row[1]) == idiom.value && t21_23(row[1]) == 0) {
+        idiom.kind = IDIOM_SUM;
+        idiom.other = t6_10(row[1]);
+        idiom.delta = t24_31(row[1]);
+    } else if (len == 6 && indexed_access(row[0], 28) && t0_5(row[1]) == 20 && t6_10(row[1]) == idiom.value &&
+               constant_imm(row[1]) && t11_15(row[1]) != 31 && t0_5(row[2]) == 23 && t6_10(row[2]) == 31 &&
+               (t11_15(row[2]) == 27 || t11_15(row[2]) == 31)) {
+        idiom.kind = IDIOM_FIND;
+        idiom.other = t11_15(row[1]);
+        idiom.delta = rr_imm(row[1], 20);
+        idiom.exit = t16_31(row[2]) + 8;
+    } else return false;
+    bool sums = idiom.kind == IDIOM_SUM;
+    dword key = idiom.kind == IDIOM_FIND ? idiom.other : 27;
+    if (idiom.index == idiom.value || (sums && (idiom.other == idiom.index || idiom.other == idiom.value))) return false;
+    for (dword w : {idiom.index, idiom.value, sums ? idiom.other : idiom.value})
+        if (w == 27 || w == 29 || w == 31 || w == idiom.bound_reg || w == key) return false;
+    return true;
+}
+
+/**
+ * words loop accesses are in guest memory, and for stores don't overwrite loop itself or instructions not
+ * assembled yet
+ * \param[first] - address accessed by first iteration
+ * \param[count] - number of iterations
+ */
+bool idiom_range(const loop_idiom &idiom, dword first, dword count, bool store) {
+    dword span = (count - 1) * idiom.step;
+    if (first > mem_limit - 8 || span > mem_limit - 8 - first) return false;
+    if (lazy_pending != 0 && first < lazy_rows.size() * 8) return false;
+    return !store || first + span + 8 <= idiom.head || first >= idiom.head + idiom.len * 8;
+}
+
+/**
+ * run loop from its head to exit at once, leaving registers, flag, pc and memory as instruction by instruction run
+ * does. Loop isn't run if its index isn't below bound or memory it accesses is out of range
+ * \return number of executed instructions, 0 if loop wasn't run
+ */
+dword run_idiom(const loop_idiom &idiom) {
+    dword x = greg(idiom.index), bound = greg(idiom.bound_reg) + idiom.bound;
+    if (x >= bound) return 0;
+    dword count = (bound - x - 1) / idiom.step + 1, s = idiom.step;
+    if (count > mem_limit || count > (~(dword) 0 - x) / s) return 0;
+    dword src = x + idiom.from, dst = x + idiom.to, branch_ops = idiom.kind == IDIOM_FIND ? 2 : 1, w;
+    bool loads = idiom.kind != IDIOM_FILL, stores = idiom.kind == IDIOM_FILL || idiom.kind == IDIOM_COPY;
+    if ((loads && !idiom_range(idiom, src, count, false)) || (stores && !idiom_range(idiom, dst, count, true)))
+        return 0;
+    if (idiom.kind == IDIOM_FILL) {
+        dword v = greg(idiom.value);
+        for (dword j = 0; j < count; j++) {
+            w = v + j * idiom.delta;
+            memcpy(mem + dst + j * s, &w, 8);
+        }
+        sreg(idiom.value, v + count * idiom.delta);
+    } else if (idiom.kind == IDIOM_COPY) {
+        for (dword j = 0; j < count; j++) memmove(mem + dst + j * s, mem + src + j * s, 8);
+        sreg(idiom.value, load_word(mem + dst + (count - 1) * s));
+    } else if (idiom.kind == IDIOM_SUM) {
+        dword sum = 0;
+        for (dword j = 0; j < count; j++) sum += load_word(mem + src + j * s);
+        sreg(idiom.other, greg(idiom.other) + sum + count * idiom.delta);
+        sreg(idiom.value, load_word(mem + src + (count - 1) * s));
+    } else if (idiom.kind == IDIOM_FIND) {
+        dword key = greg(idiom.other) + idiom.delta;
+        for (dword j = 0; j < count; j++) {
+            if (load_word(mem + src + j * s) != key) continue;
+            sreg(idiom.value, key);
+            sreg(idiom.index, x + j * s);
+            sreg(32, 0);
+            sreg(31, idiom.exit);
+            branches += 2 * j + 1;
+            return j * idiom.len + 3;
+        }
+        sreg(idiom.value, load_word(mem + src + (count - 1) * s));
+    }
+    sreg(idiom.index, x + count * s);
+    sreg(32, x + count * s == bound ? 0 : 2);
+    sreg(31, idiom.head + idiom.len * 8);
+    branches += branch_ops * count;
+    return count * idiom.len;
+}
+
+/**
+ * run rest of loop whose backward branch was just taken to head at once if it is idiom
+ * \return number of executed instructions, 0 if loop wasn't run
+ */
+dword loop_step(dword head) {
+    dword slot = head / 8 % IDIOM_MISSES;
+    if (idiom_miss[slot] == head + 1) return 0;
+    loop_idiom idiom;
+    for (dword len = 4; len <= 6 && head <= mem_limit - len * 8; len++)
+        if (match_idiom(head, len, idiom)) return run_idiom(idiom);
+    idiom_miss[slot] = head + 1;
+    return 0;
+}
+
+/**
+ * execute instructions until machine stops or is preempted
+ */
+void execute() {
+    while (true) {
+        retired++;
+        dword at = greg(31);
+        dword row_com = gmem(at);
+        if (pc_hits != nullptr) profile_step(at, row_com);
+        if (trace_out != nullptr) trace_put(TRACE_PC, at, row_com);
+        dword jumps = branches;
+        dword fused = fuse ? fused_step(row_com) : 0;
+        if (fused == 0) switch_c(row_com);
+        sreg(31, greg(31) + 8);
+        new_block = branches != jumps;
+        if (idioms && new_block && greg(31) <= at) retired += loop_step(greg(31));
+        if (retired >= preempt_at && new_block) preempt();
+    }
+}
+
+/**
+ * run started by -coldstart is about to execute its first instruction, send start_time to parent
+ */
+void report_coldstart() {
+    if (write(coldstart_fd, &start_time, sizeof(start_time)) < 0) perror("coldstart");
+    close(coldstart_fd);
+    coldstart_fd = -1;
+}
+
+/**
+ * main emulating function
+ */
+void emulate() {
+    if (pc_hits != nullptr) atexit(write_profile);
+    if (perf) start_perf();
+    if (!replay_output.empty()) put_output(replay_output.data(), replay_output.size());
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    if (coldstart_fd >= 0) report_coldstart();
+    execute();
+}
+
+/**
+ * read batch jobs list - guest input and output file, optional tenant and expected output file per line
+ */
+vector<job> read_jobs() {
+    vector<job> res;
+    ifstream fin(batch_file);
+    string line;
+    while (getline(fin, line, '\n')) {
+        vector<string> parts = split(line);
+        if (parts.size() >= 2)
+            res.push_back({parts[0], parts[1], parts.size() >= 3 ? parts[2] : "default", parts.size() >= 4 ? parts[3] : ""});
+    }
+    fin.close();
+    return res;
+}
+
+/**
+ * get cpus runner is allowed to use. With no_smt only first hardware thread of each core is taken
+ */
+vector<int> worker_cpus() {
+    vector<int> res;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set)) continue;
+        if (no_smt) {
+            char path[128];
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+            FILE *fp = fopen(path, "r");
+            int first = cpu;
+            if (fp != nullptr) {
+                if (fscanf(fp, "%d", &first) != 1) first = cpu;
+                fclose(fp);
+            }
+            if (first != cpu) continue;
+        }
+        res.push_back(cpu);
+    }
+    if (res.empty()) res.push_back(0);
+    return res;
+}
+
+/**
+ * write job result to shared memory, called on machine exit
+ */
+void report_job() {
+    result->retired = retired;
+    result->branches = branches;
+    memcpy(result->perf_value, perf_value, sizeof(perf_value));
+    if (expected != nullptr && result->mismatch < 0 && out_pos < expected_size) result->mismatch = (long long) out_pos;
+    if (job_store.base != nullptr) {
+        store_entry &e = job_store.index[result - results];
+        uint64_t size = captured.size(), length = size;
+        e.offset = store_reserve(job_store, length);
+        memcpy(job_store.data + e.offset, captured.data(), length);
+        e.length = length;
+        e.truncated = length < size;
+    }
+    result->done = 1;
+}
+
+/**
+ * fault in n bytes of guest memory from begin in chunks, stopping between chunks once job is handed over
+ * \param[writable] - fault pages in writable, otherwise only map them for reading
+ */
+void populate(char *begin, size_t n, bool writable) {
+    const size_t CHUNK = 1 << 21;
+    for (size_t from = 0; from < n && !__atomic_load_n(&prefault_stop, __ATOMIC_RELAXED); from += CHUNK) {
+        size_t len = min(CHUNK, n - from);
+#if defined(MADV_POPULATE_WRITE) && defined(MADV_POPULATE_READ)
+        if (madvise(begin + from, len, writable ? MADV_POPULATE_WRITE : MADV_POPULATE_READ) == 0) continue;
+#endif
+        for (size_t i = from; i < from + len; i += 4096) {
+            if (writable) __atomic_fetch_add(begin + i, 0, __ATOMIC_RELAXED);
+            else (void) __atomic_load_n(begin + i, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * executed on idle priority thread of spare machine: fault in guest memory, so job doesn't wait for page faults.
+ * Pages stay as zero as fork left them. Pages of shared image are only mapped for reading, so they stay shared
+ * until guest writes to them
+ */
+void prefault_memory() {
+    sched_param param = {0};
+    sched_setscheduler(0, SCHED_IDLE, &param);
+    char *begin = (char *) mem;
+    populate(begin, shared_bytes, false);
+    populate(begin + shared_bytes, MEMSIZE - shared_bytes, true);
+}
+
+/**
+ * job was handed over to spare machine: stop prefaulting and wait for prefaulter, so guest is the only
+ * one touching its memory
+ */
+void stop_prefault() {
+    __atomic_store_n(&prefault_stop, true, __ATOMIC_RELAXED);
+    if (prefaulter.joinable()) prefaulter.join();
+}
+
+/**
+ * executed in spare machine: pin to cpu, prefer cpu's numa node for guest memory and start prefaulting it
+ * \param[cpu] - cpu of worker
+ */
+void prepare_machine(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+    unsigned int now_cpu = cpu, node = 0;
+    syscall(SYS_getcpu, &now_cpu, &node, nullptr);
+    unsigned long nodemask = 1UL << node;
+    syscall(SYS_mbind, mem, MEMSIZE, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, MPOL_MF_MOVE);
+    prefaulter = thread(prefault_memory);
+    machine_cpu = (int) now_cpu;
+    machine_node = (int) node;
+}
+
+/**
+ * executed in job process: connect guest input and output and run the machine
+ * \param[id] - number of job to run
+ */
+void run_job(size_t id) {
+    result = results + id;
+    if (slice > 0) preempt_at = slice;
+    result->cpu = machine_cpu;
+    result->node = machine_node;
+    result->mismatch = -1;
+    if (profile != nullptr) profile_path = string(profile) + "." + to_string(id);
+    if (!jobs[id].expected.empty()) {
+        int fd = open(jobs[id].expected.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            perror(jobs[id].expected.c_str());
+            _exit(127);
+        }
+        expected_size = st.st_size;
+        expected = expected_size > 0 ? (const char *) mmap(nullptr, expected_size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+        close(fd);
+        if (expected == MAP_FAILED) {
+            perror(jobs[id].expected.c_str());
+            _exit(127);
+        }
+    }
+    atexit(report_job);
+    if (freopen(jobs[id].in.c_str(), "r", stdin) == nullptr ||
+        (job_store.base == nullptr && freopen(jobs[id].out.c_str(), "w", stdout) == nullptr)) {
+        perror(jobs[id].in.c_str());
+        _exit(127);
+    }
+    emulate();
+}
+
+/**
+ * fork spare machine for worker slot. It prepares itself and waits for job number in pipe
+ * \param[s] - worker slot
+ * \param[cpu] - cpu of worker
+ * \param[feeds] - pipes to spare machines of every slot, pipe of this slot is written here
+ * \return pid of spare machine, 0 if it can't be forked
+ */
+pid_t spawn_machine(int s, int cpu, vector<int> &feeds) {
+    int fd[2];
+    if (pipe(fd) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fd[0]);
+        close(fd[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        for (int f : feeds) if (f >= 0) close(f);
+        close(fd[1]);
+        prepare_machine(cpu);
+        size_t id;
+        if (read(fd[0], &id, sizeof(id)) != sizeof(id)) _exit(0);
+        close(fd[0]);
+        stop_prefault();
+        run_job(id);
+    }
+    close(fd[0]);
+    feeds[s] = fd[1];
+    return pid;
+}
+
+/**
+ * tenant of batch job, tenants without -tenant option get weight 1
+ */
+tenant_queue &tenant_of(const string &name) {
+    for (tenant_queue &t : tenants) if (t.name == name) return t;
+    tenants.push_back({name, 1, 0, {}});
+    return tenants.back();
+}
+
+/**
+ * choose job to run next slice by deficit round robin over tenants
+ * \param[turn] - tenant whose turn it is, moved along rounds
+ * \param[quantum] - instructions tenant of weight 1 gets per round
+ * \param[id] - chosen job
+ * \return false if no job is waiting
+ */
+bool pick_job(size_t &turn, long long quantum, size_t &id) {
+    bool waiting = false;
+    for (tenant_queue &t : tenants) waiting |= !t.queue.empty();
+    if (!waiting) return false;
+    while (true) {
+        tenant_queue &t = tenants[turn];
+        if (!t.queue.empty() && t.deficit > 0) {
+            id = t.queue.front();
+            t.queue.pop_front();
+            t.deficit -= quantum;
+            return true;
+        }
+        if (t.queue.empty()) t.deficit = min(t.deficit, 0LL);
+        else t.deficit += quantum * t.weight;
+        turn = (turn + 1) % tenants.size();
+    }
+}
+
+/**
+ * batch mode - run assembled programm on every job. Every worker slot keeps spare machine ready,
+ * so job starts with a write to pipe, and the next spare is prepared while other jobs run.
+ * Jobs run in slices of instructions, tenants share workers by deficit round robin
+ */
+void run_batch() {
+    jobs = read_jobs();
+    vector<int> cpus = worker_cpus();
+    if (workers <= 0) workers = (int) cpus.size();
+    results = (job_result *) mmap(nullptr, sizeof(job_result) * (jobs.size() + 1), PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (store_file != nullptr && !store_create(job_store, store_file, jobs.size(), store_capacity)) {
+        perror(store_file);
+        exit(1);
+    }
+    vector<size_t> owner(jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++) tenant_of(jobs[i].tenant);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        owner[i] = &tenant_of(jobs[i].tenant) - tenants.data();
+        tenants[owner[i]].queue.push_back(i);
+    }
+    long long quantum = slice > 0 ? (long long) slice : 1000000;
+    vector<int> codes(jobs.size(), -1);
+    vector<pid_t> job_pid(jobs.size(), 0);
+    vector<dword> charged(jobs.size(), 0);
+    vector<int> feeds(workers, -1);
+    vector<pid_t> spares(workers, 0), running(workers, 0);
+    vector<size_t> slot_job(workers, 0);
+    size_t started = 0, finished = 0, turn = 0;
+    fflush(stdout);
+    for (int s = 0; s < workers; s++) spares[s] = spawn_machine(s, cpus[s % cpus.size()], feeds);
+    while (finished < jobs.size()) {
+        for (int s = 0; s < workers; s++) {
+            size_t id;
+            if (running[s] != 0 || !pick_job(turn, quantum, id)) continue;
+            int cpu = cpus[s % cpus.size()];
+            if (job_pid[id] == 0) {
+                if (spares[s] == 0) spares[s] = spawn_machine(s, cpu, feeds);
+                if (spares[s] == 0) {
+                    started++;
+                    finished++;
+                    continue;
+                }
+                if (write(feeds[s], &id, sizeof(id)) != sizeof(id)) perror("write");
+                close(feeds[s]);
+                feeds[s] = -1;
+                job_pid[id] = spares[s];
+                spares[s] = 0;
+                started++;
+            } else {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                sched_setaffinity(job_pid[id], sizeof(set), &set);
+                kill(job_pid[id], SIGCONT);
+            }
+            running[s] = job_pid[id];
+            slot_job[s] = id;
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, WUNTRACED);
+        if (pid < 0) break;
+        for (int s = 0; s < workers; s++) {
+            if (spares[s] == pid) {
+                spares[s] = 0;
+                close(feeds[s]);
+                feeds[s] = -1;
+            }
+            if (running[s] != pid) continue;
+            size_t id = slot_job[s];
+            tenant_queue &t = tenants[owner[id]];
+            t.deficit += quantum - (long long) (results[id].retired - charged[id]);
+            charged[id] = results[id].retired;
+            if (WIFSTOPPED(status)) {
+                t.queue.push_back(id);
+            } else {
+                if (WIFEXITED(status)) codes[id] = WEXITSTATUS(status);
+                finished++;
+            }
+            running[s] = 0;
+            if (spares[s] == 0 && started < jobs.size()) spares[s] = spawn_machine(s, cpus[s % cpus.size()], feeds);
+        }
+    }
+    for (int s = 0; s < workers; s++) {
+        if (spares[s] == 0) continue;
+        close(feeds[s]);
+        waitpid(spares[s], nullptr, 0);
+    }
+    for (size_t i = 0; i < jobs.size() && job_store.base != nullptr; i++) {
+        store_entry &e = job_store.index[i];
+        e.status = results[i].done ? codes[i] : -1;
+        e.retired = results[i].retired;
+        e.branches = results[i].branches;
+        e.mismatch = results[i].mismatch;
+        memcpy(e.counters, results[i].perf_value, sizeof(e.counters));
+    }
+    store_close(job_store);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (!results[i].done) {
+            printf("job %zu: failed\n", i);
+            continue;
+        }
+        printf("job %zu: exit %d, %llu instructions, cpu %d, node %d\n", i, codes[i], results[i].retired,
+               results[i].cpu, results[i].node);
+        if (!jobs[i].expected.empty()) {
+            if (results[i].mismatch < 0) printf("job %zu: output matches\n", i);
+            else printf("job %zu: wrong output at byte %lld\n", i, results[i].mismatch);
+        }
+        if (perf) print_perf(stdout, results[i].perf_value, results[i].retired, results[i].branches);
+    }
+    munmap(results, sizeof(job_result) * (jobs.size() + 1));
+}
+
+/**
+ * create empty temporary file only this process made, so no link planted under a guessed name is followed
+ * \param[kind] - part of file name
+ * \return path of created file
+ */
+string temp_file(const char *kind) {
+    string path = string("/tmp/mipt-") + kind + "-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    return path;
+}
+
+/**
+ * write input of size n for complexity mode from template or generator command
+ * \param[n] - size of input
+ * \param[path] - file to write input to
+ */
+bool make_input(dword n, const string &path) {
+    if (gen_command != nullptr) {
+        string command = string(gen_command) + " " + to_string(n) + " > " + path;
+        return system(command.c_str()) == 0;
+    }
+    ifstream fin(gen_template);
+    string text((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+    fin.close();
+    FILE *fp = fopen(path.c_str(), "w");
+    if (fp == nullptr) return false;
+    dword seed = 12345;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text.compare(i, 3, "{n}") == 0) {
+            fprintf(fp, "%llu", n);
+            i += 2;
+        } else if (text.compare(i, 5, "{seq}") == 0) {
+            for (dword k = 0; k < n; k++) {
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                fprintf(fp, k + 1 < n ? "%llu " : "%llu", (seed >> 33) % 1000000);
+            }
+            i += 4;
+        } else fputc(text[i], fp);
+    }
+    fclose(fp);
+    return true;
+}
+
+/**
+ * complexity mode - run programm on inputs of doubling sizes, fit instructions count with
+ * a * f(n) + b for every candidate f and report the best fit
+ */
+void run_complexity() {
+    const char *name[] = {"1", "log n", "n", "n log n", "n^2", "n^2 log n", "n^3", "2^n"};
+    const int MODELS = 8;
+    vector<double> sizes, counts;
+    string path = temp_file("input");
+    results = (job_result *) mmap(nullptr, sizeof(job_result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        unlink(path.c_str());
+        return;
+    }
+    jobs.push_back({path, "/dev/null", "default", ""});
+    for (dword n = max(ladder_from, 1ULL); n <= ladder_to; n *= 2) {
+        if (!make_input(n, path)) {
+            fprintf(stderr, "can't make input of size %llu\n", n);
+            break;
+        }
+        results->done = 0;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) run_job(0);
+        int status;
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !results->done) {
+            fprintf(stderr, "machine failed on size %llu\n", n);
+            break;
+        }
+        printf("n = %llu: %llu instructions\n", n, results->retired);
+        sizes.push_back(n);
+        counts.push_back(results->retired);
+    }
+    unlink(path.c_str());
+    munmap(results, sizeof(job_result));
+    if (sizes.size() < 3) {
+        printf("need at least 3 sizes to fit complexity\n");
+        return;
+    }
+    double err[MODELS];
+    int best = -1, second = -1;
+    for (int m = 0; m < MODELS; m++) {
+        double sw = 0, sf = 0, sff = 0, st = 0, sft = 0;
+        vector<double> f(sizes.size());
+        for (size_t i = 0; i < sizes.size(); i++) {
+            double n = sizes[i], w = 1 / (counts[i] * counts[i]);
+            double fn[] = {1, log2(n), n, n * log2(n), n * n, n * n * log2(n), n * n * n, pow(2, n)};
+            f[i] = fn[m];
+            sw += w, sf += w * f[i], sff += w * f[i] * f[i], st += w * counts[i], sft += w * f[i] * counts[i];
+        }
+        double det = sw * sff - sf * sf;
+        double a = m == 0 ? 0 : (sw * sft - sf * st) / det, b = (st - a * sf) / sw;
+        err[m] = INFINITY;
+        if (!isfinite(a) || !isfinite(b) || a < 0 || (m > 0 && fabs(det) < 1e-300)) continue;
+        double sum = 0;
+        for (size_t i = 0; i < sizes.size(); i++) sum += pow((counts[i] - a * f[i] - b) / counts[i], 2);
+        err[m] = sqrt(sum / sizes.size());
+        printf("%-10s relative error %.4lf\n", name[m], err[m]);
+        if (best < 0 || err[m] < err[best]) second = best, best = m;
+        else if (second < 0 || err[m] < err[second]) second = m;
+    }
+    if (best < 0) return;
+    double confidence = second < 0 || err[second] == 0 ? 1 : 1 - err[best] / err[second];
+    printf("best fit: O(%s), confidence %.1lf%%\n", name[best], 100 * confidence);
+}
+
+/**
+ * nearest rank percentile of sorted values
+ */
+dword percentile(const vector<dword> &sorted, double p) {
+    size_t rank = (size_t) ceil(p * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * merge profiles of many runs by image and print hotspot report: share of instructions per label
+ * and percentiles of its per run cost
+ * \param[files] - profiles written with -profile
+ */
+void merge_profiles(const vector<string> &files) {
+    map<string, vector<dword>> totals; /// image - instructions of every run
+    map<string, map<string, vector<dword>>> costs; /// image - label - instructions of every run
+    map<string, map<string, dword>> blocks; /// image - label - blocks of all runs
+    for (const string &file : files) {
+        ifstream fin(file);
+        string line, image;
+        dword instructions = 0;
+        map<string, dword> run;
+        while (getline(fin, line, '\n')) {
+            vector<string> parts = split(line);
+            if (parts.size() == 2 && parts[0] == "image") image = parts[1];
+            else if (parts.size() == 2 && parts[0] == "instructions") instructions = strtoull(parts[1].c_str(), nullptr, 10);
+            else if (parts.size() == 4 && parts[0] == "label") {
+                run[parts[1]] += strtoull(parts[2].c_str(), nullptr, 10);
+                blocks[image][parts[1]] += strtoull(parts[3].c_str(), nullptr, 10);
+            }
+        }
+        fin.close();
+        if (image.empty()) {
+            fprintf(stderr, "%s: not a profile\n", file.c_str());
+            continue;
+        }
+        size_t runs = totals[image].size();
+        for (auto &l : run) costs[image][l.first].resize(runs, 0);
+        for (auto &l : costs[image]) l.second.push_back(run.count(l.first) ? run[l.first] : 0);
+        totals[image].push_back(instructions);
+    }
+    for (auto &img : totals) {
+        vector<dword> sorted = img.second;
+        sort(sorted.begin(), sorted.end());
+        dword sum = 0;
+        for (dword x : sorted) sum += x;
+        printf("image %s: %zu runs, %llu instructions, per run p50 %llu p90 %llu p99 %llu max %llu\n",
+               img.first.c_str(), sorted.size(), sum, percentile(sorted, 0.5), percentile(sorted, 0.9),
+               percentile(sorted, 0.99), sorted.back());
+        vector<pair<dword, string>> hot;
+        for (auto &l : costs[img.first]) {
+            dword total = 0;
+            for (dword x : l.second) total += x;
+            hot.push_back({total, l.first});
+        }
+        sort(hot.rbegin(), hot.rend());
+        printf("  %-20s %7s %14s %12s %10s %10s %10s %10s\n", "label", "share", "instructions", "blocks", "p50", "p90",
+               "p99", "max");
+        for (auto &h : hot) {
+            vector<dword> run = costs[img.first][h.second];
+            sort(run.begin(), run.end());
+            printf("  %-20s %6.2lf%% %14llu %12llu %10llu %10llu %10llu %10llu\n", h.second.c_str(),
+                   sum > 0 ? 100.0 * h.first / sum : 0.0, h.first, blocks[img.first][h.second], percentile(run, 0.5),
+                   percentile(run, 0.9), percentile(run, 0.99), run.back());
+        }
+    }
+}
+
+/**
+ * counters of one run in A/B comparison, read back from its profile
+ */
+struct ab_run {
+    dword value[4] = {0, 0, 0, 0}; /// instructions, syscalls, touched pages, modelled cycles
+    map<string, dword> labels; /// instructions per label
+    string output; /// guest output
+    bool ok = false; /// run finished and wrote profile
+};
+
+/**
+ * run one version of programm on input in forked machine with profile enabled
+ * \param[source] - asm file of version
+ * \param[in] - guest input
+ */
+ab_run run_version(const char *source, const string &in) {
+    ab_run res;
+    string out = temp_file("ab-out"), prof = temp_file("ab-prof");
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        unlink(prof.c_str());
+        unlink(out.c_str());
+        return res;
+    }
+    if (pid == 0) {
+        source_file = source;
+        file_input();
+        source_hash = image_hash();
+        assemble();
+        profile = prof.c_str();
+        start_profile();
+        if (freopen(in.c_str(), "r", stdin) == nullptr || freopen(out.c_str(), "w", stdout) == nullptr) {
+            perror(in.c_str());
+            _exit(127);
+        }
+        emulate();
+    }
+    waitpid(pid, nullptr, 0);
+    ifstream fin(prof);
+    string line;
+    const char *name[4] = {"instructions", "syscalls", "touched", "cycles"};
+    while (getline(fin, line, '\n')) {
+        vector<string> parts = split(line);
+        for (int k = 0; k < 4; k++)
+            if (parts.size() == 2 && parts[0] == name[k]) res.value[k] = strtoull(parts[1].c_str(), nullptr, 10);
+        if (parts.size() == 2 && parts[0] == "instructions") res.ok = true;
+        if (parts.size() == 4 && parts[0] == "label") res.labels[parts[1]] = strtoull(parts[2].c_str(), nullptr, 10);
+    }
+    fin.close();
+    ifstream fout(out);
+    res.output = string((istreambuf_iterator<char>(fout)), istreambuf_iterator<char>());
+    fout.close();
+    unlink(prof.c_str());
+    unlink(out.c_str());
+    return res;
+}
+
+/**
+ * A/B mode - run versions A (source_file) and B (ab_source) on every recorded input and report differences
+ * of instructions, syscalls, touched memory and modelled cycles per input, in total with statistics of per
+ * input ratios, and per label. Counts are deterministic, so one run per input is enough
+ */
+void run_ab() {
+    const char *metric[4] = {"instructions", "syscalls", "touched kB", "cycles"};
+    const dword scale[4] = {1, 1, 4, 1};
+    dword total[2][4] = {{0}};
+    vector<double> ratios[4];
+    size_t better[4] = {0}, worse[4] = {0};
+    map<string, dword> labels[2];
+    for (const string &in : ab_inputs) {
+        ab_run a = run_version(source_file, in), b = run_version(ab_source, in);
+        if (!a.ok) printf("%s: version A failed\n", in.c_str());
+        if (!b.ok) printf("%s: version B failed\n", in.c_str());
+        if (!a.ok || !b.ok) continue;
+        printf("%s:%s\n", in.c_str(), a.output == b.output ? "" : " outputs differ");
+        for (int k = 0; k < 4; k++) {
+            dword x = a.value[k] * scale[k], y = b.value[k] * scale[k];
+            printf("  %-14s %14llu %14llu %+9.2lf%%\n", metric[k], x, y, x > 0 ? 100.0 * ((double) y - x) / x : 0.0);
+            total[0][k] += x, total[1][k] += y;
+            if (x > 0 && y > 0) ratios[k].push_back((double) y / x);
+            better[k] += y < x, worse[k] += y > x;
+        }
+        for (auto &l : a.labels) labels[0][l.first] += l.second;
+        for (auto &l : b.labels) labels[1][l.first] += l.second;
+    }
+    printf("total over %zu inputs:\n", ab_inputs.size());
+    printf("  %-14s %14s %14s %10s %10s %10s %10s %7s\n", "", "A", "B", "change", "geomean", "min", "max",
+           "B<A/B>A");
+    for (int k = 0; k < 4; k++) {
+        double log_sum = 0, low = INFINITY, high = 0;
+        for (double r : ratios[k]) log_sum += log(r), low = min(low, r), high = max(high, r);
+        double mean = ratios[k].empty() ? 1 : exp(log_sum / ratios[k].size());
+        if (ratios[k].empty()) low = high = 1;
+        printf("  %-14s %14llu %14llu %+9.2lf%% %10.4lf %10.4lf %10.4lf %3zu/%-3zu\n", metric[k], total[0][k],
+               total[1][k], total[0][k] > 0 ? 100.0 * ((double) total[1][k] - total[0][k]) / total[0][k] : 0.0,
+               mean, low, high, better[k], worse[k]);
+    }
+    vector<pair<dword, string>> order;
+    for (int v = 0; v < 2; v++)
+        for (auto &l : labels[v])
+            if (v == 0 || !labels[0].count(l.first)) {
+                dword x = labels[0][l.first], y = labels[1][l.first];
+                order.push_back({x > y ? x - y : y - x, l.first});
+            }
+    sort(order.rbegin(), order.rend());
+    printf("per label instructions:\n  %-20s %14s %14s %10s\n", "label", "A", "B", "change");
+    for (auto &o : order) {
+        dword x = labels[0][o.second], y = labels[1][o.second];
+        if (x == 0 && y == 0) continue;
+        printf("  %-20s %14llu %14llu ", o.second.c_str(), x, y);
+        if (x > 0) printf("%+9.2lf%%\n", 100.0 * ((double) y - x) / x);
+        else printf("%10s\n", "new");
+    }
+}
+
+/**
+ * handler call of instruction in generated fused sequence, operands are decoded from row
+ * \param[type] - type of instruction
+ */
+string fused_call(int type) {
+    const char *HANDLER[30] = {"halt", "svc", "add", "sub", "mul", "div", "mod", "And", "Or", "Xor", "nand", "shl", "shr",
+                               "addd", "subd", "muld", "divd", "itod", "dtoi", "bl", "cmp", "cmpd", "cne", "ceq", "cle",
+                               "clt", "cge", "cgt", "ld", "st"};
+    if (TYPE[type] == TYPE_RM) return string(HANDLER[type]) + "(t6_10(row), t11_15(row), rm_imm(row))";
+    return string(HANDLER[type]) + "(t6_10(row), t11_15(row), rr_imm(row, " + to_string(type) + "))";
+}
+
+/**
+ * generate fused.inc from profiles: fused_step() executes the n sequences which save most dispatches in one step.
+ * Every following instruction is fetched, checked and counted right before it executes, so fused sequence gives
+ * the same result as executing its instructions one by one
+ * \param[n] - number of sequences
+ * \param[file] - generated file
+ * \param[files] - profiles
+ */
+void write_fused(size_t n, const char *file, const vector<string> &files) {
+    map<vector<int>, dword> counts;
+    for (const string &f : files) {
+        ifstream fin(f);
+        string line;
+        while (getline(fin, line, '\n')) {
+            vector<string> parts = split(line);
+            if (parts.size() != 3 || parts[0] != "seq") continue;
+            vector<int> seq;
+            for (const char *c = parts[1].c_str(); *c != 0; c += *c == '+') seq.push_back(strtol(c, (char **) &c, 10));
+            counts[seq] += strtoull(parts[2].c_str(), nullptr, 10);
+        }
+        fin.close();
+    }
+    vector<pair<dword, vector<int>>> top;
+    for (auto &c : counts) top.push_back({c.second * (c.first.size() - 1), c.first});
+    sort(top.begin(), top.end(), [](const pair<dword, vector<int>> &a, const pair<dword, vector<int>> &b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+    if (top.size() > n) top.resize(n);
+    sort(top.begin(), top.end(), [](const pair<dword, vector<int>> &a, const pair<dword, vector<int>> &b) {
+        if (a.second[0] != b.second[0]) return a.second[0] < b.second[0];
+        if (a.second.size() != b.second.size()) return a.second.size() > b.second.size();
+        return a.first > b.first;
+    });
+    FILE *fp = fopen(file, "w");
+    if (fp == nullptr) {
+        perror(file);
+        exit(1);
+    }
+    fprintf(fp, "// generated by mipt64 -fuse from %zu profiles, do not edit\n\n", files.size());
+    fprintf(fp, "/**\n * execute instruction at pc together with following ones if they form frequent sequence\n");
+    fprintf(fp, " * \\param[row] - instruction at pc\n");
+    fprintf(fp, " * \\return number of executed instructions, 0 if no sequence starts at pc\n */\n");
+    fprintf(fp, "dword fused_step(dword row) {\n");
+    if (!top.empty()) {
+        fprintf(fp, "    dword pc = greg(31);\n    switch (t0_5(row)) {\n");
+        for (size_t i = 0; i < top.size(); i++) {
+            const vector<int> &seq = top[i].second;
+            if (i == 0 || seq[0] != top[i - 1].second[0]) fprintf(fp, "        case %d:\n", seq[0]);
+            fprintf(fp, "            // %llu dispatches saved\n", top[i].first);
+            fprintf(fp, "            if (t6_10(row) != 31 && pc + %zu <= mem_limit - 8", (seq.size() - 1) * 8);
+            for (size_t k = 1; k < seq.size(); k++) fprintf(fp, " && fuse_match(gmem(pc + %zu), %d)", k * 8, seq[k]);
+            fprintf(fp, ") {\n                %s;\n", fused_call(seq[0]).c_str());
+            for (size_t k = 1; k < seq.size(); k++) {
+                string at = k == 1 ? "pc" : "pc + " + to_string((k - 1) * 8);
+                fprintf(fp, "                row = gmem(pc + %zu);\n", k * 8);
+                fprintf(fp, "                if (greg(31) != %s || !fuse_match(row, %d)) return %zu;\n", at.c_str(), seq[k], k);
+                fprintf(fp, "                sreg(31, pc + %zu);\n                retired++;\n", k * 8);
+                fprintf(fp, "                %s;\n", fused_call(seq[k]).c_str());
+            }
+            fprintf(fp, "                return %zu;\n            }\n", seq.size());
+            if (i + 1 == top.size() || top[i + 1].second[0] != seq[0]) fprintf(fp, "            break;\n");
+        }
+        fprintf(fp, "    }\n");
+    } else fprintf(fp, "    (void) row;\n");
+    fprintf(fp, "    return 0;\n}\n");
+    fclose(fp);
+    fprintf(stderr, "%s: %zu sequences\n", file, top.size());
+}
+
+/**
+ * print entry and output of batch job from result store
+ * \param[file] - result store
+ * \param[id] - number of job
+ */
+void lookup_result(const char *file, dword id) {
+    result_store st;
+    if (!store_open(st, file)) {
+        fprintf(stderr, "%s: not a result store\n", file);
+        exit(1);
+    }
+    const char *output;
+    const store_entry *e = store_get(st, id, &output);
+    if (e == nullptr) {
+        fprintf(stderr, "no valid entry of job %llu in %s\n", id, file);
+        exit(1);
+    }
+    fprintf(stderr, "job %llu: exit %d, %llu instructions, %llu bytes of output%s\n", id, e->status,
+            (dword) e->retired, (dword) e->length, e->truncated ? " (truncated)" : "");
+    if (e->mismatch >= 0) fprintf(stderr, "job %llu: wrong output at byte %lld\n", id, (long long) e->mismatch);
+    fwrite(output, 1, e->length, stdout);
+    store_close(st);
+}
+
+/**
+ * start recording execution trace to trace_file. Fused sequences, loop idioms and clones are turned off, so every
+ * instruction gets its own records
+ */
+void start_trace() {
+    trace_out = fopen(trace_file, "wb");
+    if (trace_out == nullptr) {
+        perror(trace_file);
+        exit(1);
+    }
+    trace_put(TRACE_MAGIC, MEMSIZE, 33);
+    trace_buf[0].step = 0;
+    fuse = false;
+    idioms = false;
+    fork_width = 0;
+    atexit(flush_trace);
+}
+
+/**
+ * header of trace index: start of every key's entries, then entries of all keys ordered by key and step
+ */
+struct trace_index_header {
+    dword magic; /// TRACE_MAGIC
+    dword kind; /// TRACE_PC - executions by pc, TRACE_REG - writes by register, TRACE_MEM - writes by address
+    dword keys; /// number of keys
+    dword entries; /// number of entries
+};
+
+/**
+ * entry of trace index
+ */
+struct trace_entry {
+    dword step; /// instruction which made record
+    dword value; /// executed instruction or written value
+};
+
+const char *TRACE_INDEX[3] = {".pc", ".reg", ".mem"}; /// suffixes of index files of kinds
+
+/**
+ * build per pc execution lists, per register and per address write lists of trace in files trace.pc, trace.reg
+ * and trace.mem. Entries are placed by counting sort in two sequential passes over the mapped trace, so lists
+ * come out ordered by step and memory used doesn't depend on trace size
+ * \param[path] - trace recorded with -trace
+ */
+void index_trace(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(trace_record)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        exit(1);
+    }
+    auto *rec = (const trace_record *) mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    dword n = st.st_size / sizeof(trace_record);
+    if (rec == MAP_FAILED || rec[0].kind != TRACE_MAGIC) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        exit(1);
+    }
+    madvise((void *) rec, st.st_size, MADV_SEQUENTIAL);
+    dword keys[3] = {rec[0].where, rec[0].value, rec[0].where};
+    vector<dword> start[3];
+    for (int k = 0; k < 3; k++) start[k].assign(keys[k] + 1, 0);
+    for (dword i = 1; i < n; i++) {
+        dword k = rec[i].kind - TRACE_PC;
+        if (k < 3 && rec[i].where < keys[k]) start[k][rec[i].where + 1]++;
+    }
+    trace_entry *entry[3];
+    for (int k = 0; k < 3; k++) {
+        for (dword key = 0; key < keys[k]; key++) start[k][key + 1] += start[k][key];
+        string name = string(path) + TRACE_INDEX[k];
+        size_t table = sizeof(trace_index_header) + (keys[k] + 1) * sizeof(dword);
+        size_t size = table + start[k][keys[k]] * sizeof(trace_entry);
+        int out = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        char *base = out < 0 || ftruncate(out, size) != 0 ? (char *) MAP_FAILED :
+                     (char *) mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+        if (base == MAP_FAILED) {
+            perror(name.c_str());
+            exit(1);
+        }
+        close(out);
+        *(trace_index_header *) base = {TRACE_MAGIC, (dword) k + TRACE_PC, keys[k], start[k][keys[k]]};
+        memcpy(base + sizeof(trace_index_header), start[k].data(), (keys[k] + 1) * sizeof(dword));
+        entry[k] = (trace_entry *) (base + table);
+    }
+    for (dword i = 1; i < n; i++) {
+        dword k = rec[i].kind - TRACE_PC;
+        if (k < 3 && rec[i].where < keys[k]) entry[k][start[k][rec[i].where]++] = {rec[i].step, rec[i].value};
+    }
+    fprintf(stderr, "%s: %llu records, %llu executions, %llu register writes, %llu memory writes\n", path, n - 1,
+            start[0][keys[0] - 1], start[1][keys[1] - 1], start[2][keys[2] - 1]);
+    munmap((void *) rec, st.st_size);
+}
+
+/**
+ * mapped trace index
+ */
+struct trace_index {
+    const trace_index_header *head;
+    const dword *start; /// first entry of every key, keys + 1 values
+    const trace_entry *entry;
+};
+
+/**
+ * map index file of kind built by index_trace()
+ */
+trace_index open_index(const char *path, int kind) {
+    string name = string(path) + TRACE_INDEX[kind - TRACE_PC];
+    int fd = open(name.c_str(), O_RDONLY);
+    struct stat st;
+    const char *base = (const char *) MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(trace_index_header))
+        base = (const char *) mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd >= 0) close(fd);
+    if (base == MAP_FAILED || ((const trace_index_header *) base)->magic != TRACE_MAGIC) {
+        fprintf(stderr, "%s: no index, build it with -index-trace %s\n", name.c_str(), path);
+        exit(1);
+    }
+    trace_index res;
+    res.head = (const trace_index_header *) base;
+    res.start = (const dword *) (base + sizeof(trace_index_header));
+    res.entry = (const trace_entry *) (res.start + res.head->keys + 1);
+    return res;
+}
+
+/**
+ * answer question about indexed trace, printing one "step value" line per found entry:
+ *  write <address> <step> - last write to address before step. Writes of words covering address count in mipt64
+ *  pc <pc> - all executions of instruction at pc
+ *  reg <register> - value history of register
+ * \param[path] - trace indexed with -index-trace
+ */
+void query_trace(const char *path, const char *what, const vector<string> &args) {
+    dword key = args.empty() ? 0 : strtoull(args[0].c_str(), nullptr, 10);
+    if (strcmp(what, "write") == 0 && args.size() >= 2) {
+        trace_index ix = open_index(path, TRACE_MEM);
+        dword before = strtoull(args[1].c_str(), nullptr, 10), best = 0, value = 0;
+        if (key >= ix.head->keys) {
+            fprintf(stderr, "address %llu is outside traced memory\n", key);
+            exit(1);
+        }
+        for (dword a = key >= 8 - 1 ? key - (8 - 1) : 0; a <= key; a++) {
+            const trace_entry *first = ix.entry + ix.start[a], *last = ix.entry + ix.start[a + 1];
+            const trace_entry *e = lower_bound(first, last, before, [](const trace_entry &x, dword step) {
+                return x.step < step;
+            });
+            if (e != first && (e - 1)->step > best) {
+                best = (e - 1)->step;
+                value = (e - 1)->value;
+            }
+        }
+        if (best == 0) fprintf(stderr, "no write to %llu before step %llu\n", key, before);
+        else printf("%llu %llu\n", best, value);
+    } else if ((strcmp(what, "pc") == 0 || strcmp(what, "reg") == 0) && args.size() >= 1) {
+        trace_index ix = open_index(path, what[0] == 'p' ? TRACE_PC : TRACE_REG);
+        if (key >= ix.head->keys) {
+            fprintf(stderr, "%s %llu is outside trace, keys are below %llu\n", what, key, ix.head->keys);
+            exit(1);
+        }
+        for (dword i = ix.start[key]; i < ix.start[key + 1]; i++)
+            printf("%llu %llu\n", ix.entry[i].step, ix.entry[i].value);
+    } else {
+        fprintf(stderr, "query is one of: write <address> <step>, pc <pc>, reg <register>\n");
+        exit(1);
+    }
+}
+
+/**
+ * packed mode - assemble small programms into disjoint windows of one arena and run them by turns,
+ * switching on time slices at block boundaries. Every programm sees its window as whole memory
+ */
+void run_pack() {
+    vector<program> progs;
+    ifstream fin(pack_file);
+    string line;
+    while (getline(fin, line, '\n')) {
+        vector<string> parts = split(line);
+        if (parts.size() < 3) continue;
+        program p;
+        p.source = parts[0];
+        p.in = parts[1];
+        p.out = parts[2];
+        progs.push_back(p);
+    }
+    fin.close();
+    window = window / 8 * 8;
+    if (window < 64 || progs.size() * window > MEMSIZE) {
+        fprintf(stderr, "%zu programms of %llu bytes don't fit in memory\n", progs.size(), window);
+        exit(1);
+    }
+    packing = true;
+    mem_limit = window;
+    for (size_t k = 0; k < progs.size(); k++) {
+        program &p = progs[k];
+        p.base = k * window;
+        mem = arena + p.base;
+        memset(regs, 0, sizeof(regs));
+        source_file = p.source.c_str();
+        input.clear();
+        label.clear();
+        try {
+            file_input();
+            assemble();
+        } catch (const pack_switch &e) {
+            p.done = true;
+            p.code = stop_code;
+            continue;
+        }
+        memcpy(p.regs, regs, sizeof(regs));
+        p.fin = fopen(p.in.c_str(), "r");
+        p.fout = fopen(p.out.c_str(), "w");
+        if (p.fin == nullptr || p.fout == nullptr) {
+            perror(p.fin == nullptr ? p.in.c_str() : p.out.c_str());
+            exit(1);
+        }
+    }
+    dword quantum = slice > 0 ? slice : 10000;
+    size_t live = 0;
+    for (const program &p : progs) live += !p.done;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    while (live > 0) {
+        for (size_t k = 0; k < progs.size(); k++) {
+            program &p = progs[k];
+            if (p.done) continue;
+            mem = arena + p.base;
+            memcpy(regs, p.regs, sizeof(regs));
+            guest_in = p.fin;
+            guest_out = p.fout;
+            dword start = retired;
+            preempt_at = retired + quantum;
+            maps.swap(p.maps);
+            bool stopped = false;
+            try {
+                execute();
+            } catch (const pack_switch &e) {
+                stopped = e.stopped;
+            }
+            maps.swap(p.maps);
+            memcpy(p.regs, regs, sizeof(regs));
+            p.retired += retired - start;
+            if (stopped) {
+                p.done = true;
+                p.code = stop_code;
+                p.maps.clear();
+                fclose(p.fin);
+                fclose(p.fout);
+                live--;
+            }
+        }
+    }
+    for (size_t k = 0; k < progs.size(); k++)
+        printf("programm %zu (%s): exit %d, %llu instructions\n", k, progs[k].source.c_str(), progs[k].code,
+               progs[k].retired);
+}
+
+/**
+ * milliseconds from one moment to another
+ * \param[from] - earlier moment
+ * \param[to] - later moment
+ */
+double elapsed_ms(const timespec &from, const timespec &to) {
+    return (to.tv_sec - from.tv_sec) * 1e3 + (to.tv_nsec - from.tv_nsec) / 1e6;
+}
+
+/**
+ * copy standard input of emulator to memfd, so every run of the programm gets all of it
+ * \return descriptor of input to give runs, /dev/null if emulator reads terminal
+ */
+int copy_input() {
+    int input = isatty(0) ? open("/dev/null", O_RDONLY) : memfd_create("coldstart-input", 0);
+    if (!isatty(0)) {
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(0, buf, sizeof(buf))) > 0)
+            if (write(input, buf, n) != n) break;
+    }
+    return input;
+}
+
+/**
+ * exec emulator as fresh process on whole input, guest output goes to /dev/null. Child takes its clock right
+ * before execve and the exec'd emulator reports moment it is about to execute first guest instruction through
+ * pipe MIPT_COLDSTART names
+ * \param[args] - arguments of exec'd emulator, null terminated
+ * \param[input] - standard input of run, read from start
+ * \param[first] - milliseconds from execve to first instruction are written here
+ * \param[total] - milliseconds from execve to exit are written here
+ * \return false if run ended before first instruction
+ */
+bool timed_run(vector<char *> &args, int input, double &first, double &total) {
+    lseek(input, 0, SEEK_SET);
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    timespec moments[2], end;
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(input, 0);
+        dup2(open("/dev/null", O_WRONLY), 1);
+        setenv("MIPT_COLDSTART", to_string(fds[1]).c_str(), 1);
+        clock_gettime(CLOCK_MONOTONIC, moments);
+        if (write(fds[1], moments, sizeof(timespec)) < 0) _exit(127);
+        execv("/proc/self/exe", args.data());
+        _exit(127);
+    }
+    close(fds[1]);
+    size_t got = 0;
+    ssize_t n;
+    while (got < sizeof(moments) && (n = read(fds[0], (char *) moments + got, sizeof(moments) - got)) > 0) got += n;
+    close(fds[0]);
+    waitpid(pid, nullptr, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (got < sizeof(moments)) return false;
+    first = elapsed_ms(moments[0], moments[1]);
+    total = elapsed_ms(moments[0], end);
+    return true;
+}
+
+/**
+ * exec emulator with the same arguments except -coldstart as fresh process coldstart_runs times. Every run gets
+ * the whole standard input of this process
+ * \param[argc] - number of arguments
+ * \param[argv] - arguments of emulator
+ */
+void run_coldstart(int argc, char **argv) {
+    vector<char *> args;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-coldstart") == 0 && i + 1 < argc) i++;
+        else args.push_back(argv[i]);
+    }
+    args.push_back(nullptr);
+    int input = copy_input();
+    vector<double> first, total;
+    for (int run = 0; run < coldstart_runs; run++) {
+        double to_first, to_exit;
+        if (!timed_run(args, input, to_first, to_exit)) {
+            fprintf(stderr, "run %d ended before first instruction\n", run);
+            continue;
+        }
+        first.push_back(to_first);
+        total.push_back(to_exit);
+    }
+    close(input);
+    if (first.empty()) return;
+    sort(first.begin(), first.end());
+    sort(total.begin(), total.end());
+    printf("cold start over %zu runs, ms:\n", first.size());
+    printf("  %-28s %10s %10s %10s\n", "", "median", "min", "max");
+    printf("  %-28s %10.3lf %10.3lf %10.3lf\n", "exec to first instruction", first[first.size() / 2], first[0], first.back());
+    printf("  %-28s %10.3lf %10.3lf %10.3lf\n", "exec to exit", total[total.size() / 2], total[0], total.back());
+    bool met = first[first.size() / 2] < 1;
+    printf("target 1 ms to first instruction: %s\n", met ? "met" : "missed");
+    if (!met && getauxval(AT_BASE) != 0) printf("emulator is linked dynamically, the target needs -static build\n");
+}
+
+/**
+ * exec emulator with the same arguments except -hugebench hugebench_runs times with guest memory on regular pages
+ * (-nohuge) and as many times on huge pages, alternating them, and compare time from first instruction to exit
+ * \param[argc] - number of arguments
+ * \param[argv] - arguments of emulator
+ */
+void run_hugebench(int argc, char **argv) {
+    vector<char *> huge, regular;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-hugebench") == 0 && i + 1 < argc) i++;
+        else if (strcmp(argv[i], "-nohuge") != 0) huge.push_back(argv[i]);
+    }
+    regular = huge;
+    regular.push_back((char *) "-nohuge");
+    huge.push_back(nullptr);
+    regular.push_back(nullptr);
+    int input = copy_input();
+    vector<double> times[2];
+    for (int run = 0; run < hugebench_runs; run++) {
+        for (int side = 0; side < 2; side++) {
+            double first, total;
+            if (timed_run(side == 0 ? regular : huge, input, first, total)) times[side].push_back(total - first);
+            else fprintf(stderr, "run %d ended before first instruction\n", run);
+        }
+    }
+    close(input);
+    if (times[0].empty() || times[1].empty()) return;
+    const char *name[2] = {"regular pages", page_mode == 2 ? "hugetlbfs pages" : "transparent huge pages"};
+    printf("guest memory pages over %d runs, ms from first instruction to exit:\n", hugebench_runs);
+    printf("  %-28s %10s %10s %10s\n", "", "median", "min", "max");
+    for (int side = 0; side < 2; side++) {
+        sort(times[side].begin(), times[side].end());
+        printf("  %-28s %10.3lf %10.3lf %10.3lf\n", name[side], times[side][times[side].size() / 2], times[side][0],
+               times[side].back());
+    }
+    double base = times[0][times[0].size() / 2], now = times[1][times[1].size() / 2];
+    printf("huge pages: %+.2lf%% time, %.3lfx speed\n", (now - base) / base * 100, now > 0 ? base / now : 0);
+}
+
+/**
+ * parse command line options:
+ *  -stats - print execution statistics to stderr on exit
+ *  -hugetlb - back guest memory with hugetlbfs pages, falls back to transparent huge pages
+ *  -nohuge - back guest memory with regular pages only
+ *  -batch <file> - run programm on every "input output [tenant [expected]]" line of file, one machine per job
+ *  -j <n> - number of batch jobs executed at once, one per allowed cpu by default
+ *  -nosmt - place batch workers on one hardware thread per core
+ *  -pack <file> - run every "source input output" programm of file in its own window of one memory
+ *  -window <bytes> - memory window of packed programm, 65536 by default
+ *  -results <file> - write batch outputs and statuses to one mapped, indexed result store instead of output files
+ *  -results-size <mb> - megabytes preallocated for outputs in result store, 64 by default
+ *  -lookup <file> <job> - print status and output of job from result store
+ *  -trace <file> - record every executed instruction, register and memory write of run to file
+ *  -index-trace <file> - build per pc, register and address lists of trace for -query
+ *  -query <file> <question> - answer "write <address> <step>", "pc <pc>" or "reg <register>" from indexed trace
+ *  -profile <file> - write per label instructions and blocks of run to file, file.job for batch jobs
+ *  -merge <files> - aggregate profiles by image into hotspot report
+ *  -ab <source> <inputs> - compare counters of programm with its version from source on recorded inputs
+ *  -fuse <n> <file> <profiles> - generate fused.inc executing n most frequent instruction sequences of profiles at once
+ *  -nofuse - execute fused sequences instruction by instruction
+ *  -noidioms - execute fill, copy, sum and find loops instruction by instruction
+ *  -gen <command> - estimate complexity on inputs printed by "command n"
+ *  -template <file> - estimate complexity on inputs made from file, {n} is size and {seq} n numbers
+ *  -ladder <from> <to> - sizes complexity is estimated on, doubled from first to last
+ *  -slice <n> - preempt batch jobs at first block boundary after n instructions
+ *  -tenant <name:weight> - share of workers batch jobs of tenant get, 1 by default
+ *  -share <dir> - map image published in registry dir by other process, or assemble and publish it there
+ *  -lazy - assemble instructions when they are first executed or accessed
+ *  -snapshots <dir> - start from snapshot taken at first input by earlier run of the same programm
+ *  -idle <ms> - compress guest memory of machine waiting for input longer than ms
+ *  -mm-threads <n> - host threads of matrix multiply syscall, 1 by default
+ *  -forks <n> - most guest clones running at once, number of allowed cpus by default, 0 - no clones
+ *  -perf - count host cycles, instructions, branch and cache misses of each run or batch job
+ *  -coldstart <n> - start the run n times as fresh process, print time from exec to first instruction and to exit
+ *  -hugebench <n> - run n times on regular and n times on huge pages, print time of execution on both
+ */
+void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-stats") == 0) stats = true;
+        else if (strcmp(argv[i], "-hugetlb") == 0) page_mode = 2;
+        else if (strcmp(argv[i], "-nohuge") == 0) page_mode = 0;
+        else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc) batch_file = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-nosmt") == 0) no_smt = true;
+        else if (strcmp(argv[i], "-pack") == 0 && i + 1 < argc) pack_file = argv[++i];
+        else if (strcmp(argv[i], "-window") == 0 && i + 1 < argc) window = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "-results") == 0 && i + 1 < argc) store_file = argv[++i];
+        else if (strcmp(argv[i], "-results-size") == 0 && i + 1 < argc) store_capacity = strtoull(argv[++i], nullptr, 10) << 20;
+        else if (strcmp(argv[i], "-lookup") == 0 && i + 2 < argc) {
+            lookup_result(argv[i + 1], strtoull(argv[i + 2], nullptr, 10));
+            exit(0);
+        }
+        else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) trace_file = argv[++i];
+        else if (strcmp(argv[i], "-index-trace") == 0 && i + 1 < argc) {
+            index_trace(argv[i + 1]);
+            exit(0);
+        }
+        else if (strcmp(argv[i], "-query") == 0 && i + 2 < argc) {
+            query_trace(argv[i + 1], argv[i + 2], vector<string>(argv + i + 3, argv + argc));
+            exit(0);
+        }
+        else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc) profile = argv[++i];
+        else if (strcmp(argv[i], "-fuse") == 0 && i + 2 < argc) {
+            write_fused(strtoul(argv[i + 1], nullptr, 10), argv[i + 2], vector<string>(argv + i + 3, argv + argc));
+            exit(0);
+        }
+        else if (strcmp(argv[i], "-nofuse") == 0) fuse = false;
+        else if (strcmp(argv[i], "-noidioms") == 0) idioms = false;
+        else if (strcmp(argv[i], "-ab") == 0 && i + 1 < argc) {
+            ab_source = argv[i + 1];
+            ab_inputs = vector<string>(argv + i + 2, argv + argc);
+            break;
+        }
+        else if (strcmp(argv[i], "-merge") == 0) {
+            merge_profiles(vector<string>(argv + i + 1, argv + argc));
+            exit(0);
+        }
+        else if (strcmp(argv[i], "-gen") == 0 && i + 1 < argc) gen_command = argv[++i];
+        else if (strcmp(argv[i], "-template") == 0 && i + 1 < argc) gen_template = argv[++i];
+        else if (strcmp(argv[i], "-ladder") == 0 && i + 2 < argc) {
+            ladder_from = strtoull(argv[++i], nullptr, 10);
+            ladder_to = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "-slice") == 0 && i + 1 < argc) slice = strtoull(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "-tenant") == 0 && i + 1 < argc) {
+            string spec = argv[++i];
+            size_t colon = spec.find(':');
+            tenant_of(spec.substr(0, colon)).weight = colon == string::npos ? 1 : max(1LL, atoll(spec.c_str() + colon + 1));
+        }
+        else if (strcmp(argv[i], "-share") == 0 && i + 1 < argc) share_dir = argv[++i];
+        else if (strcmp(argv[i], "-lazy") == 0) lazy = true;
+        else if (strcmp(argv[i], "-snapshots") == 0 && i + 1 < argc) snapshot_dir = argv[++i];
+        else if (strcmp(argv[i], "-idle") == 0 && i + 1 < argc) idle_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-mm-threads") == 0 && i + 1 < argc) matmul_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-forks") == 0 && i + 1 < argc) fork_width = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-perf") == 0) perf = true;
+        else if (strcmp(argv[i], "-coldstart") == 0 && i + 1 < argc) coldstart_runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-hugebench") == 0 && i + 1 < argc) hugebench_runs = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    if (coldstart_runs > 0) {
+        run_coldstart(argc, argv);
+        return 0;
+    }
+    if (hugebench_runs > 0) {
+        run_hugebench(argc, argv);
+        return 0;
+    }
+    if (getenv("MIPT_COLDSTART") != nullptr) coldstart_fd = atoi(getenv("MIPT_COLDSTART"));
+    huge_pending = page_mode == 1 && ab_source == nullptr && batch_file == nullptr && pack_file == nullptr &&
+                   gen_command == nullptr && gen_template == nullptr;
+    arena = mem = (char *) alloc_table(MEMSIZE, &mem_backing, !huge_pending);
+    if (huge_pending) preempt_at = HUGE_AFTER;
+    if (ab_source != nullptr) {
+        run_ab();
+        return 0;
+    }
+    if (stats || (perf && batch_file == nullptr)) atexit(print_stats);
+    if (pack_file != nullptr) {
+        run_pack();
+        return 0;
+    }
+    file_input();
+    source_hash = image_hash();
+    if (snapshot_dir == nullptr || !load_snapshot()) {
+        if (share_dir == nullptr || !map_shared_image()) {
+            if (lazy && share_dir == nullptr) lazy_assemble();
+            else assemble();
+            if (share_dir != nullptr) publish_image();
+        }
+    }
+    if (profile != nullptr) start_profile();
+    if (batch_file != nullptr) {
+        run_batch();
+        return 0;
+    }
+    if (gen_command != nullptr || gen_template != nullptr) {
+        run_complexity();
+        return 0;
+    }
+    if (trace_file != nullptr) start_trace();
     emulate();
 }
\ No newline at end of file
@@ -0,0 +1,181 @@
+/******************************************************************************
+     * File: result_store.h
+     * Description: memory-mapped, indexed store of batch job results
+     * Created: 19.10.2026
+
+******************************************************************************/
+
+/**
+ * Result store is one preallocated file written by batch runner of mipt32/mipt64 emulators:
+ *
+ *  header | index of fixed size entries, one per job | outputs of jobs
+ *
+ * Every job appends its output to data area and its entry keeps offset, length, exit status and counters.
+ * Readers map file and get outputs without copying:
+ *
+ *  result_store st;
+ *  if (store_open(st, "results.bin")) {
+ *      const char *out;
+ *      const store_entry *e = store_get(st, 5, &out);
+ *      if (e != nullptr) fwrite(out, 1, e->length, stdout);
+ *      store_close(st);
+ *  }
+*/
+
+#ifndef RESULT_STORE_H
+#define RESULT_STORE_H
+
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STORE_MAGIC "MIPTRES1"
+#define STORE_COUNTERS 5
+
+/**
+ * first bytes of store file
+ */
+struct store_header {
+    char magic[8]; /// STORE_MAGIC
+    uint64_t jobs; /// number of index entries
+    uint64_t data_offset; /// where outputs start in file
+    uint64_t capacity; /// bytes preallocated for outputs
+    uint64_t used; /// bytes of outputs taken, grows atomically. May exceed capacity if outputs didn't fit
+};
+
+/**
+ * index entry of job
+ */
+struct store_entry {
+    uint64_t offset; /// output position in data area
+    uint64_t length; /// output length
+    int32_t status; /// exit code of machine, -1 if it didn't exit normally
+    int32_t truncated; /// 1 if output didn't fit in store
+    uint64_t retired; /// executed instructions
+    uint64_t branches; /// executed branches
+    int64_t mismatch; /// offset of first output byte differing from expected output, -1 if none
+    int64_t counters[STORE_COUNTERS]; /// host cycles, instructions, branch misses, L1D and LLC misses, -1 if unknown
+};
+
+/**
+ * mapped store file
+ */
+struct result_store {
+    char *base = nullptr;
+    size_t size = 0;
+    store_header *header = nullptr;
+    store_entry *index = nullptr;
+    char *data = nullptr;
+};
+
+/**
+ * map store file and set pointers to its parts
+ */
+inline bool store_map(result_store &st, int fd, size_t size, bool writable) {
+    void *base = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+    st.base = (char *) base;
+    st.size = size;
+    st.header = (store_header *) base;
+    st.index = (store_entry *) (st.base + sizeof(store_header));
+    st.data = st.base + st.header->data_offset;
+    return true;
+}
+
+/**
+ * create store file with entries for jobs and capacity bytes for their outputs
+ * \param[path] - store file
+ * \param[jobs] - number of jobs
+ * \param[capacity] - bytes preallocated for outputs
+ */
+inline bool store_create(result_store &st, const char *path, uint64_t jobs, uint64_t capacity) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    uint64_t data_offset = (sizeof(store_header) + jobs * sizeof(store_entry) + 4095) / 4096 * 4096;
+    size_t size = data_offset + capacity;
+    if (posix_fallocate(fd, 0, size) != 0 && ftruncate(fd, size) != 0) {
+        close(fd);
+        return false;
+    }
+    store_header header = {};
+    memcpy(header.magic, STORE_MAGIC, 8);
+    header.jobs = jobs;
+    header.data_offset = data_offset;
+    header.capacity = capacity;
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        close(fd);
+        return false;
+    }
+    if (!store_map(st, fd, size, true)) return false;
+    for (uint64_t i = 0; i < jobs; i++) {
+        memset(st.index + i, 0, sizeof(store_entry));
+        st.index[i].status = -1;
+        st.index[i].mismatch = -1;
+        for (int k = 0; k < STORE_COUNTERS; k++) st.index[i].counters[k] = -1;
+    }
+    return true;
+}
+
+/**
+ * reserve space for output of length bytes in data area, safe to call from many processes
+ * \return offset of reserved space, length is cut down if output doesn't fit. When data area is full the
+ * offset is its end, so the entry with empty output is still valid
+ */
+inline uint64_t store_reserve(result_store &st, uint64_t &length) {
+    uint64_t offset = __atomic_fetch_add(&st.header->used, length, __ATOMIC_RELAXED);
+    if (offset >= st.header->capacity) {
+        length = 0;
+        offset = st.header->capacity;
+    } else if (offset + length > st.header->capacity) length = st.header->capacity - offset;
+    return offset;
+}
+
+/**
+ * map store file for reading. Index and data area are checked to lie inside file
+ */
+inline bool store_open(result_store &st, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(store_header)) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    if (!store_map(st, fd, info.st_size, false)) return false;
+    const store_header &h = *st.header;
+    if (memcmp(h.magic, STORE_MAGIC, 8) != 0 || h.jobs > (st.size - sizeof(store_header)) / sizeof(store_entry) ||
+        h.data_offset < sizeof(store_header) + h.jobs * sizeof(store_entry) || h.data_offset > st.size ||
+        h.capacity > st.size - h.data_offset) {
+        munmap(st.base, st.size);
+        st = result_store();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * get entry of job and pointer to its output inside mapped file
+ * \param[id] - number of job
+ * \param[output] - if not null, start of output is written here
+ * \return entry or null if there is no such job or its output isn't inside data area
+ */
+inline const store_entry *store_get(const result_store &st, uint64_t id, const char **output) {
+    if (st.header == nullptr || id >= st.header->jobs) return nullptr;
+    const store_entry *e = st.index + id;
+    if (e->offset > st.header->capacity || e->length > st.header->capacity - e->offset) return nullptr;
+    if (output != nullptr) *output = st.data + e->offset;
+    return e;
+}
+
+/**
+ * unmap store file
+ */
+inline void store_close(result_store &st) {
+    if (st.base != nullptr) munmap(st.base, st.size);
+    st = result_store();
+}
+
+#endif